@@ -0,0 +1,231 @@
+/***************************************************************************
+*
+*   bitmap_cache.c
+*
+*   Content-addressed cache of lossless bitmaps. Servers resend the same
+*   text runs and icons all the time (scrolling, menu redraws), so each
+*   payload is hashed and the converted pixels are kept, with a copy of
+*   the source to check hits against. A hit is drawn with a plain copy,
+*   and a hit at the place it was last drawn, with nothing drawn over it
+*   since, is skipped altogether.
+*
+****************************************************************************/
+
+#include "video_gl.h"
+
+#define PRIME32_1   0x9E3779B1U
+#define PRIME32_2   0x85EBCA77U
+#define PRIME32_3   0xC2B2AE3DU
+#define PRIME32_4   0x27D4EB2FU
+#define PRIME32_5   0x165667B1U
+
+#define ROTL32(x, r)    (((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline uint32_t round32(uint32_t acc, uint32_t lane)
+{
+    acc += lane * PRIME32_2;
+    acc = ROTL32(acc, 13);
+    return acc * PRIME32_1;
+}
+
+static inline uint32_t avalanche32(uint32_t h)
+{
+    h ^= h >> 15;
+    h *= PRIME32_2;
+    h ^= h >> 13;
+    h *= PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+/* XXH32-style hash of the visible pixels (rows may be padded), seeded
+ * with the size and format. Two differently finalised halves give a
+ * 64-bit key, so a compare against the source almost always succeeds.
+ */
+
+uint64_t bitmap_hash(struct image_buf *obj)
+{
+    uint32_t seed = (obj->width << 16) ^ obj->height ^ ((uint32_t)obj->pixel_format << 31);
+    uint32_t v1 = seed + PRIME32_1 + PRIME32_2;
+    uint32_t v2 = seed + PRIME32_2;
+    uint32_t v3 = seed;
+    uint32_t v4 = seed - PRIME32_1;
+    uint32_t tail = seed + PRIME32_5;
+    unsigned int x, y, width = obj->width;
+    uint32_t h1, h2;
+
+    for (y = 0; y < obj->height; y++) {
+        const uint32_t *row = (const uint32_t *)((const uint8_t *)obj->bits + (y * obj->stride));
+
+        for (x = 0; x + 4 <= width; x += 4) {
+            v1 = round32(v1, row[x]);
+            v2 = round32(v2, row[x + 1]);
+            v3 = round32(v3, row[x + 2]);
+            v4 = round32(v4, row[x + 3]);
+        }
+
+        for (; x < width; x++) {
+            tail += row[x] * PRIME32_3;
+            tail = ROTL32(tail, 17) * PRIME32_4;
+        }
+    }
+
+    h1 = ROTL32(v1, 1) + ROTL32(v2, 7) + ROTL32(v3, 12) + ROTL32(v4, 18) + tail;
+    h2 = (v1 ^ ROTL32(v3, 5)) + (v2 ^ ROTL32(v4, 11)) + (tail * PRIME32_1);
+
+    return ((uint64_t)avalanche32(h1) << 32) | avalanche32(h2 ^ h1);
+}
+
+void bitmap_cache_free(OMXH264_bitmap_cache *cache)
+{
+    int i;
+
+    if (cache->stats.lookups) {
+        DEBUG_TRACE("Bitmap cache: %llu lookups, %llu hits, %llu skipped, %llu collisions, %llu bytes saved\n",
+                    cache->stats.lookups, cache->stats.hits, cache->stats.skips,
+                    cache->stats.collisions, cache->stats.bytes_saved);
+    }
+
+    for (i = 0; i < BITMAP_CACHE_SLOTS; i++) {
+        free(cache->slots[i].pixels);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* Each entry holds the converted pixels and the source, in one block. */
+
+static size_t entry_size(int width, int height)
+{
+    return (size_t)width * height * 4 * 2;
+}
+
+static void evict(OMXH264_bitmap_cache *cache, OMXH264_bitmap *entry)
+{
+    cache->stats.bytes_used -= entry_size(entry->width, entry->height);
+    cache->stats.entries--;
+    free(entry->pixels);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static BOOL matches(OMXH264_bitmap *entry, uint64_t key, struct image_buf *obj)
+{
+    unsigned int y;
+
+    if (   entry->key != key
+        || entry->width != (int)obj->width
+        || entry->height != (int)obj->height
+        || entry->pixel_format != (int)obj->pixel_format) {
+        return FALSE;
+    }
+
+    for (y = 0; y < obj->height; y++) {
+        if (memcmp(entry->source + (y * obj->width),
+                   (const uint8_t *)obj->bits + (y * obj->stride), obj->width * 4)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Slots are probed linearly from the hash, at most BITMAP_CACHE_PROBE of
+ * them.
+ */
+
+OMXH264_bitmap *bitmap_cache_find(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj)
+{
+    int i;
+
+    cache->stats.lookups++;
+
+    for (i = 0; i < BITMAP_CACHE_PROBE; i++) {
+        OMXH264_bitmap *entry = &cache->slots[(key + i) % BITMAP_CACHE_SLOTS];
+
+        if (entry->pixels && entry->key == key) {
+            if (!matches(entry, key, obj)) {
+                cache->stats.collisions++;
+                continue;
+            }
+            entry->last_used = ++cache->clock;
+            cache->stats.hits++;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Add "obj" and its converted pixels. The least recently used entry in
+ * the probe window makes room, then the oldest overall until the cache is
+ * back within BITMAP_CACHE_BYTES. Returns NULL if not cached.
+ */
+
+OMXH264_bitmap *bitmap_cache_insert(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj,
+                                    const uint32_t *pixels, int stride)
+{
+    OMXH264_bitmap *entry = NULL;
+    int width = obj->width, height = obj->height;
+    size_t size = entry_size(width, height);
+    int i, y;
+
+    if ((size_t)width * height * 4 > BITMAP_CACHE_MAX_ENTRY) {
+        return NULL;
+    }
+
+    for (i = 0; i < BITMAP_CACHE_PROBE; i++) {
+        OMXH264_bitmap *slot = &cache->slots[(key + i) % BITMAP_CACHE_SLOTS];
+
+        if (!entry || !slot->pixels || (entry->pixels && slot->last_used < entry->last_used)) {
+            entry = slot;
+        }
+    }
+
+    if (entry->pixels) {
+        evict(cache, entry);
+    }
+
+    while (cache->stats.bytes_used + size > BITMAP_CACHE_BYTES) {
+        OMXH264_bitmap *oldest = NULL;
+
+        for (i = 0; i < BITMAP_CACHE_SLOTS; i++) {
+            if (cache->slots[i].pixels && (!oldest || cache->slots[i].last_used < oldest->last_used)) {
+                oldest = &cache->slots[i];
+            }
+        }
+        evict(cache, oldest);
+    }
+
+    entry->pixels = malloc(size);
+    if (!entry->pixels) {
+        return NULL;
+    }
+
+    entry->source = entry->pixels + (width * height);
+
+    for (y = 0; y < height; y++) {
+        memcpy(entry->pixels + (y * width), (const uint8_t *)pixels + (y * stride), width * 4);
+        memcpy(entry->source + (y * width), (const uint8_t *)obj->bits + (y * obj->stride), width * 4);
+    }
+
+    entry->key = key;
+    entry->width = width;
+    entry->height = height;
+    entry->pixel_format = obj->pixel_format;
+    entry->last_used = ++cache->clock;
+    cache->stats.bytes_used += size;
+    cache->stats.entries++;
+
+    return entry;
+}
+
+void bitmap_cache_add_stats(OMXH264_bitmap_cache *cache, struct ctxh264_bitmap_cache_stats *stats)
+{
+    stats->lookups += cache->stats.lookups;
+    stats->hits += cache->stats.hits;
+    stats->skips += cache->stats.skips;
+    stats->collisions += cache->stats.collisions;
+    stats->bytes_saved += cache->stats.bytes_saved;
+    stats->bytes_used += cache->stats.bytes_used;
+    stats->entries += cache->stats.entries;
+}
@@ -0,0 +1,196 @@
+/***************************************************************************
+*
+*   damage.c
+*
+*   Tile-granular damage tracking. Everything that changes the output
+*   (H.264 dirty rects, lossless text, small frames, deletes) marks the
+*   tiles it touches, and each present turns the marked tiles into a
+*   short list of rects for upload or blit. The number of pixels handed
+*   out is counted, giving a pixels-pushed-per-frame figure.
+*
+****************************************************************************/
+
+#include "video_gl.h"
+
+BOOL damage_init(OMXH264_damage *dmg, int width, int height)
+{
+    memset(dmg, 0, sizeof(*dmg));
+
+    dmg->width = width;
+    dmg->height = height;
+    dmg->tiles_x = (width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    dmg->tiles_y = (height + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    dmg->words_x = (dmg->tiles_x + 31) / 32;
+
+    dmg->bits = calloc(dmg->tiles_y * dmg->words_x, sizeof(uint32_t));
+    if (!dmg->bits) {
+        DEBUG_TRACE("Couldn't allocate %dx%d damage map\n", dmg->tiles_x, dmg->tiles_y);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void damage_free(OMXH264_damage *dmg)
+{
+    if (dmg->bits) {
+        DEBUG_TRACE("Damage: %llu pixels in %u presents\n", dmg->pixels, dmg->presents);
+        free(dmg->bits);
+        dmg->bits = NULL;
+    }
+}
+
+void damage_add(OMXH264_damage *dmg, SIGNED_RECT *rect)
+{
+    int left = max(rect->left, 0);
+    int top = max(rect->top, 0);
+    int right = min(rect->right, dmg->width);
+    int bottom = min(rect->bottom, dmg->height);
+    int tx, ty;
+
+    if (!dmg->bits || left >= right || top >= bottom) {
+        return;
+    }
+
+    for (ty = top / DAMAGE_TILE; ty <= (bottom - 1) / DAMAGE_TILE; ty++) {
+        uint32_t *row = dmg->bits + (ty * dmg->words_x);
+
+        for (tx = left / DAMAGE_TILE; tx <= (right - 1) / DAMAGE_TILE; tx++) {
+            row[tx / 32] |= 1U << (tx % 32);
+        }
+    }
+
+    dmg->empty = FALSE;
+}
+
+void damage_add_all(OMXH264_damage *dmg)
+{
+    SIGNED_RECT all = {0, 0, dmg->width, dmg->height};
+
+    damage_add(dmg, &all);
+}
+
+BOOL damage_empty(OMXH264_damage *dmg)
+{
+    int i;
+
+    if (!dmg->bits || dmg->empty) {
+        return TRUE;
+    }
+
+    for (i = 0; i < dmg->tiles_y * dmg->words_x; i++) {
+        if (dmg->bits[i]) {
+            return FALSE;
+        }
+    }
+
+    dmg->empty = TRUE;
+    return TRUE;
+}
+
+static inline BOOL tile_set(OMXH264_damage *dmg, int tx, int ty)
+{
+    return (dmg->bits[(ty * dmg->words_x) + (tx / 32)] >> (tx % 32)) & 1;
+}
+
+/* Turn the marked tiles into rects and clear them. Each row of tiles is
+ * split into runs, and a run is merged into the rect above it when it
+ * spans the same columns. If more than "max_rects" would be needed, the
+ * remainder is folded into the last rect. Returns the number of rects.
+ */
+
+int damage_rects(OMXH264_damage *dmg, SIGNED_RECT *rects, int max_rects)
+{
+    int n = 0;
+    int tx, ty, i;
+
+    if (damage_empty(dmg) || max_rects < 1) {
+        return 0;
+    }
+
+    for (ty = 0; ty < dmg->tiles_y; ty++) {
+        int top = ty * DAMAGE_TILE;
+        int bottom = min(top + DAMAGE_TILE, dmg->height);
+
+        for (tx = 0; tx < dmg->tiles_x; tx++) {
+            SIGNED_RECT run;
+            BOOL merged = FALSE;
+
+            if (!tile_set(dmg, tx, ty)) {
+                continue;
+            }
+
+            run.left = tx * DAMAGE_TILE;
+            while (tx + 1 < dmg->tiles_x && tile_set(dmg, tx + 1, ty)) {
+                tx++;
+            }
+            run.right = min((tx + 1) * DAMAGE_TILE, dmg->width);
+            run.top = top;
+            run.bottom = bottom;
+
+            /* Extend a rect from the previous row with the same span. */
+            for (i = 0; i < n; i++) {
+                if (rects[i].left == run.left && rects[i].right == run.right && rects[i].bottom == top) {
+                    rects[i].bottom = bottom;
+                    merged = TRUE;
+                    break;
+                }
+            }
+
+            if (merged) {
+                continue;
+            }
+
+            if (n < max_rects) {
+                rects[n++] = run;
+            } else {
+                SIGNED_RECT *last = &rects[max_rects - 1];
+
+                last->left = min(last->left, run.left);
+                last->top = min(last->top, run.top);
+                last->right = max(last->right, run.right);
+                last->bottom = max(last->bottom, run.bottom);
+            }
+        }
+    }
+
+    memset(dmg->bits, 0, dmg->tiles_y * dmg->words_x * sizeof(uint32_t));
+    dmg->empty = TRUE;
+
+    return n;
+}
+
+/* Count what a present actually pushed. */
+
+void damage_account(OMXH264_damage *dmg, SIGNED_RECT *rects, int num_rects)
+{
+    unsigned int pixels = 0;
+    int i;
+
+    for (i = 0; i < num_rects; i++) {
+        pixels += (rects[i].right - rects[i].left) * (rects[i].bottom - rects[i].top);
+    }
+
+    dmg->last_pixels = pixels;
+    dmg->pixels += pixels;
+    dmg->presents++;
+}
+
+/* For outputs that always redraw the whole frame. Returns TRUE, clearing
+ * the damage and counting the whole frame as pushed, if anything changed.
+ */
+
+BOOL damage_present_all(OMXH264_damage *dmg)
+{
+    SIGNED_RECT all = {0, 0, dmg->width, dmg->height};
+
+    if (damage_empty(dmg)) {
+        return FALSE;
+    }
+
+    memset(dmg->bits, 0, dmg->tiles_y * dmg->words_x * sizeof(uint32_t));
+    dmg->empty = TRUE;
+    damage_account(dmg, &all, 1);
+
+    return TRUE;
+}
@@ -0,0 +1,584 @@
+/***************************************************************************
+*
+*   overlay.c
+*
+*   ARGB overlay for lossless objects (text rects). Receiver's lossless
+*   draws are applied to a CPU copy of the overlay and the changed rows
+*   are written to a dispmanx element that sits above the video layer
+*   when the frame is pushed. In seamless mode there is no element and
+*   the overlay is blended into the composed frame instead.
+*
+****************************************************************************/
+
+#include "video_gl.h"
+#include "pixops.h"
+
+BOOL overlay_create(OMXH264_overlay *ov, int width, int height)
+{
+    memset(ov, 0, sizeof(*ov));
+
+    /* Keep the pitch a multiple of 16 pixels, which is what dispmanx uses
+     * for the resource, so rows can be written without repacking.
+     */
+    ov->width = width;
+    ov->height = height;
+    ov->stride = ((width + 15) & ~15) * 4;
+
+    ov->tiles_x = (width + OVERLAY_TILE - 1) / OVERLAY_TILE;
+    ov->tiles_y = (height + OVERLAY_TILE - 1) / OVERLAY_TILE;
+
+    ov->image = calloc(height, ov->stride);
+    ov->tiles = calloc(ov->tiles_y, ov->tiles_x);
+    ov->stamps = calloc(ov->tiles_y * ov->tiles_x, sizeof(uint32_t));
+    ov->fb_tiles = calloc(ov->tiles_y, ov->tiles_x);
+    if (!ov->image || !ov->tiles || !ov->stamps || !ov->fb_tiles || !damage_init(&ov->damage, width, height)) {
+        DEBUG_TRACE("Couldn't allocate %dx%d overlay\n", width, height);
+        overlay_destroy(ov);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Create the dispmanx element at "layer", scaled to "dst". Until this is
+ * called the overlay is CPU only. Set "opaque" first to ignore the
+ * source alpha.
+ */
+
+BOOL overlay_show(OMXH264_overlay *ov, DISPMANX_DISPLAY_HANDLE_T display, int layer, VC_RECT_T *dst)
+{
+    VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE, 255, 0};
+    VC_RECT_T src_rect;
+    VC_RECT_T rect;
+
+    if (!ov->image || ov->element) {
+        return FALSE;
+    }
+
+    ov->resource = vc_dispmanx_resource_create(VC_IMAGE_ARGB8888, ov->stride / 4, ov->height, &ov->vc_image_ptr);
+    if (!ov->resource) {
+        DEBUG_TRACE("Couldn't create overlay resource\n");
+        return FALSE;
+    }
+
+    vc_dispmanx_rect_set(&rect, 0, 0, ov->stride / 4, ov->height);
+    vc_dispmanx_resource_write_data(ov->resource, VC_IMAGE_ARGB8888, ov->stride, ov->image, &rect);
+
+    if (ov->opaque) {
+        alpha.flags = DISPMANX_FLAGS_ALPHA_FIXED_ALL_PIXELS;
+    }
+
+    DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
+    vc_dispmanx_rect_set(&src_rect, 0, 0, ov->width << 16, ov->height << 16);
+
+    ov->element = vc_dispmanx_element_add(update, display,
+                                          layer,
+                                          dst,
+                                          ov->resource,
+                                          &src_rect,
+                                          DISPMANX_PROTECTION_NONE,
+                                          &alpha,
+                                          NULL,
+                                          VC_IMAGE_ROT0);
+
+    vc_dispmanx_update_submit_sync(update);
+
+    return TRUE;
+}
+
+/* Follow the video element. Done as part of the caller's update so both
+ * move together.
+ */
+
+void overlay_move(OMXH264_overlay *ov, DISPMANX_UPDATE_HANDLE_T update, VC_RECT_T *dst)
+{
+    if (ov->element) {
+        vc_dispmanx_element_change_attributes(update, ov->element, 1 << 2, 0, 0, dst, NULL, 0, 0);
+    }
+}
+
+void overlay_destroy(OMXH264_overlay *ov)
+{
+    if (ov->element) {
+        DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
+        vc_dispmanx_element_remove(update, ov->element);
+        vc_dispmanx_update_submit_sync(update);
+        ov->element = 0;
+    }
+
+    if (ov->resource) {
+        vc_dispmanx_resource_delete(ov->resource);
+        ov->resource = 0;
+    }
+
+    if (ov->image) {
+        free(ov->image);
+        ov->image = NULL;
+    }
+
+    if (ov->tiles) {
+        free(ov->tiles);
+        ov->tiles = NULL;
+    }
+
+    if (ov->stamps) {
+        free(ov->stamps);
+        ov->stamps = NULL;
+    }
+
+    if (ov->fb_tiles) {
+        free(ov->fb_tiles);
+        ov->fb_tiles = NULL;
+    }
+
+    bitmap_cache_free(&ov->cache);
+
+    damage_free(&ov->damage);
+}
+
+/* Clip an object to the overlay. Returns FALSE if nothing is left. */
+
+static BOOL clip_object(OMXH264_overlay *ov, struct image_buf *obj, SIGNED_RECT *rect, int *src_x, int *src_y)
+{
+    rect->left = max(obj->dst_x, 0);
+    rect->top = max(obj->dst_y, 0);
+    rect->right = min(obj->dst_x + (int)obj->width, ov->width);
+    rect->bottom = min(obj->dst_y + (int)obj->height, ov->height);
+
+    *src_x = rect->left - obj->dst_x;
+    *src_y = rect->top - obj->dst_y;
+
+    return (rect->left < rect->right) && (rect->top < rect->bottom);
+}
+
+/* Every write goes through here. Besides the damage, the tiles written
+ * get a new stamp, which is returned, so a cached bitmap can tell whether
+ * anything has been drawn over it since.
+ */
+
+static uint32_t mark_dirty(OMXH264_overlay *ov, SIGNED_RECT *rect)
+{
+    uint32_t stamp = ++ov->stamp;
+    int tx, ty;
+
+    for (ty = rect->top / OVERLAY_TILE; ty * OVERLAY_TILE < rect->bottom; ty++) {
+        for (tx = rect->left / OVERLAY_TILE; tx * OVERLAY_TILE < rect->right; tx++) {
+            ov->stamps[(ty * ov->tiles_x) + tx] = stamp;
+        }
+    }
+
+    damage_add(&ov->damage, rect);
+
+    return stamp;
+}
+
+static BOOL stamps_match(OMXH264_overlay *ov, SIGNED_RECT *rect, uint32_t stamp)
+{
+    int tx, ty;
+
+    for (ty = rect->top / OVERLAY_TILE; ty * OVERLAY_TILE < rect->bottom; ty++) {
+        for (tx = rect->left / OVERLAY_TILE; tx * OVERLAY_TILE < rect->right; tx++) {
+            if (ov->stamps[(ty * ov->tiles_x) + tx] != stamp) {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/* Update the tile summary for "rect". Tiles that become used are always
+ * marked; a tile is only marked empty if "rect" covers all of it.
+ */
+
+static void mark_tiles(OMXH264_overlay *ov, SIGNED_RECT *rect, BOOL used)
+{
+    int tx, ty;
+
+    for (ty = rect->top / OVERLAY_TILE; ty * OVERLAY_TILE < rect->bottom; ty++) {
+        for (tx = rect->left / OVERLAY_TILE; tx * OVERLAY_TILE < rect->right; tx++) {
+            if (used) {
+                ov->tiles[(ty * ov->tiles_x) + tx] = 1;
+            } else if (rect->left <= tx * OVERLAY_TILE &&
+                       rect->top <= ty * OVERLAY_TILE &&
+                       rect->right >= min((tx + 1) * OVERLAY_TILE, ov->width) &&
+                       rect->bottom >= min((ty + 1) * OVERLAY_TILE, ov->height)) {
+                ov->tiles[(ty * ov->tiles_x) + tx] = 0;
+            }
+        }
+    }
+}
+
+/* IMAGE_OP_DRAW_LOSSLESS and IMAGE_OP_SMALL_FRAME_BITMAP. Text rects
+ * replace whatever is beneath them, so they are made opaque regardless of
+ * the alpha Receiver sent. Objects that fit entirely go through the
+ * bitmap cache.
+ */
+
+void overlay_draw(OMXH264_overlay *ov, struct image_buf *obj)
+{
+    SIGNED_RECT rect;
+    OMXH264_bitmap *entry = NULL;
+    uint32_t *dst;
+    int src_x, src_y, width, height;
+    unsigned int flags = PIXOPS_OPAQUE;
+    uint32_t stamp;
+
+    if (!ov->image || !obj->bits || !clip_object(ov, obj, &rect, &src_x, &src_y)) {
+        return;
+    }
+
+    if (PIXEL_FORMAT_BGRA == obj->pixel_format) {
+        flags |= PIXOPS_SWAP_BGRA;
+    }
+
+    dst = (uint32_t *)((uint8_t *)ov->image + (rect.top * ov->stride)) + rect.left;
+    width = rect.right - rect.left;
+    height = rect.bottom - rect.top;
+
+    if (width == (int)obj->width && height == (int)obj->height) {
+        uint64_t key = bitmap_hash(obj);
+
+        entry = bitmap_cache_find(&ov->cache, key, obj);
+        if (entry) {
+            if (entry->x == rect.left && entry->y == rect.top && stamps_match(ov, &rect, entry->stamp)) {
+                /* Still on screen, untouched. */
+                ov->cache.stats.skips++;
+                return;
+            }
+
+            pixops_copy_argb(dst, ov->stride, entry->pixels, width * 4, width, height, 0);
+            ov->cache.stats.bytes_saved += width * height * 4;
+        } else {
+            pixops_copy_argb(dst, ov->stride, obj->bits, obj->stride, width, height, flags);
+            entry = bitmap_cache_insert(&ov->cache, key, obj, dst, ov->stride);
+        }
+    } else {
+        pixops_copy_argb(dst, ov->stride,
+                         (uint8_t *)obj->bits + (src_y * obj->stride) + (src_x * 4), obj->stride,
+                         width, height, flags);
+    }
+
+    mark_tiles(ov, &rect, TRUE);
+    stamp = mark_dirty(ov, &rect);
+
+    if (entry) {
+        entry->x = rect.left;
+        entry->y = rect.top;
+        entry->stamp = stamp;
+    }
+}
+
+/* IMAGE_OP_DELETE_LOSSLESS: make the area transparent again. */
+
+void overlay_erase(OMXH264_overlay *ov, struct image_buf *obj)
+{
+    SIGNED_RECT rect;
+    int src_x, src_y;
+
+    if (!ov->image || !clip_object(ov, obj, &rect, &src_x, &src_y)) {
+        return;
+    }
+
+    pixops_fill((uint32_t *)((uint8_t *)ov->image + (rect.top * ov->stride)) + rect.left, ov->stride,
+                rect.right - rect.left, rect.bottom - rect.top, 0);
+
+    mark_tiles(ov, &rect, FALSE);
+    mark_dirty(ov, &rect);
+}
+
+/* IMAGE_OP_SMALL_FRAME_SOLID_FILL, "col" being RGB. */
+
+void overlay_fill(OMXH264_overlay *ov, struct image_buf *obj)
+{
+    SIGNED_RECT rect;
+    int src_x, src_y;
+
+    if (!ov->image || !clip_object(ov, obj, &rect, &src_x, &src_y)) {
+        return;
+    }
+
+    pixops_fill((uint32_t *)((uint8_t *)ov->image + (rect.top * ov->stride)) + rect.left, ov->stride,
+                rect.right - rect.left, rect.bottom - rect.top, 0xff000000 | obj->col);
+
+    mark_tiles(ov, &rect, TRUE);
+    mark_dirty(ov, &rect);
+}
+
+/* Make the whole overlay transparent, touching only the tiles in use. */
+
+void overlay_clear(OMXH264_overlay *ov)
+{
+    int tx, ty;
+
+    if (!ov->image) {
+        return;
+    }
+
+    for (ty = 0; ty < ov->tiles_y; ty++) {
+        for (tx = 0; tx < ov->tiles_x; tx++) {
+            if (ov->tiles[(ty * ov->tiles_x) + tx]) {
+                SIGNED_RECT t;
+
+                t.left = tx * OVERLAY_TILE;
+                t.top = ty * OVERLAY_TILE;
+                t.right = min(t.left + OVERLAY_TILE, ov->width);
+                t.bottom = min(t.top + OVERLAY_TILE, ov->height);
+
+                pixops_fill((uint32_t *)((uint8_t *)ov->image + (t.top * ov->stride)) + t.left, ov->stride,
+                            t.right - t.left, t.bottom - t.top, 0);
+                ov->tiles[(ty * ov->tiles_x) + tx] = 0;
+                mark_dirty(ov, &t);
+            }
+        }
+    }
+}
+
+/* Bring one tile's worth ("t", within a single tile) of the overlay up to
+ * date with the lossless frame buffer. Only the non-transparent part of
+ * the source is copied unless the tile held something before, in which
+ * case the rest has to be cleared too. Returns TRUE if the source had
+ * anything to show in "t".
+ */
+
+static BOOL compose_fb_tile(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT *t)
+{
+    unsigned char *used = &ov->tiles[((t->top / OVERLAY_TILE) * ov->tiles_x) + (t->left / OVERLAY_TILE)];
+    uint32_t mask = (PIXEL_FORMAT_BGRA == fb->pixel_format) ? 0x000000ff : 0xff000000;
+    unsigned int flags = (PIXEL_FORMAT_BGRA == fb->pixel_format) ? PIXOPS_SWAP_BGRA : 0;
+    SIGNED_RECT box = {t->right, t->bottom, t->left, t->top};
+    SIGNED_RECT *out;
+    int y, first, last;
+
+    for (y = t->top; y < t->bottom; y++) {
+        const uint32_t *row = (const uint32_t *)((uint8_t *)fb->bits + (y * fb->stride)) + t->left;
+
+        if (pixops_alpha_span(row, t->right - t->left, mask, &first, &last)) {
+            box.left = min(box.left, t->left + first);
+            box.right = max(box.right, t->left + last + 1);
+            box.top = min(box.top, y);
+            box.bottom = y + 1;
+        }
+    }
+
+    if (box.left >= box.right) {
+        /* Nothing to show here. */
+        if (!*used) {
+            return FALSE;
+        }
+        pixops_fill((uint32_t *)((uint8_t *)ov->image + (t->top * ov->stride)) + t->left, ov->stride,
+                    t->right - t->left, t->bottom - t->top, 0);
+        mark_tiles(ov, t, FALSE);
+        out = t;
+    } else {
+        out = *used ? t : &box;
+        pixops_copy_argb((uint32_t *)((uint8_t *)ov->image + (out->top * ov->stride)) + out->left, ov->stride,
+                         (uint8_t *)fb->bits + (out->top * fb->stride) + (out->left * 4), fb->stride,
+                         out->right - out->left, out->bottom - out->top, flags);
+        *used = 1;
+    }
+
+    mark_dirty(ov, out);
+
+    return box.left < box.right;
+}
+
+/* The source summary: what the last scan of each tile of the lossless
+ * frame buffer found.
+ */
+
+#define FB_TILE_UNKNOWN     0
+#define FB_TILE_EMPTY       1
+#define FB_TILE_USED        2
+
+static void forget_fb_tiles(OMXH264_overlay *ov, SIGNED_RECT *rect)
+{
+    int tx, ty;
+
+    for (ty = max(rect->top, 0) / OVERLAY_TILE; ty < ov->tiles_y && ty * OVERLAY_TILE < rect->bottom; ty++) {
+        for (tx = max(rect->left, 0) / OVERLAY_TILE; tx < ov->tiles_x && tx * OVERLAY_TILE < rect->right; tx++) {
+            ov->fb_tiles[(ty * ov->tiles_x) + tx] = FB_TILE_UNKNOWN;
+        }
+    }
+}
+
+/* compose_with_fb(): take the areas of "rects" from the lossless frame
+ * buffer. The buffer is scanned for alpha a tile at a time, so mostly
+ * transparent areas cost a read and nothing more.
+ */
+
+void overlay_compose_fb(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT rects[], unsigned int num_rects)
+{
+    unsigned int i;
+    int tx, ty;
+    int width = min(ov->width, (int)fb->width);
+    int height = min(ov->height, (int)fb->height);
+
+    if (!ov->image || !fb->bits) {
+        return;
+    }
+
+    for (i = 0; i < num_rects; i++) {
+        SIGNED_RECT r;
+
+        r.left = max(rects[i].left, 0);
+        r.top = max(rects[i].top, 0);
+        r.right = min(rects[i].right, width);
+        r.bottom = min(rects[i].bottom, height);
+
+        for (ty = r.top / OVERLAY_TILE; ty * OVERLAY_TILE < r.bottom; ty++) {
+            for (tx = r.left / OVERLAY_TILE; tx * OVERLAY_TILE < r.right; tx++) {
+                SIGNED_RECT t;
+
+                t.left = max(r.left, tx * OVERLAY_TILE);
+                t.top = max(r.top, ty * OVERLAY_TILE);
+                t.right = min(r.right, (tx + 1) * OVERLAY_TILE);
+                t.bottom = min(r.bottom, (ty + 1) * OVERLAY_TILE);
+
+                if (compose_fb_tile(ov, fb, &t)) {
+                    ov->fb_tiles[(ty * ov->tiles_x) + tx] = FB_TILE_USED;
+                } else if (t.left == tx * OVERLAY_TILE && t.top == ty * OVERLAY_TILE &&
+                           t.right == min((tx + 1) * OVERLAY_TILE, width) &&
+                           t.bottom == min((ty + 1) * OVERLAY_TILE, height)) {
+                    ov->fb_tiles[(ty * ov->tiles_x) + tx] = FB_TILE_EMPTY;
+                }
+            }
+        }
+    }
+}
+
+/* compose_with_fb() without interesting rects: the whole buffer, but
+ * tiles the last scan found empty are skipped unless one of the "changed"
+ * rects covers them. A frame with no dirty rects says nothing about where
+ * text may have appeared, so a row of the empty tiles is checked again on
+ * each call as well; the whole buffer is covered every tiles_y calls.
+ */
+
+void overlay_compose_fb_tiles(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT changed[], unsigned int num_changed)
+{
+    unsigned int i;
+    int tx, ty;
+    int width = min(ov->width, (int)fb->width);
+    int height = min(ov->height, (int)fb->height);
+
+    if (!ov->image || !fb->bits) {
+        return;
+    }
+
+    if (fb->bits != ov->fb_bits || fb->stride != ov->fb_stride) {
+        /* A different buffer: nothing is known about it. */
+        memset(ov->fb_tiles, FB_TILE_UNKNOWN, ov->tiles_x * ov->tiles_y);
+        ov->fb_bits = fb->bits;
+        ov->fb_stride = fb->stride;
+    }
+
+    for (i = 0; i < num_changed; i++) {
+        forget_fb_tiles(ov, &changed[i]);
+    }
+
+    for (tx = 0; tx < ov->tiles_x; tx++) {
+        unsigned char *state = &ov->fb_tiles[(ov->fb_refresh * ov->tiles_x) + tx];
+
+        if (FB_TILE_EMPTY == *state) {
+            *state = FB_TILE_UNKNOWN;
+        }
+    }
+    ov->fb_refresh = (ov->fb_refresh + 1) % ov->tiles_y;
+
+    for (ty = 0; ty * OVERLAY_TILE < height; ty++) {
+        for (tx = 0; tx * OVERLAY_TILE < width; tx++) {
+            unsigned char *state = &ov->fb_tiles[(ty * ov->tiles_x) + tx];
+            SIGNED_RECT t;
+
+            if (FB_TILE_EMPTY == *state) {
+                continue;
+            }
+
+            t.left = tx * OVERLAY_TILE;
+            t.top = ty * OVERLAY_TILE;
+            t.right = min(t.left + OVERLAY_TILE, width);
+            t.bottom = min(t.top + OVERLAY_TILE, height);
+
+            *state = compose_fb_tile(ov, fb, &t) ? FB_TILE_USED : FB_TILE_EMPTY;
+        }
+    }
+}
+
+/* Write the damaged areas to the element. dispmanx only transfers whole
+ * rows, so each distinct band of damaged rows is written once. The areas
+ * are also marked in "changed", if given, for outputs that compose the
+ * overlay themselves. "flushed", if set, is called once the update has
+ * been applied. Returns the number of rects that were damaged.
+ */
+
+int overlay_flush(OMXH264_overlay *ov, OMXH264_damage *changed)
+{
+    SIGNED_RECT rects[DAMAGE_MAX_RECTS];
+    int i, n = damage_rects(&ov->damage, rects, DAMAGE_MAX_RECTS);
+
+    if (!n) {
+        return 0;
+    }
+
+    damage_account(&ov->damage, rects, n);
+
+    if (ov->element) {
+        DISPMANX_UPDATE_HANDLE_T update;
+        VC_RECT_T rect;
+        int top = rects[0].top, bottom = rects[0].bottom;
+
+        /* Rects come out ordered by their top edge. */
+        for (i = 1; i <= n; i++) {
+            if (i < n && rects[i].top <= bottom) {
+                bottom = max(bottom, rects[i].bottom);
+                continue;
+            }
+
+            vc_dispmanx_rect_set(&rect, 0, top, ov->stride / 4, bottom - top);
+            vc_dispmanx_resource_write_data(ov->resource, VC_IMAGE_ARGB8888, ov->stride, ov->image, &rect);
+
+            if (i < n) {
+                top = rects[i].top;
+                bottom = rects[i].bottom;
+            }
+        }
+
+        /* Don't wait for vsync, the next frame's draws go to the CPU copy. */
+        vc_dispmanx_rect_set(&rect, 0, 0, ov->width, ov->height);
+        update = vc_dispmanx_update_start(0);
+        vc_dispmanx_element_modified(update, ov->element, &rect);
+        vc_dispmanx_update_submit(update, ov->flushed, ov->flushed_arg);
+    }
+
+    if (changed) {
+        for (i = 0; i < n; i++) {
+            damage_add(changed, &rects[i]);
+        }
+    }
+
+    return n;
+}
+
+/* Seamless: blend the overlay over "rect" of a composed XRGB frame. */
+
+void overlay_compose(OMXH264_overlay *ov, void *dst, int dst_stride, SIGNED_RECT *rect)
+{
+    SIGNED_RECT r;
+
+    if (!ov->image) {
+        return;
+    }
+
+    r.left = max(rect->left, 0);
+    r.top = max(rect->top, 0);
+    r.right = min(rect->right, ov->width);
+    r.bottom = min(rect->bottom, ov->height);
+
+    if (r.left >= r.right || r.top >= r.bottom) {
+        return;
+    }
+
+    pixops_blend((uint32_t *)((uint8_t *)dst + (r.top * dst_stride)) + r.left, dst_stride,
+                 (uint32_t *)((uint8_t *)ov->image + (r.top * ov->stride)) + r.left, ov->stride,
+                 r.right - r.left, r.bottom - r.top, 0);
+}
@@ -0,0 +1,538 @@
+/***************************************************************************
+*
+*   pixopstest.c
+*
+*   Checks the pixops kernels against their scalar references and times
+*   them. Each kernel is run over odd widths, strides and alignments with
+*   every combination of its flags, and the blend is checked exhaustively
+*   over alpha, source and destination values for each implementation
+*   this CPU can run. Throughput is then reported in MPix/s, and cursor
+*   conversion in microseconds for 64x64 and 128x128 cursors.
+*
+*   Usage: pixopstest [-b]     (-b: benchmarks only)
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pixops.h"
+
+#define MAX_WIDTH       67
+#define MAX_HEIGHT      5
+#define PAD             8               /* Pixels around each block. */
+
+#define BENCH_WIDTH     1920
+#define BENCH_HEIGHT    1080
+#define BENCH_SECONDS   0.2
+
+static const char *blend_impls[] = { "c", "neon", "sse2", "avx2" };
+
+#define NUM_IMPLS       (int)(sizeof(blend_impls) / sizeof(blend_impls[0]))
+
+static int failures;
+
+static uint32_t random_pixel(void)
+{
+    static uint32_t state = 0x12345678;
+
+    /* xorshift32, so the results do not depend on the C library. */
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+static void fill_random(uint32_t *buf, size_t n)
+{
+    while (n--) {
+        *buf++ = random_pixel();
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+static void check(int ok, const char *what, int width, int height, unsigned int flags, const char *impl)
+{
+    if (!ok) {
+        printf("FAIL %s %dx%d flags 0x%x%s%s\n", what, width, height, flags,
+               impl ? " impl " : "", impl ? impl : "");
+        failures++;
+    }
+}
+
+/***************************************************************************
+*
+*   Correctness.
+*
+****************************************************************************/
+
+/* XFixes cursor images: one "unsigned long" per pixel, 8 bytes on 64-bit
+ * hosts, where the upper half must be ignored. The destination is padded
+ * to 16-pixel multiples, or more, and whatever is beyond the image must
+ * be cleared. It may also be smaller than the image, which is then cut.
+ */
+
+static void test_cursor(void)
+{
+    static unsigned long src[MAX_WIDTH * MAX_WIDTH];
+    static uint32_t out[(MAX_WIDTH + 32) * (MAX_WIDTH + 32)];
+    static uint32_t ref[(MAX_WIDTH + 32) * (MAX_WIDTH + 32)];
+    unsigned int flags;
+    int width, height, extra, x, y, i;
+
+    for (flags = 0; flags <= PIXOPS_PREMULTIPLY; flags += PIXOPS_PREMULTIPLY) {
+        for (width = 1; width <= MAX_WIDTH; width++) {
+            for (height = 1; height <= MAX_WIDTH; height += 11) {
+                for (extra = -16; extra <= 16; extra += 16) {
+                    int dst_width = ((width + 15) & ~15) + extra;
+                    int dst_height = ((height + 15) & ~15) + extra;
+                    int columns, rows, ok = 1;
+
+                    if (extra < 0) {
+                        /* Smaller than the image, by up to 16. */
+                        dst_width = width > 16 ? width - 1 - (width % 16) : 1;
+                        dst_height = height > 16 ? height - 1 - (height % 16) : 1;
+                    }
+                    columns = width < dst_width ? width : dst_width;
+                    rows = height < dst_height ? height : dst_height;
+
+                    for (i = 0; i < width * height; i++) {
+                        src[i] = random_pixel();
+                        if (i % 5 == 0) {
+                            src[i] &= 0x00ffffff;   /* Clear. */
+                        } else if (i % 5 == 1) {
+                            src[i] |= 0xff000000;   /* Opaque. */
+                        }
+#if ULONG_MAX > 0xffffffffUL
+                        src[i] |= (unsigned long)random_pixel() << 32;
+#endif
+                    }
+                    fill_random(out, sizeof(out) / 4);
+                    memcpy(ref, out, sizeof(out));
+
+                    pixops_cursor_argb(out, dst_width, dst_height, src, width, height, flags);
+                    pixops_cursor_argb_c(ref, dst_width, dst_height, src, width, height, flags);
+
+                    for (y = 0; y < dst_height && ok; y++) {
+                        for (x = 0; x < dst_width; x++) {
+                            uint32_t p = out[(y * dst_width) + x];
+
+                            if (x >= columns || y >= rows) {
+                                ok = ok && (p == 0);
+                            } else if (!(flags & PIXOPS_PREMULTIPLY)) {
+                                ok = ok && (p == (uint32_t)src[(y * width) + x]);
+                            }
+                        }
+                    }
+                    check(ok && !memcmp(out, ref, sizeof(out)), "cursor_argb", width, height, flags, NULL);
+                }
+            }
+        }
+    }
+}
+
+/* Copies with flags from PIXOPS_SWAP_BGRA and PIXOPS_OPAQUE, the source
+ * and destination at different alignments with padded strides.
+ */
+
+static void test_copy(void)
+{
+    static uint32_t src[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    static uint32_t out[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    static uint32_t ref[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    unsigned int flags;
+    int width, height, offset;
+
+    for (flags = 0; flags < 4; flags++) {
+        unsigned int f = ((flags & 1) ? PIXOPS_SWAP_BGRA : 0) | ((flags & 2) ? PIXOPS_OPAQUE : 0);
+
+        for (width = 0; width <= MAX_WIDTH; width++) {
+            for (height = 1; height <= MAX_HEIGHT; height += 2) {
+                for (offset = 0; offset < 4; offset++) {
+                    int stride = (width + offset + 1) * 4;
+
+                    fill_random(src, sizeof(src) / 4);
+                    fill_random(out, sizeof(out) / 4);
+                    memcpy(ref, out, sizeof(out));
+
+                    pixops_copy_argb(out + offset, stride + 4, src + 3 - offset, stride, width, height, f);
+                    pixops_copy_argb_c(ref + offset, stride + 4, src + 3 - offset, stride, width, height, f);
+                    check(!memcmp(out, ref, sizeof(out)), "copy_argb", width, height, f, NULL);
+                }
+            }
+        }
+    }
+}
+
+static void test_fill(void)
+{
+    static uint32_t out[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    static uint32_t ref[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    int width, height, offset;
+
+    for (width = 0; width <= MAX_WIDTH; width++) {
+        for (height = 1; height <= MAX_HEIGHT; height += 2) {
+            for (offset = 0; offset < 4; offset++) {
+                uint32_t value = random_pixel();
+                int stride = (width + offset + 3) * 4;
+
+                fill_random(out, sizeof(out) / 4);
+                memcpy(ref, out, sizeof(out));
+
+                pixops_fill(out + offset, stride, width, height, value);
+                pixops_fill_c(ref + offset, stride, width, height, value);
+                check(!memcmp(out, ref, sizeof(out)), "fill", width, height, 0, NULL);
+            }
+        }
+    }
+}
+
+/* Overlapping moves in both directions, as copy_rect does them. */
+
+static void test_move(void)
+{
+    static uint32_t out[(MAX_HEIGHT + 8) * (MAX_WIDTH + PAD)];
+    static uint32_t ref[(MAX_HEIGHT + 8) * (MAX_WIDTH + PAD)];
+    int stride = (MAX_WIDTH + PAD) * 4;
+    int width, height, dx, dy;
+
+    for (width = 0; width <= MAX_WIDTH; width++) {
+        for (height = 1; height <= MAX_HEIGHT; height += 2) {
+            for (dy = -2; dy <= 2; dy++) {
+                for (dx = -5; dx <= 5; dx += 2) {
+                    int origin = (3 * (MAX_WIDTH + PAD)) + (PAD / 2);
+                    int moved = origin + (dy * (MAX_WIDTH + PAD)) + dx;
+
+                    fill_random(out, sizeof(out) / 4);
+                    memcpy(ref, out, sizeof(out));
+
+                    pixops_move(out + moved, stride, out + origin, stride, width, height);
+                    pixops_move_c(ref + moved, stride, ref + origin, stride, width, height);
+                    check(!memcmp(out, ref, sizeof(out)), "move", width, height, 0, NULL);
+                }
+            }
+        }
+    }
+}
+
+/* Rows with a few set pixels, in both ARGB and BGRA alpha positions. */
+
+static void test_alpha_span(void)
+{
+    static uint32_t row[MAX_WIDTH * 4];
+    static const uint32_t masks[] = { 0xff000000, 0x000000ff };
+    int width, i, m;
+
+    for (m = 0; m < 2; m++) {
+        for (width = 0; width <= (int)(sizeof(row) / 4); width++) {
+            for (i = 0; i < 40; i++) {
+                int first = -1, last = -1, ref_first = -1, ref_last = -1, n, found, ref_found;
+
+                memset(row, 0, sizeof(row));
+                for (n = i % 4; n > 0 && width > 0; n--) {
+                    row[random_pixel() % width] = random_pixel() | masks[m];
+                }
+                /* Bits outside the mask must not count. */
+                for (n = 0; n < width; n += 3) {
+                    row[n] |= random_pixel() & ~masks[m];
+                }
+
+                found = pixops_alpha_span(row, width, masks[m], &first, &last);
+                ref_found = pixops_alpha_span_c(row, width, masks[m], &ref_first, &ref_last);
+                check(found == ref_found && first == ref_first && last == ref_last,
+                      "alpha_span", width, 1, masks[m], NULL);
+            }
+        }
+    }
+}
+
+/* Odd widths, strides and alignments, with random pixels. */
+
+static void test_blend_blocks(const char *impl, unsigned int flags)
+{
+    static uint32_t src[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    static uint32_t out[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    static uint32_t ref[(MAX_HEIGHT + 1) * (MAX_WIDTH + PAD)];
+    int width, height, offset, i;
+
+    for (width = 0; width <= MAX_WIDTH; width++) {
+        for (height = 1; height <= MAX_HEIGHT; height += 2) {
+            for (offset = 0; offset < 4; offset++) {
+                int stride = (width + offset + 1) * 4;
+
+                fill_random(src, sizeof(src) / 4);
+                fill_random(out, sizeof(out) / 4);
+                /* Plenty of the fully clear and opaque special cases. */
+                for (i = 0; i < (int)(sizeof(src) / 4); i += 3) {
+                    src[i] = (i & 1) ? (src[i] | 0xff0000ff) : (src[i] & 0x00ffff00);
+                }
+                memcpy(ref, out, sizeof(out));
+
+                pixops_blend(out + offset, stride + 4, src + 3 - offset, stride, width, height, flags);
+                pixops_blend_c(ref + offset, stride + 4, src + 3 - offset, stride, width, height, flags);
+                check(!memcmp(out, ref, sizeof(out)), "blend", width, height, flags, impl);
+            }
+        }
+    }
+}
+
+/* Every source alpha against every source and destination channel value.
+ * Premultiplied sources have colour no greater than alpha.
+ */
+
+static void test_blend_exhaustive(const char *impl, unsigned int flags)
+{
+    static uint32_t src[256], out[256], ref[256];
+    int a, s, d, bad = 0;
+    int alpha_shift = (flags & PIXOPS_SWAP_BGRA) ? 0 : 24;
+
+    for (a = 0; a < 256 && !bad; a++) {
+        for (s = 0; s < 256 && !bad; s++) {
+            int c = (flags & PIXOPS_PREMULTIPLIED) ? (s * a) / 255 : s;
+            uint32_t colour;
+
+            /* The same value in each colour channel of the source, and
+             * 0..255 in each channel of the destination across the row.
+             */
+            colour = (flags & PIXOPS_SWAP_BGRA) ? ((uint32_t)c * 0x01010100) : ((uint32_t)c * 0x00010101);
+            for (d = 0; d < 256; d++) {
+                src[d] = ((uint32_t)a << alpha_shift) | colour;
+                out[d] = ref[d] = ((uint32_t)(255 - d) << 24) | ((uint32_t)d * 0x00010101);
+            }
+
+            pixops_blend(out, sizeof(out), src, sizeof(src), 256, 1, flags);
+            pixops_blend_c(ref, sizeof(ref), src, sizeof(src), 256, 1, flags);
+            if (memcmp(out, ref, sizeof(out))) {
+                printf("FAIL blend exhaustive alpha %d source %d flags 0x%x impl %s\n", a, c, flags, impl);
+                failures++;
+                bad = 1;
+            }
+        }
+    }
+}
+
+static void test_blend(void)
+{
+    unsigned int flags;
+    int i;
+
+    for (i = 0; i < NUM_IMPLS; i++) {
+        if (!pixops_blend_use(blend_impls[i])) {
+            continue;
+        }
+        for (flags = 0; flags < 4; flags++) {
+            unsigned int f = ((flags & 1) ? PIXOPS_SWAP_BGRA : 0) | ((flags & 2) ? PIXOPS_PREMULTIPLIED : 0);
+
+            test_blend_blocks(blend_impls[i], f);
+            test_blend_exhaustive(blend_impls[i], f);
+        }
+        printf("blend %s: checked\n", blend_impls[i]);
+    }
+}
+
+/***************************************************************************
+*
+*   Benchmarks, in MPix/s over a 1080p frame.
+*
+****************************************************************************/
+
+typedef void (*BENCH_FN)(uint32_t *dst, uint32_t *src, unsigned int flags);
+
+static void bench_copy(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_copy_argb(dst, BENCH_WIDTH * 4, src, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT, flags);
+}
+
+static void bench_copy_c(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_copy_argb_c(dst, BENCH_WIDTH * 4, src, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT, flags);
+}
+
+static void bench_fill(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_fill(dst, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT, 0x80402010);
+}
+
+static void bench_fill_c(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_fill_c(dst, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT, 0x80402010);
+}
+
+/* Scrolling up by one row, in place. */
+
+static void bench_move(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_move(dst, BENCH_WIDTH * 4, dst + BENCH_WIDTH, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT - 1);
+}
+
+static void bench_move_c(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_move_c(dst, BENCH_WIDTH * 4, dst + BENCH_WIDTH, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT - 1);
+}
+
+/* A mostly transparent frame, as composed text usually is. */
+
+static void bench_span(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    int y, first, last;
+
+    for (y = 0; y < BENCH_HEIGHT; y++) {
+        pixops_alpha_span(src + (y * BENCH_WIDTH), BENCH_WIDTH, 0xff000000, &first, &last);
+    }
+}
+
+static void bench_span_c(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    int y, first, last;
+
+    for (y = 0; y < BENCH_HEIGHT; y++) {
+        pixops_alpha_span_c(src + (y * BENCH_WIDTH), BENCH_WIDTH, 0xff000000, &first, &last);
+    }
+}
+
+static void bench_blend(uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    pixops_blend(dst, BENCH_WIDTH * 4, src, BENCH_WIDTH * 4, BENCH_WIDTH, BENCH_HEIGHT, flags);
+}
+
+static double mpix_per_second(BENCH_FN fn, uint32_t *dst, uint32_t *src, unsigned int flags)
+{
+    double start = now(), elapsed;
+    int runs = 0;
+
+    do {
+        fn(dst, src, flags);
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return ((double)runs * BENCH_WIDTH * BENCH_HEIGHT) / (elapsed * 1e6);
+}
+
+/* Shape changes of large cursors, in microseconds per conversion. */
+
+static void benchmark_cursor(void)
+{
+    static unsigned long src[128 * 128];
+    static uint32_t out[128 * 128];
+    int size, i;
+
+    for (i = 0; i < 128 * 128; i++) {
+        src[i] = random_pixel();
+    }
+
+    printf("\n%-24s %10s %10s\n", "cursor_argb premultiply", "us", "scalar");
+    for (size = 64; size <= 128; size *= 2) {
+        double start, simd, scalar;
+        int runs;
+
+        start = now();
+        for (runs = 0; now() - start < BENCH_SECONDS; runs++) {
+            pixops_cursor_argb(out, size, size, src, size - 3, size - 3, PIXOPS_PREMULTIPLY);
+        }
+        simd = (now() - start) * 1e6 / runs;
+
+        start = now();
+        for (runs = 0; now() - start < BENCH_SECONDS; runs++) {
+            pixops_cursor_argb_c(out, size, size, src, size - 3, size - 3, PIXOPS_PREMULTIPLY);
+        }
+        scalar = (now() - start) * 1e6 / runs;
+
+        printf("%3dx%-20d %10.2f %10.2f\n", size, size, simd, scalar);
+    }
+}
+
+static void benchmark(void)
+{
+    static const struct {
+        const char  *name;
+        BENCH_FN    fn, ref;
+        unsigned int flags;
+    } kernels[] = {
+        { "copy_argb swap",     bench_copy,  bench_copy_c,  PIXOPS_SWAP_BGRA },
+        { "copy_argb opaque",   bench_copy,  bench_copy_c,  PIXOPS_OPAQUE },
+        { "fill",               bench_fill,  bench_fill_c,  0 },
+        { "move",               bench_move,  bench_move_c,  0 },
+        { "alpha_span",         bench_span,  bench_span_c,  0 },
+    };
+    size_t pixels = BENCH_WIDTH * BENCH_HEIGHT;
+    uint32_t *src = malloc(pixels * 4);
+    uint32_t *dst = malloc(pixels * 4);
+    unsigned int flags;
+    int i;
+
+    if (!src || !dst) {
+        return;
+    }
+
+    fill_random(src, pixels);
+    fill_random(dst, pixels);
+
+    printf("\n%-24s %10s %10s\n", "kernel (1920x1080)", "MPix/s", "scalar");
+    for (i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+        if (kernels[i].fn == bench_span) {
+            /* One short run of text per 32 rows. */
+            memset(src, 0, pixels * 4);
+            for (flags = 0; flags < BENCH_HEIGHT; flags += 32) {
+                memset(src + (flags * BENCH_WIDTH) + 700, 0xff, 200 * 4);
+            }
+        }
+        printf("%-24s %10.1f %10.1f\n", kernels[i].name,
+               mpix_per_second(kernels[i].fn, dst, src, kernels[i].flags),
+               mpix_per_second(kernels[i].ref, dst, src, kernels[i].flags));
+    }
+
+    fill_random(src, pixels);
+    for (i = 0; i < NUM_IMPLS; i++) {
+        if (!pixops_blend_use(blend_impls[i])) {
+            continue;
+        }
+        for (flags = 0; flags < 4; flags++) {
+            unsigned int f = ((flags & 1) ? PIXOPS_SWAP_BGRA : 0) | ((flags & 2) ? PIXOPS_PREMULTIPLIED : 0);
+            char name[40];
+
+            snprintf(name, sizeof(name), "blend %s%s%s", blend_impls[i],
+                     (f & PIXOPS_SWAP_BGRA) ? " bgra" : "",
+                     (f & PIXOPS_PREMULTIPLIED) ? " premul" : "");
+            printf("%-24s %10.1f\n", name, mpix_per_second(bench_blend, dst, src, f));
+        }
+    }
+
+    free(src);
+    free(dst);
+
+    benchmark_cursor();
+}
+
+int main(int argc, char **argv)
+{
+    int bench_only = (argc > 1 && !strcmp(argv[1], "-b"));
+
+    if (!bench_only) {
+        test_cursor();
+        test_copy();
+        test_fill();
+        test_move();
+        test_alpha_span();
+        test_blend();
+        printf("%s: %d failures\n", failures ? "FAILED" : "passed", failures);
+    }
+
+    benchmark();
+
+    return failures ? 1 : 0;
+}
@@ -21,9 +21,9 @@ struct H264_decoder	H264_decoder = {
     1920,
     1080,
     60,
-    0, 
+    H264_OPTION_LOSSLESS | H264_OPTION_PREFER_TEXT_RECTS | H264_OPTION_SMALL_FRAME_SUPPORT,
     H264_CHROMA_FORMAT_444,
-    0,                 /* Preferred alpha value for lossless objects. */
+    255,               /* Preferred alpha value for lossless objects. */
     PIXEL_FORMAT_ARGB, /* Preferred pixel format for lossless objects. */
     &v3_init,
     &v3_open_context,
@@ -159,6 +159,10 @@ BOOL setup_decoder()
     /* Initialize variables. */
     hw_decoder->video_render = NULL;
     hw_decoder->renderer_init = 0;
+    hw_decoder->dispman_display = 0;
+    memset(&hw_decoder->overlay, 0, sizeof(hw_decoder->overlay));
+    memset(&hw_decoder->small_frames, 0, sizeof(hw_decoder->small_frames));
+    memset(&hw_decoder->damage, 0, sizeof(hw_decoder->damage));
 
     comp_details **comp_out = &(hw_decoder->video_render);
 
@@ -201,6 +205,13 @@ static void close_decoder()
         COMPONENT_T *components[3] = {0};
         
         components[0] = hw_decoder->image_decode->component;
+
+        overlay_destroy(&hw_decoder->small_frames);
+        overlay_destroy(&hw_decoder->overlay);
+        damage_free(&hw_decoder->damage);
+        if (hw_decoder->dispman_display) {
+            vc_dispmanx_display_close(hw_decoder->dispman_display);
+        }
         
         if (hw_decoder->video_render) {
             components[1] = hw_decoder->video_render->component;
@@ -229,6 +240,20 @@ static void close_decoder()
     }
 }
 
+/* Call from the thread that drives the context, as for the v3_ entry
+ * points; an overlay that was never created has an empty cache.
+ */
+
+void ctxh264_bitmap_cache_stats(struct ctxh264_bitmap_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if (hw_decoder) {
+        bitmap_cache_add_stats(&hw_decoder->overlay.cache, stats);
+        bitmap_cache_add_stats(&hw_decoder->small_frames.cache, stats);
+    }
+}
+
 int decode_frame(OMXH264_decoder *decoder, unsigned char *data, int size, int last)
 {
     static OMX_BUFFERHEADERTYPE *buf = 0;
@@ -394,6 +419,26 @@ H264_context v3_open_context(int width, int height, void* codec_data, int len, u
         hw_decoder->width = width;
         hw_decoder->height = height;
 
+        damage_init(&hw_decoder->damage, width, height);
+
+        /* video_render fills the screen, so scale the overlays to match. */
+        {
+            uint32_t screen_width, screen_height;
+            VC_RECT_T dst_rect;
+
+            graphics_get_display_size(0, &screen_width, &screen_height);
+            vc_dispmanx_rect_set(&dst_rect, 0, 0, screen_width, screen_height);
+
+            hw_decoder->dispman_display = vc_dispmanx_display_open(0);
+
+            if (overlay_create(&hw_decoder->small_frames, width, height)) {
+                overlay_show(&hw_decoder->small_frames, hw_decoder->dispman_display, SMALL_FRAME_LAYER, &dst_rect);
+            }
+            if (overlay_create(&hw_decoder->overlay, width, height)) {
+                overlay_show(&hw_decoder->overlay, hw_decoder->dispman_display, OVERLAY_LAYER, &dst_rect);
+            }
+        }
+
         return id++;
     }
 
@@ -408,6 +453,34 @@ void v3_close_context(H264_context Ctx)
 
 bool v3_start_frame(H264_context Ctx, unsigned int encoded_size, SIGNED_RECT dirty_rects[], unsigned int num_rects)
 {
+    unsigned int i;
+
+    /* Save the dirty rects for this frame, they bound lossless changes. */
+    if (num_rects > 0 && num_rects <= sizeof(hw_decoder->dirty_rects) / sizeof(hw_decoder->dirty_rects[0])) {
+        for (i = 0; i < num_rects; i++) {
+            hw_decoder->dirty_rects[i] = dirty_rects[i];
+        }
+        hw_decoder->num_rects = num_rects;
+        hw_decoder->dirty_given = TRUE;
+    } else {
+        /* No dirty rect means entire context needs updating. */
+        hw_decoder->dirty_rects[0].left = 0;
+        hw_decoder->dirty_rects[0].top = 0;
+        hw_decoder->dirty_rects[0].right = hw_decoder->width;
+        hw_decoder->dirty_rects[0].bottom = hw_decoder->height;
+        hw_decoder->num_rects = 1;
+        hw_decoder->dirty_given = FALSE;
+    }
+
+    if (encoded_size > 0) {
+        for (i = 0; i < hw_decoder->num_rects; i++) {
+            damage_add(&hw_decoder->damage, &hw_decoder->dirty_rects[i]);
+        }
+
+        /* A new H.264 frame replaces any small frames. */
+        overlay_clear(&hw_decoder->small_frames);
+    }
+
 	return 1;
 }
 
@@ -420,16 +493,52 @@ bool v3_decode_frame(H264_context Ctx, void* H264_data, int len, bool last)
 
 bool v3_compose_with_fb(H264_context Ctx, struct image_buf *fb, SIGNED_RECT interesting_rects[], unsigned int num_rects)
 {
+    if (num_rects > 0) {
+        overlay_compose_fb(&hw_decoder->overlay, fb, interesting_rects, num_rects);
+    } else {
+        /* Whole buffer: skip the tiles known to be empty, other than
+         * those under the frame's dirty rects.
+         */
+        overlay_compose_fb_tiles(&hw_decoder->overlay, fb, hw_decoder->dirty_rects,
+                                 hw_decoder->dirty_given ? hw_decoder->num_rects : 0);
+    }
+
 	return 1;
 }
 
 bool v3_compose_with_rects(H264_context Ctx, struct image_buf rects[], unsigned int num_rects, bool last)
 {
+    unsigned int i;
+
+    /* Applied to the overlay's CPU copy; it is shown on push. */
+    for (i = 0; i < num_rects; i++) {
+        switch (rects[i].lossless_op) {
+        case IMAGE_OP_DRAW_LOSSLESS:
+            overlay_draw(&hw_decoder->overlay, &rects[i]);
+            break;
+        case IMAGE_OP_DELETE_LOSSLESS:
+            overlay_erase(&hw_decoder->overlay, &rects[i]);
+            break;
+        case IMAGE_OP_SMALL_FRAME_BITMAP:
+            overlay_draw(&hw_decoder->small_frames, &rects[i]);
+            break;
+        case IMAGE_OP_SMALL_FRAME_SOLID_FILL:
+            overlay_fill(&hw_decoder->small_frames, &rects[i]);
+            break;
+        }
+    }
+
 	return 1;
 }
 
 bool v3_push_frame(H264_context Ctx, struct window_info windows[], unsigned int num_windows, bool wait, bool *pushed)
 {
+    /* video_render shows each decoded frame whole; this only counts it. */
+    damage_present_all(&hw_decoder->damage);
+
+    overlay_flush(&hw_decoder->small_frames, NULL);
+    overlay_flush(&hw_decoder->overlay, NULL);
+
     if (pushed) {
         *pushed = 1;
     }
@@ -42,6 +42,90 @@ typedef unsigned char BOOL;
 #define max(a,b) (((a) > (b)) ? (a) : (b)) 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
+/* Tile damage (damage.c). */
+
+#define DAMAGE_TILE         64
+#define DAMAGE_MAX_RECTS    64      /* Rects handed out per present. */
+
+typedef struct _OMXH264_damage
+{
+    uint32_t                    *bits;      /* One bit per tile. */
+    int                         width, height;
+    int                         tiles_x, tiles_y;
+    int                         words_x;    /* Words per row of tiles. */
+    BOOL                        empty;      /* Known to be clear. */
+    unsigned int                presents;
+    unsigned int                last_pixels;
+    unsigned long long          pixels;     /* Pushed, over all presents. */
+} OMXH264_damage;
+
+/* Cache of converted lossless bitmaps (bitmap_cache.c). */
+
+#define BITMAP_CACHE_SLOTS      512
+#define BITMAP_CACHE_PROBE      8
+#define BITMAP_CACHE_BYTES      (4 * 1024 * 1024)
+#define BITMAP_CACHE_MAX_ENTRY  (256 * 1024)
+
+/* Counters, for ctxh264_bitmap_cache_stats(). */
+
+struct ctxh264_bitmap_cache_stats {
+    unsigned long long          lookups;
+    unsigned long long          hits;
+    unsigned long long          skips;          /* Hits already on screen. */
+    unsigned long long          collisions;     /* Same key, other pixels. */
+    unsigned long long          bytes_saved;    /* Converted bytes copied on hits. */
+    size_t                      bytes_used;
+    unsigned int                entries;
+};
+
+typedef struct _OMXH264_bitmap
+{
+    uint64_t                    key;        /* bitmap_hash(). */
+    uint32_t                    *pixels;    /* Converted, width x height. */
+    uint32_t                    *source;    /* As sent, to check hits. */
+    int                         width, height;
+    int                         pixel_format;
+    unsigned int                last_used;
+    int                         x, y;       /* Where last drawn... */
+    uint32_t                    stamp;      /* ...and the overlay stamp it got. */
+} OMXH264_bitmap;
+
+typedef struct _OMXH264_bitmap_cache
+{
+    OMXH264_bitmap              slots[BITMAP_CACHE_SLOTS];
+    unsigned int                clock;
+    struct ctxh264_bitmap_cache_stats stats;
+} OMXH264_bitmap_cache;
+
+/* Lossless overlay (overlay.c). */
+
+#define OVERLAY_LAYER       1000    /* Above video. */
+#define SMALL_FRAME_LAYER   500     /* Above video, below text. */
+#define OVERLAY_TILE        64      /* Pixels, for the used-tile summary. */
+
+typedef struct _OMXH264_overlay
+{
+    void                        *image;     /* CPU copy, ARGB. */
+    DISPMANX_RESOURCE_HANDLE_T  resource;
+    DISPMANX_ELEMENT_HANDLE_T   element;    /* 0 in seamless mode. */
+    uint32_t                    vc_image_ptr;
+    int                         width, height;
+    int                         stride;     /* Bytes. */
+    OMXH264_damage              damage;     /* Awaiting upload. */
+    unsigned char               *tiles;     /* Non-zero if tile may be non-transparent. */
+    uint32_t                    *stamps;    /* Stamp of the last write to each tile. */
+    int                         tiles_x, tiles_y;
+    uint32_t                    stamp;
+    unsigned char               *fb_tiles;  /* What the last scan of the lossless fb found. */
+    const void                  *fb_bits;   /* The fb it was of. */
+    int                         fb_stride;
+    int                         fb_refresh; /* Tile row of empty tiles to check next. */
+    OMXH264_bitmap_cache        cache;
+    BOOL                        opaque;     /* Shown ignoring alpha. */
+    DISPMANX_CALLBACK_FUNC_T    flushed;    /* Update from overlay_flush() done. */
+    void                        *flushed_arg;
+} OMXH264_overlay;
+
 typedef struct _comp_details {
     COMPONENT_T    *component;
     OMX_HANDLETYPE  handle;
@@ -60,8 +144,57 @@ typedef struct _OMXH264_decoder {
     int             width;
     int             height;
 
+    /* Dirty rects from start_frame, and what is still to be shown. */
+    SIGNED_RECT     dirty_rects[31];
+    int             num_rects;
+    BOOL            dirty_given;    /* Not just the whole context. */
+    OMXH264_damage  damage;
+
+    /* Lossless text and small frames, over the full screen video_render
+     * output.
+     */
+    DISPMANX_DISPLAY_HANDLE_T   dispman_display;
+    OMXH264_overlay             overlay;
+    OMXH264_overlay             small_frames;
+
 } OMXH264_decoder;
 
+void DEBUG_TRACE(const char *format, ...);
+
+BOOL damage_init(OMXH264_damage *dmg, int width, int height);
+void damage_free(OMXH264_damage *dmg);
+void damage_add(OMXH264_damage *dmg, SIGNED_RECT *rect);
+void damage_add_all(OMXH264_damage *dmg);
+BOOL damage_empty(OMXH264_damage *dmg);
+int damage_rects(OMXH264_damage *dmg, SIGNED_RECT *rects, int max_rects);
+void damage_account(OMXH264_damage *dmg, SIGNED_RECT *rects, int num_rects);
+BOOL damage_present_all(OMXH264_damage *dmg);
+
+uint64_t bitmap_hash(struct image_buf *obj);
+void bitmap_cache_free(OMXH264_bitmap_cache *cache);
+OMXH264_bitmap *bitmap_cache_find(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj);
+OMXH264_bitmap *bitmap_cache_insert(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj,
+                                    const uint32_t *pixels, int stride);
+void bitmap_cache_add_stats(OMXH264_bitmap_cache *cache, struct ctxh264_bitmap_cache_stats *stats);
+
+/* Exported, for callers that look it up with dlsym(). Sums the caches of
+ * the overlays of the open context.
+ */
+
+void ctxh264_bitmap_cache_stats(struct ctxh264_bitmap_cache_stats *stats);
+
+BOOL overlay_create(OMXH264_overlay *ov, int width, int height);
+BOOL overlay_show(OMXH264_overlay *ov, DISPMANX_DISPLAY_HANDLE_T display, int layer, VC_RECT_T *dst);
+void overlay_move(OMXH264_overlay *ov, DISPMANX_UPDATE_HANDLE_T update, VC_RECT_T *dst);
+void overlay_destroy(OMXH264_overlay *ov);
+void overlay_draw(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_erase(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_fill(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_clear(OMXH264_overlay *ov);
+void overlay_compose_fb(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT rects[], unsigned int num_rects);
+void overlay_compose_fb_tiles(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT changed[], unsigned int num_changed);
+int overlay_flush(OMXH264_overlay *ov, OMXH264_damage *changed);
+void overlay_compose(OMXH264_overlay *ov, void *dst, int dst_stride, SIGNED_RECT *rect);
 
 bool v3_init();
 H264_context v3_open_context(int width, int height, void *codec_data, int len, unsigned int options);
@@ -0,0 +1,475 @@
+/***************************************************************************
+*
+*   canvas.c
+*
+*   V2 converged mode canvasses. A canvas holds one monitor's worth of
+*   ARGB: an XImage (MIT-SHM where the server has it), or, if it is mapped
+*   to a dispmanx display, the CPU copy of its own element. Bitmaps,
+*   fills and copies from Receiver go straight into it, H.264 contexts
+*   are copied in from their decode buffer, and a push sends only the
+*   damaged tiles to the window(s) or element. The XImage helpers are
+*   shared with the seamless V1 path.
+*
+****************************************************************************/
+
+#include <errno.h>
+#include <time.h>
+
+#include "video_gl.h"
+#include "pixops.h"
+
+/* Create a width x height ZPixmap image for "disp", backed by shared
+ * memory if possible. shm_info->shmid is -1 if it is not; the unaligned
+ * malloc'd block is then returned in "old_ptr".
+ */
+
+XImage *ximage_create(Display *disp, Screen *scr, int width, int height,
+                      XShmSegmentInfo *shm_info, void **old_ptr)
+{
+    XImage *image;
+    unsigned int size;
+    int major, minor;
+    Bool pixmaps;
+
+    /* Try to use MIT-SHM. */
+    BOOL using_shm = XShmQueryExtension(disp) && XShmQueryVersion(disp, &major, &minor, &pixmaps);
+
+    DEBUG_TRACE("shm=%d\n", using_shm);
+
+    memset(shm_info, 0, sizeof(*shm_info));
+    shm_info->shmid = -1;
+    *old_ptr = NULL;
+
+    if (using_shm) {
+        image = XShmCreateImage(disp, DefaultVisualOfScreen(scr), DefaultDepthOfScreen(scr),
+                                ZPixmap, NULL, shm_info, width, height);
+    } else {
+        /* Use XPutImage. */
+        image = XCreateImage(disp, DefaultVisualOfScreen(scr), DefaultDepthOfScreen(scr),
+                             ZPixmap, 0, NULL, width, height, 32, 0);
+    }
+
+    if (!image) {
+        return NULL;
+    }
+
+    size = image->bytes_per_line * height;
+
+    if (using_shm) {
+        /* Shared memory, already attached, from the pool. */
+        if (shm_arena_get(disp, size + 32, shm_info)) {
+            image->data = (char *)shm_info->shmaddr;
+        } else {
+            shm_info->shmid = -1;
+        }
+    }
+
+    if (-1 == shm_info->shmid) {
+        /* Use traditional memory for XPutImage(). This memory is freed
+         * by XDestroyImage();
+         */
+        image->data = (char *)malloc(size + 32);
+        *old_ptr = (void *)image->data;
+    }
+
+    /* Align. */
+    image->data = (char *)(((unsigned int)(image->data) + 15) & ~0x0F);
+
+    return image;
+}
+
+void ximage_destroy(Display *disp, XImage *image, XShmSegmentInfo *shm_info, void *old_ptr)
+{
+    if (!image) {
+        return;
+    }
+
+    if (-1 != shm_info->shmid) {
+        /* Kept for the next image. */
+        shm_arena_put(disp, shm_info);
+        shm_info->shmid = -1;
+    }
+
+    image->data = old_ptr;
+    XDestroyImage(image);
+}
+
+static bool intersects(SIGNED_RECT *r1, SIGNED_RECT *r2, SIGNED_RECT *r3)
+{
+    r3->top = max(r1->top, r2->top);
+    r3->bottom = min(r1->bottom, r2->bottom);
+    if (r3->top >= r3->bottom) {
+        return 0;
+    }
+
+    r3->left = max(r1->left, r2->left);
+    r3->right = min(r1->right, r2->right);
+    if (r3->left >= r3->right) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Show "rects" of "image" in each window they overlap. Window rects are
+ * in image coordinates, and target_x/y say where the image origin is in
+ * the window.
+ */
+
+void ximage_put(Display *disp, GC gc, XImage *image, XShmSegmentInfo *shm_info,
+                struct window_info windows[], unsigned int num_windows,
+                SIGNED_RECT rects[], int num_rects)
+{
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < num_windows; i++) {
+        Window X_window = windows[i].id;
+        SIGNED_RECT window_rect = windows[i].rect;
+
+        /* Check if any of the dirty rects lie within this window. */
+        for (j = 0; j < num_rects; j++) {
+            SIGNED_RECT overlap;
+
+            if (intersects(&window_rect, &rects[j], &overlap)) {
+                /* No special alignment required. */
+                int width = overlap.right - overlap.left;
+                int height = overlap.bottom - overlap.top;
+                int dest_x = windows[i].target_x + overlap.left;
+                int dest_y = windows[i].target_y + overlap.top;
+
+                if (-1 != shm_info->shmid) {
+                    XShmPutImage(disp, X_window, gc, image, overlap.left, overlap.top,
+                                 dest_x, dest_y, width, height, 1);
+                } else {
+                    /* No need to wait for synchronization with XPutImage(). */
+                    XPutImage(disp, X_window, gc, image, overlap.left, overlap.top,
+                              dest_x, dest_y, width, height);
+                }
+            }
+        }
+    }
+}
+
+/* CTXH264_CANVAS_DISPLAYS lists a dispmanx display number per canvas, by
+ * canvas index, e.g. "2,7" for the two HDMI ports of a Pi 4. Returns -1,
+ * for output through X, for canvasses not in the list or if it is unset.
+ */
+
+int canvas_display(int index)
+{
+    const char *list = getenv("CTXH264_CANVAS_DISPLAYS");
+    char *end;
+    int i;
+
+    for (i = 0; list && *list; i++) {
+        long num = strtol(list, &end, 10);
+
+        if (end == list || (*end && *end != ',')) {
+            break;
+        }
+
+        if (i == index) {
+            return (int)num;
+        }
+
+        list = *end ? end + 1 : end;
+    }
+
+    return -1;
+}
+
+/* Called on the dispmanx thread once a push has been applied. */
+
+static void presented(DISPMANX_UPDATE_HANDLE_T update, void *arg)
+{
+    OMXH264_canvas *canvas = arg;
+
+    pthread_mutex_lock(&canvas->lock);
+    canvas->in_flight = FALSE;
+    pthread_cond_signal(&canvas->done);
+    pthread_mutex_unlock(&canvas->lock);
+}
+
+/* Pacing: the element's resource isn't rewritten until the update that
+ * last changed it has been applied. Only this canvas waits; others have
+ * their own element and updates.
+ */
+
+static void wait_presented(OMXH264_canvas *canvas)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += TIMEOUT_MS / 1000;
+
+    pthread_mutex_lock(&canvas->lock);
+    while (canvas->in_flight) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&canvas->done, &canvas->lock, &ts)) {
+            DEBUG_TRACE("Canvas update on display %d timed out\n", canvas->display_num);
+            canvas->in_flight = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&canvas->lock);
+}
+
+static BOOL create_element(OMXH264_canvas *canvas, int dst_x, int dst_y)
+{
+    VC_RECT_T dst;
+
+    canvas->display = vc_dispmanx_display_open(canvas->display_num);
+    if (!canvas->display || !overlay_create(&canvas->output, canvas->width, canvas->height)) {
+        return FALSE;
+    }
+
+    pthread_mutex_init(&canvas->lock, NULL);
+    pthread_cond_init(&canvas->done, NULL);
+
+    canvas->output.opaque = TRUE;
+    canvas->output.flushed = presented;
+    canvas->output.flushed_arg = canvas;
+
+    vc_dispmanx_rect_set(&dst, dst_x, dst_y, canvas->width, canvas->height);
+    if (!overlay_show(&canvas->output, canvas->display, CANVAS_LAYER, &dst)) {
+        return FALSE;
+    }
+
+    canvas->bits = canvas->output.image;
+    canvas->stride = canvas->output.stride;
+
+    return TRUE;
+}
+
+/* "display" is a dispmanx display number, with the canvas at (dst_x,
+ * dst_y) on it, or -1 to show it through X.
+ */
+
+BOOL canvas_create(OMXH264_canvas *canvas, Display *disp, int width, int height, int x_off, int y_off,
+                   int display, int dst_x, int dst_y)
+{
+    memset(canvas, 0, sizeof(*canvas));
+
+    canvas->width = width;
+    canvas->height = height;
+    canvas->x_off = x_off;
+    canvas->y_off = y_off;
+    canvas->display_num = display;
+
+    if (!damage_init(&canvas->damage, width, height)) {
+        canvas_destroy(canvas, disp);
+        return FALSE;
+    }
+
+    if (display >= 0) {
+        if (!create_element(canvas, dst_x, dst_y)) {
+            DEBUG_TRACE("Couldn't create %dx%d canvas on display %d\n", width, height, display);
+            canvas_destroy(canvas, disp);
+            return FALSE;
+        }
+    } else {
+        canvas->fb = ximage_create(disp, DefaultScreenOfDisplay(disp), width, height,
+                                   &canvas->shm_info, &canvas->old_ptr);
+        if (!canvas->fb) {
+            DEBUG_TRACE("Couldn't create %dx%d canvas\n", width, height);
+            canvas_destroy(canvas, disp);
+            return FALSE;
+        }
+
+        canvas->bits = (uint8_t *)canvas->fb->data;
+        canvas->stride = canvas->fb->bytes_per_line;
+        canvas->gc = XCreateGC(disp, DefaultRootWindow(disp), 0, 0);
+    }
+
+    canvas->in_use = TRUE;
+
+    return TRUE;
+}
+
+void canvas_destroy(OMXH264_canvas *canvas, Display *disp)
+{
+    if (canvas->gc) {
+        XFreeGC(disp, canvas->gc);
+    }
+
+    ximage_destroy(disp, canvas->fb, &canvas->shm_info, canvas->old_ptr);
+
+    if (canvas->display) {
+        if (canvas->output.flushed) {
+            wait_presented(canvas);
+            pthread_mutex_destroy(&canvas->lock);
+            pthread_cond_destroy(&canvas->done);
+        }
+        overlay_destroy(&canvas->output);
+        vc_dispmanx_display_close(canvas->display);
+    }
+
+    damage_free(&canvas->damage);
+    memset(canvas, 0, sizeof(*canvas));
+}
+
+/* Receiver never draws outside a canvas, but be safe. */
+
+static BOOL clip_rect(OMXH264_canvas *canvas, SIGNED_RECT *rect)
+{
+    rect->left = max(rect->left, 0);
+    rect->top = max(rect->top, 0);
+    rect->right = min(rect->right, canvas->width);
+    rect->bottom = min(rect->bottom, canvas->height);
+
+    return rect->left < rect->right && rect->top < rect->bottom;
+}
+
+/* Copy width x height 32-bit pixels to (x, y), converting with "flags" as
+ * pixops_copy_argb() does.
+ */
+
+void canvas_draw(OMXH264_canvas *canvas, int x, int y, const void *bits, int stride,
+                 int width, int height, unsigned int flags)
+{
+    SIGNED_RECT rect = {x, y, x + width, y + height};
+
+    if (!canvas->bits || !bits || !clip_rect(canvas, &rect)) {
+        return;
+    }
+
+    pixops_copy_argb((uint32_t *)(canvas->bits + (rect.top * canvas->stride)) + rect.left, canvas->stride,
+                     (const uint8_t *)bits + ((rect.top - y) * stride) + ((rect.left - x) * 4), stride,
+                     rect.right - rect.left, rect.bottom - rect.top, flags);
+
+    damage_add(&canvas->damage, &rect);
+}
+
+/* Where Receiver should decode an image bound for "dest", so that it
+ * lands in the canvas and copy_image() has nothing left to copy. The
+ * rect is marked now as it is about to be written.
+ */
+
+void *canvas_pointer(OMXH264_canvas *canvas, SIGNED_RECT *dest, int *stride)
+{
+    SIGNED_RECT rect = *dest;
+
+    if (!canvas->bits || dest->left < 0 || dest->top < 0 || !clip_rect(canvas, &rect) ||
+        rect.right != dest->right || rect.bottom != dest->bottom) {
+        return NULL;
+    }
+
+    damage_add(&canvas->damage, &rect);
+
+    *stride = canvas->stride;
+    return canvas->bits + (rect.top * canvas->stride) + (rect.left * 4);
+}
+
+void canvas_copy_image(OMXH264_canvas *canvas, SIGNED_RECT *dest, struct image_buf *source)
+{
+    int width = min(dest->right - dest->left, (int)source->width);
+    int height = min(dest->bottom - dest->top, (int)source->height);
+    unsigned int flags = (PIXEL_FORMAT_BGRA == source->pixel_format) ? PIXOPS_SWAP_BGRA : 0;
+
+    if (canvas->bits && dest->left >= 0 && dest->top >= 0 && source->stride == canvas->stride &&
+        (uint8_t *)source->bits == canvas->bits + (dest->top * canvas->stride) + (dest->left * 4)) {
+        /* Decoded in place via canvas_pointer(). Only a format swap, if
+         * any, is left to do; it works in place.
+         */
+        if (flags) {
+            canvas_draw(canvas, dest->left, dest->top, source->bits, source->stride, width, height, flags);
+        } else {
+            SIGNED_RECT rect = {dest->left, dest->top, dest->left + width, dest->top + height};
+
+            damage_add(&canvas->damage, &rect);
+        }
+        return;
+    }
+
+    canvas_draw(canvas, dest->left, dest->top, source->bits, source->stride, width, height, flags);
+}
+
+/* The rects may overlap within one canvas (scrolling); pixops_move()
+ * takes care of the order.
+ */
+
+void canvas_copy_rect(OMXH264_canvas *canvas, SIGNED_RECT *dest, OMXH264_canvas *src, SIGNED_RECT *source)
+{
+    SIGNED_RECT rect = *dest;
+    int src_x, src_y, width, height;
+
+    if (!canvas->bits || !src->bits || !clip_rect(canvas, &rect)) {
+        return;
+    }
+
+    src_x = source->left + (rect.left - dest->left);
+    src_y = source->top + (rect.top - dest->top);
+    width = min(rect.right - rect.left, src->width - src_x);
+    height = min(rect.bottom - rect.top, src->height - src_y);
+
+    if (src_x < 0 || src_y < 0 || width <= 0 || height <= 0) {
+        return;
+    }
+
+    rect.right = rect.left + width;
+    rect.bottom = rect.top + height;
+
+    pixops_move((uint32_t *)(canvas->bits + (rect.top * canvas->stride)) + rect.left, canvas->stride,
+                (const uint32_t *)(src->bits + (src_y * src->stride)) + src_x, src->stride,
+                width, height);
+
+    damage_add(&canvas->damage, &rect);
+}
+
+void canvas_fill(OMXH264_canvas *canvas, SIGNED_RECT *dest, unsigned int rgb)
+{
+    SIGNED_RECT rect = *dest;
+
+    if (!canvas->bits || !clip_rect(canvas, &rect)) {
+        return;
+    }
+
+    pixops_fill((uint32_t *)(canvas->bits + (rect.top * canvas->stride)) + rect.left, canvas->stride,
+                rect.right - rect.left, rect.bottom - rect.top, 0xff000000 | rgb);
+
+    damage_add(&canvas->damage, &rect);
+}
+
+/* Show what changed since the last push. A canvas with its own element
+ * ignores the windows. Otherwise, with no windows there is nowhere to
+ * show it, so it is kept for the next push.
+ */
+
+BOOL canvas_push(OMXH264_canvas *canvas, Display *disp, struct window_info windows[], unsigned int num_windows)
+{
+    SIGNED_RECT rects[DAMAGE_MAX_RECTS];
+    int i, n;
+
+    if (canvas->display) {
+        n = damage_rects(&canvas->damage, rects, DAMAGE_MAX_RECTS);
+        if (!n) {
+            return TRUE;
+        }
+
+        damage_account(&canvas->damage, rects, n);
+
+        for (i = 0; i < n; i++) {
+            damage_add(&canvas->output.damage, &rects[i]);
+        }
+
+        wait_presented(canvas);
+        canvas->in_flight = TRUE;
+        overlay_flush(&canvas->output, NULL);
+
+        return TRUE;
+    }
+
+    if (!canvas->fb) {
+        return FALSE;
+    }
+
+    if (0 == num_windows) {
+        return TRUE;
+    }
+
+    n = damage_rects(&canvas->damage, rects, DAMAGE_MAX_RECTS);
+    damage_account(&canvas->damage, rects, n);
+
+    ximage_put(disp, canvas->gc, canvas->fb, &canvas->shm_info, windows, num_windows, rects, n);
+
+    return TRUE;
+}
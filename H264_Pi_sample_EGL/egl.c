@@ -14,14 +14,21 @@
 
 #include "video_gl.h"
 #include "citrix_rgb.h"
+#include "pixops.h"
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 
 #define WINDOW_READ_TIME_MS 500
+#define LATENCY_DUMP_TIME_MS 1000
 
 #define WATERMARK
 
 BOOL window_hidden = FALSE;
 
+/* Receiver asked for the cursor to be hidden (V2.1). Kept across contexts. */
+BOOL cursor_hidden = FALSE;
+
 static const GLbyte quadx[1*4*3] = {
    -1, -1,  1,
    1, -1,  1,
@@ -44,16 +51,18 @@ static void hide_egl_display(OMXH264_decoder *decoder)
 
     DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);         
     vc_dispmanx_element_change_attributes(update, decoder->dispman_element, 1 << 2, 0, 0, &dst, NULL, 0, 0);
+    overlay_move(&decoder->small_frames, update, &dst);
+    overlay_move(&decoder->overlay, update, &dst);
     vc_dispmanx_update_submit_sync(update);
 }
 
-void move_egl_display(OMXH264_decoder *decoder, BOOL force)
+void move_egl_display(OMXH264_decoder *decoder, Display *disp, BOOL force)
 {
     XWindowAttributes xwa;
     Window temp;
 
-    XGetWindowAttributes(decoder->disp, decoder->ica_window, &xwa);
-    XTranslateCoordinates(decoder->disp, decoder->ica_window, xwa.root, 0, 0, &xwa.x, &xwa.y, &temp);
+    XGetWindowAttributes(disp, decoder->ica_window, &xwa);
+    XTranslateCoordinates(disp, decoder->ica_window, xwa.root, 0, 0, &xwa.x, &xwa.y, &temp);
 
     if (xwa.x != decoder->dest_x || xwa.y != decoder->dest_y || force) {
         VC_RECT_T dst;
@@ -65,6 +74,8 @@ void move_egl_display(OMXH264_decoder *decoder, BOOL force)
 
         DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);         
         vc_dispmanx_element_change_attributes(update, decoder->dispman_element, 1 << 2, 0, 0, &dst, NULL, 0, 0);
+        overlay_move(&decoder->small_frames, update, &dst);
+        overlay_move(&decoder->overlay, update, &dst);
         vc_dispmanx_update_submit_sync(update);
     }
 }
@@ -112,20 +123,9 @@ static void create_watermark(OMXH264_decoder *decoder)
     vc_dispmanx_update_submit_sync(update);
 }
 
-static void create_dispmanx_cursor(OMXH264_decoder *decoder, XFixesCursorImage *cursor)
+static void remove_dispmanx_cursor(OMXH264_cursor *vars)
 {
-    static VC_IMAGE_TYPE_T type = VC_IMAGE_ARGB8888;
-    static VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE, 255, 0};
-
-    OMXH264_cursor *vars = &(decoder->cursor);
-
-    if (!vars) {
-        return;
-    }
-
     if (vars->image) {
-        /* Remove existing cursor. */
-
         free(vars->image);
         vars->image = NULL;
 
@@ -134,30 +134,59 @@ static void create_dispmanx_cursor(OMXH264_decoder *decoder, XFixesCursorImage *
         vc_dispmanx_update_submit_sync(update);
         vc_dispmanx_resource_delete(vars->resource);
     }
+}
+
+static void create_dispmanx_cursor(OMXH264_decoder *decoder, XFixesCursorImage *cursor)
+{
+    static VC_IMAGE_TYPE_T type = VC_IMAGE_ARGB8888;
+    static VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE, 255, 0};
+
+    OMXH264_cursor *vars = &(decoder->cursor);
+
+    if (!vars) {
+        return;
+    }
 
     if (cursor && cursor->width > 0 && cursor->height > 0) {
         VC_RECT_T src_rect;
         VC_RECT_T dst_rect;
-        int stride = 0, x, y;
+        int width = (cursor->width + 15) & ~15;
+        int height = (cursor->height + 15) & ~15;
+        int stride = width * 4;
+
+        if (vars->image && (vars->width != width || vars->height != height)) {
+            /* Padded size changed, the resource can't be reused. */
+            remove_dispmanx_cursor(vars);
+        }
 
         vars->xhot = cursor->xhot;
         vars->yhot = cursor->yhot;
-        vars->width = (cursor->width + 15) & ~15;
-        vars->height = (cursor->height + 15) & ~15;
-        stride = vars->width * 4;
-    
-        vars->image = malloc(vars->height * stride);
-
-        memset(vars->image, 0, vars->height * stride);
-
-        for (y = 0; y < cursor->height; y++) {
-            unsigned long *ptr = (unsigned long *) ((unsigned char *)vars->image + (y * stride));
-            for (x = 0; x < cursor->width; x++) {
-                unsigned long value = *(cursor->pixels + (y * cursor->width) + x);
-                *ptr++ = value;
-            }
+
+        if (vars->image) {
+            /* Same size as the existing cursor. Overwrite the resource in
+             * place rather than tearing down and re-adding the element.
+             */
+            pixops_cursor_argb(vars->image, width, height, cursor->pixels, cursor->width, cursor->height, 0);
+
+            vc_dispmanx_rect_set(&dst_rect, 0, 0, width, height);
+            vc_dispmanx_resource_write_data(vars->resource, type, stride, vars->image, &dst_rect);
+
+            DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
+            vc_dispmanx_rect_set(&dst_rect, vars->lx - vars->xhot, vars->ly - vars->yhot, width, height);
+            vc_dispmanx_element_change_attributes(update, vars->element, 1 << 2, 0, 0, &dst_rect, NULL, 0, 0);
+            vc_dispmanx_update_submit_sync(update);
+            return;
         }
 
+        vars->width = width;
+        vars->height = height;
+        vars->image = malloc(height * stride);
+
+        /* Narrow the XFixes pixels (one unsigned long each) to 32-bit ARGB
+         * and clear the padding in the same pass.
+         */
+        pixops_cursor_argb(vars->image, width, height, cursor->pixels, cursor->width, cursor->height, 0);
+
         vars->resource = vc_dispmanx_resource_create(type, vars->width, vars->height, &vars->vc_image_ptr);
 
         vc_dispmanx_rect_set(&dst_rect, 0, 0, vars->width, vars->height);
@@ -178,7 +207,62 @@ static void create_dispmanx_cursor(OMXH264_decoder *decoder, XFixesCursorImage *
                                                     VC_IMAGE_ROT0);
 
         vc_dispmanx_update_submit_sync(update);
+    } else {
+        /* Remove existing cursor. */
+        remove_dispmanx_cursor(vars);
+    }
+}
+
+void hide_egl_cursor(OMXH264_decoder *decoder)
+{
+    if (!decoder) {
+        cursor_hidden = TRUE;
+        return;
+    }
+
+    OMXH264_cursor *vars = &(decoder->cursor);
+
+    pthread_mutex_lock(&vars->lock);
+    if (!cursor_hidden && vars->image) {
+        VC_RECT_T dst;
+
+        /* Park the element: fully transparent and 1x1. The image and
+         * resource are kept so show_egl_cursor() can restore them.
+         */
+        vc_dispmanx_rect_set(&dst, vars->lx, vars->ly, 1, 1);
+
+        DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+        vc_dispmanx_element_change_attributes(update, vars->element, (1 << 1) | (1 << 2), 0, 0, &dst, NULL, 0, 0);
+        vc_dispmanx_update_submit_sync(update);
     }
+    cursor_hidden = TRUE;
+    pthread_mutex_unlock(&vars->lock);
+}
+
+void show_egl_cursor(OMXH264_decoder *decoder)
+{
+    if (!decoder) {
+        cursor_hidden = FALSE;
+        return;
+    }
+
+    OMXH264_cursor *vars = &(decoder->cursor);
+
+    pthread_mutex_lock(&vars->lock);
+    if (cursor_hidden && vars->image) {
+        VC_RECT_T dst;
+
+        /* Restore from the cached position and image. Any movement while
+         * hidden is picked up on the next mouse event.
+         */
+        vc_dispmanx_rect_set(&dst, vars->lx - vars->xhot, vars->ly - vars->yhot, vars->width, vars->height);
+
+        DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+        vc_dispmanx_element_change_attributes(update, vars->element, (1 << 1) | (1 << 2), 0, 255, &dst, NULL, 0, 0);
+        vc_dispmanx_update_submit_sync(update);
+    }
+    cursor_hidden = FALSE;
+    pthread_mutex_unlock(&vars->lock);
 }
 
 static Window get_active_window(Display *disp)
@@ -203,124 +287,159 @@ static Window get_active_window(Display *disp)
     return 0;
 }
 
-static void *window_read(void *arg)
+/* Hide the EGL layer while the ICA window isn't active and keep it over the
+ * window when it moves. Runs on the event loop thread.
+ */
+
+static void check_window(OMXH264_decoder *decoder)
 {
-    OMXH264_decoder *decoder = (OMXH264_decoder *)arg;
-    static GC gc = None;
-
-    if (gc == None) {
-        gc = XCreateGC(decoder->disp, DefaultRootWindow(decoder->disp), 0, 0);
-        XSetForeground(decoder->disp, gc, 0x000000);
-    }    
-
-    for (;;) {
-        if (decoder->terminate_readers) {
-            /* Done. */
-            break;
+    Display *disp = decoder->ev_disp ? decoder->ev_disp : decoder->disp;
+
+    if (!decoder->ica_parent) {
+        return;
+    }
+
+    if (decoder->ev_disp && decoder->tracked_parent != decoder->ica_parent) {
+        /* Be told when the ICA window's frame is moved. */
+        decoder->tracked_parent = decoder->ica_parent;
+        XSelectInput(decoder->ev_disp, decoder->tracked_parent, StructureNotifyMask);
+    }
+
+    /* The window is only blanked through our own connection, never from
+     * this thread on Receiver's.
+     */
+    if (decoder->ev_disp && decoder->ev_gc == None) {
+        decoder->ev_gc = XCreateGC(decoder->ev_disp, DefaultRootWindow(decoder->ev_disp), 0, 0);
+        XSetForeground(decoder->ev_disp, decoder->ev_gc, 0x000000);
+    }
+
+    Window active_window = get_active_window(disp);
+
+    if (active_window != decoder->ica_parent) {
+        if (!window_hidden) {
+            hide_egl_display(decoder);
+            window_hidden = TRUE;
+        }
+        if (decoder->ev_gc != None) {
+            XFillRectangle(decoder->ev_disp, decoder->ica_window, decoder->ev_gc, 0, 0, decoder->width, decoder->height);
         }
+    } else if (window_hidden) {
+        window_hidden = FALSE;
+        /* Force show the window. */
+        move_egl_display(decoder, disp, TRUE);
+    } else {
+        /* Check if the display needs moving. */
+        move_egl_display(decoder, disp, FALSE);
+    }
 
-        if (decoder->ica_parent) {
-            Window active_window = get_active_window(decoder->disp);
+    XFlush(disp);
+}
 
-            if (active_window != decoder->ica_parent) {
-                if (!window_hidden) {
-                    hide_egl_display(decoder);
-                    window_hidden = TRUE;
-                }
-                XFillRectangle(decoder->disp, decoder->ica_window, gc, 0, 0, decoder->width, decoder->height);
-            } else {
-                window_hidden = FALSE;
-                /* Force show the window. */
-                move_egl_display(decoder, TRUE);
-            }
+static void window_event(OMXH264_decoder *decoder, int fd, unsigned int events)
+{
+    Atom active = XInternAtom(decoder->ev_disp, "_NET_ACTIVE_WINDOW", False);
+    BOOL changed = FALSE;
 
-            if (!window_hidden) {
-                /* Check if the display needs moving. */
-                move_egl_display(decoder, FALSE);
-            }
+    while (XPending(decoder->ev_disp)) {
+        XEvent ev;
+
+        XNextEvent(decoder->ev_disp, &ev);
+        if ((PropertyNotify == ev.type && active == ev.xproperty.atom) ||
+            ConfigureNotify == ev.type) {
+            changed = TRUE;
         }
+    }
 
-        usleep(WINDOW_READ_TIME_MS * 1000);
+    if (changed) {
+        check_window(decoder);
     }
+}
 
-    return 0;
+/* Fallback for window managers whose frame we can't follow. */
+
+static void window_timer(OMXH264_decoder *decoder, int fd, unsigned int events)
+{
+    check_window(decoder);
 }
 
-static void *mouse_read(void *arg)
+static void latency_timer(OMXH264_decoder *decoder, int fd, unsigned int events)
 {
-    OMXH264_decoder *decoder = (OMXH264_decoder *)arg;
-    BOOL recreate = FALSE;    
+    latency_dump();
+}
 
-    decoder->mouse_fd = open("/dev/input/mouse0", O_RDWR);
+static void mouse_event(OMXH264_decoder *decoder, int fd, unsigned int events)
+{
+    Display *disp = decoder->ev_disp ? decoder->ev_disp : decoder->disp;
+    static unsigned char waste[256];
+    uint64_t input_time = latency_enabled() ? latency_now() : 0;
 
-    if (-1 != decoder->mouse_fd) {
-        fd_set set;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        /* Device went away. */
+        event_loop_remove(decoder, fd);
+        return;
+    }
 
-        for (;;) {
-            FD_ZERO(&set);
-            FD_SET(decoder->mouse_fd, &set);
+    /* Mouse cursor has moved or been clicked. Only the fact that something
+     * happened matters, so drain everything.
+     */
+    while (read(fd, waste, sizeof(waste)) > 0) {
+    }
 
-            select(decoder->mouse_fd + 1, &set, NULL, NULL, NULL);
+    if (cursor_hidden) {
+        /* Cursor is parked, don't track it. */
+        return;
+    }
 
-            if (FD_ISSET(decoder->mouse_fd, &set)) {
-                /* Mouse cursor has moved or been clicked. */
-                if (decoder->terminate_readers) {
-                    /* Done. */
-                    break;
-                }
+    OMXH264_cursor *vars = &(decoder->cursor);
 
-                static unsigned char waste[256];
-                read(decoder->mouse_fd, waste, sizeof(waste));
-
-                OMXH264_cursor *vars = &(decoder->cursor);
-
-                /* Update our pointer position from X. */
-                Window rr, cr;
-                int x, y, win_x, win_y;
-                unsigned int mr;
-                
-                XQueryPointer(decoder->disp, DefaultRootWindow(decoder->disp), &rr, &cr, &x, &y, &win_x, &win_y, &mr);
-                if (vars->lx != x || vars->ly != y) {
-                    vars->lx = x;
-                    vars->ly = y;
-
-                    int d_x = vars->lx - vars->xhot;
-                    int d_y = vars->ly - vars->yhot;
-                    
-                    /* Check if the cursor shape has changed. */
-                    XFixesCursorImage *new_cursor = XFixesGetCursorImage(decoder->disp);
-                    if (new_cursor) {
-                        if (!vars->X_cur || (new_cursor->cursor_serial != vars->X_cur->cursor_serial) || recreate) {
-                            /* New cursor. Free existing cursor. */
-                            if (vars->X_cur) {
-                                XFree(vars->X_cur);
-                            }
-                            vars->X_cur = new_cursor;
-                            /* Re-create. */
-                            create_dispmanx_cursor(decoder, new_cursor);
-                        } else {
-                            XFree(new_cursor);
-                        }
-                    }
-      
-                    if (vars->image) {
-                        VC_RECT_T dst;
+    /* Update our pointer position from X. */
+    Window rr, cr;
+    int x, y, win_x, win_y;
+    unsigned int mr;
 
-                        vc_dispmanx_rect_set(&dst, d_x, d_y, vars->width, vars->height);
+    XQueryPointer(disp, DefaultRootWindow(disp), &rr, &cr, &x, &y, &win_x, &win_y, &mr);
 
-                        DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
-                        vc_dispmanx_element_change_attributes(update, vars->element, 1 << 2, 0, 0, &dst, NULL, 0, 0);
-                        vc_dispmanx_update_submit_sync(update);
-                    }
+    pthread_mutex_lock(&vars->lock);
+    if (!cursor_hidden && (vars->lx != x || vars->ly != y)) {
+        vars->lx = x;
+        vars->ly = y;
 
-                    recreate = d_x < 0 || d_y < 0;
+        int d_x = vars->lx - vars->xhot;
+        int d_y = vars->ly - vars->yhot;
+
+        /* Check if the cursor shape has changed. */
+        XFixesCursorImage *new_cursor = XFixesGetCursorImage(disp);
+        if (new_cursor) {
+            if (!vars->X_cur || (new_cursor->cursor_serial != vars->X_cur->cursor_serial) || vars->recreate) {
+                /* New cursor. Free existing cursor. */
+                if (vars->X_cur) {
+                    XFree(vars->X_cur);
                 }
+                vars->X_cur = new_cursor;
+                /* Re-create. */
+                create_dispmanx_cursor(decoder, new_cursor);
+            } else {
+                XFree(new_cursor);
             }
         }
-        close(decoder->mouse_fd);
-    }
 
-    return 0;
+        latency_record(LATENCY_QUERY, input_time);
+
+        if (vars->image) {
+            VC_RECT_T dst;
+
+            vc_dispmanx_rect_set(&dst, d_x, d_y, vars->width, vars->height);
+
+            DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+            vc_dispmanx_element_change_attributes(update, vars->element, 1 << 2, 0, 0, &dst, NULL, 0, 0);
+            vc_dispmanx_update_submit_sync(update);
+
+            latency_record(LATENCY_SUBMIT, input_time);
+        }
+
+        vars->recreate = d_x < 0 || d_y < 0;
+    }
+    pthread_mutex_unlock(&vars->lock);
 }
 
 void init_ogl(OMXH264_decoder *decoder)
@@ -429,48 +548,79 @@ void init_ogl(OMXH264_decoder *decoder)
     create_watermark(decoder);
 #endif
 
-    /* Create mouse tracker. */
-    pthread_create(&decoder->mouse_reader, 0, mouse_read, (void *)decoder);
+    /* Small frames and lossless text go on their own elements above the
+     * video.
+     */
+    overlay_show(&decoder->small_frames, decoder->dispman_display, SMALL_FRAME_LAYER, &dst_rect);
+    overlay_show(&decoder->overlay, decoder->dispman_display, OVERLAY_LAYER, &dst_rect);
+
+    /* Track the mouse and the ICA window from one event loop thread. It gets
+     * its own X connection so that Receiver's is never used concurrently.
+     */
+    decoder->ev_disp = XOpenDisplay(DisplayString(decoder->disp));
+
+    if (event_loop_init(decoder)) {
+        decoder->mouse_fd = open("/dev/input/mouse0", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        event_loop_add(decoder, decoder->mouse_fd, mouse_event);
+
+        if (decoder->ev_disp) {
+            XSelectInput(decoder->ev_disp, DefaultRootWindow(decoder->ev_disp), PropertyChangeMask);
+            XFlush(decoder->ev_disp);
+            event_loop_add(decoder, ConnectionNumber(decoder->ev_disp), window_event);
+        }
+
+        event_loop_add_timer(decoder, WINDOW_READ_TIME_MS, window_timer);
 
-    /* Create window tracker. */
-    pthread_create(&decoder->window_reader, 0, window_read, (void *)decoder);
+        if (latency_init()) {
+            vc_dispmanx_vsync_callback(decoder->dispman_display, latency_vsync, NULL);
+            event_loop_add_timer(decoder, LATENCY_DUMP_TIME_MS, latency_timer);
+        }
+
+        event_loop_start(decoder);
+    }
 }
 
 void deinit_ogl(OMXH264_decoder *decoder)
 {
     if (decoder) {
-        decoder->terminate_readers = 1;
-
-        /* Shutdown mouse reader. */
-        if (decoder->mouse_reader != (pthread_t)0) {
-            static unsigned char tmp = 1;
-
-            /* Write a byte to the mouse fd as a signal. */
-            write(decoder->mouse_fd, &tmp, sizeof(tmp));
-            /* Wait for termination. */
-            pthread_join(decoder->mouse_reader, NULL);
+        /* Stop mouse and window tracking. This doesn't depend on the mouse
+         * producing data, so it completes immediately.
+         */
+        event_loop_stop(decoder);
+
+        if (latency_enabled()) {
+            vc_dispmanx_vsync_callback(decoder->dispman_display, NULL, NULL);
+            latency_dump();
         }
 
-        if (decoder->window_reader != (pthread_t)0) {
-            /* Wait for termination. */
-            pthread_join(decoder->window_reader, NULL);
+        if (-1 != decoder->mouse_fd) {
+            close(decoder->mouse_fd);
+            decoder->mouse_fd = -1;
         }
 
         {
             OMXH264_cursor *vars = &(decoder->cursor);
 
             /* Remove cursor. */
-            if (vars && vars->image) {
-                free(vars->image);
-                vars->image = NULL;
+            if (vars) {
+                remove_dispmanx_cursor(vars);
 
-                DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
-                vc_dispmanx_element_remove(update, vars->element);
-                vc_dispmanx_update_submit_sync(update);
-                vc_dispmanx_resource_delete(vars->resource);
+                if (vars->X_cur) {
+                    XFree(vars->X_cur);
+                    vars->X_cur = NULL;
+                }
             }
         }
 
+        if (decoder->ev_disp) {
+            if (decoder->ev_gc != None) {
+                XFreeGC(decoder->ev_disp, decoder->ev_gc);
+                decoder->ev_gc = None;
+            }
+            XCloseDisplay(decoder->ev_disp);
+            decoder->ev_disp = NULL;
+        }
+
 #ifdef WATERMARK
         {
             OMXH264_watermark *vars = &(decoder->watermark);
@@ -497,6 +647,9 @@ void deinit_ogl(OMXH264_decoder *decoder)
             decoder->egl_image = NULL;
         }
 
+        overlay_destroy(&decoder->small_frames);
+        overlay_destroy(&decoder->overlay);
+
         DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);         
         vc_dispmanx_element_remove(update, decoder->dispman_element);
         vc_dispmanx_update_submit_sync(update);
@@ -0,0 +1,221 @@
+/***************************************************************************
+*
+*   event_loop.c
+*
+*   Single event loop thread for the plugin. Subsystems register file
+*   descriptors (X connection, input devices, timers) together with a
+*   handler that is called on the loop thread when the descriptor becomes
+*   readable. An eventfd is used to wake the loop for shutdown, so
+*   teardown does not depend on any device producing data.
+*
+****************************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "video_gl.h"
+
+BOOL event_loop_init(OMXH264_decoder *decoder)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+    struct epoll_event ev;
+
+    loop->thread = (pthread_t)0;
+    loop->terminate = 0;
+    loop->num_sources = 0;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (-1 == loop->epoll_fd || -1 == loop->wake_fd) {
+        DEBUG_TRACE("Couldn't create event loop, errno=%d\n", errno);
+        event_loop_stop(decoder);
+        return FALSE;
+    }
+
+    /* A NULL source identifies the wakeup descriptor. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+
+    return TRUE;
+}
+
+static OMXH264_event_source *add_source(OMXH264_decoder *decoder, int fd, EVENT_HANDLER handler, BOOL timer)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+    OMXH264_event_source *src;
+    struct epoll_event ev;
+
+    if (-1 == loop->epoll_fd || -1 == fd || loop->num_sources >= MAX_EVENT_SOURCES) {
+        return NULL;
+    }
+
+    src = &(loop->sources[loop->num_sources]);
+    src->fd = fd;
+    src->handler = handler;
+    src->timer = timer;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        DEBUG_TRACE("Couldn't add fd=%d to event loop, errno=%d\n", fd, errno);
+        return NULL;
+    }
+
+    loop->num_sources++;
+
+    return src;
+}
+
+/* Register a descriptor. Must be called before event_loop_start(). The
+ * caller keeps ownership of "fd" and closes it after event_loop_stop().
+ */
+
+BOOL event_loop_add(OMXH264_decoder *decoder, int fd, EVENT_HANDLER handler)
+{
+    return NULL != add_source(decoder, fd, handler, FALSE);
+}
+
+/* Stop watching "fd", e.g. when an input device disappears. May be called
+ * from a handler.
+ */
+
+void event_loop_remove(OMXH264_decoder *decoder, int fd)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+
+    if (-1 != loop->epoll_fd) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+/* Register a periodic timer. The timerfd belongs to the loop and its
+ * expirations are consumed before "handler" runs. Returns the timer fd,
+ * or -1 on error.
+ */
+
+int event_loop_add_timer(OMXH264_decoder *decoder, int interval_ms, EVENT_HANDLER handler)
+{
+    struct itimerspec its;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (-1 == fd) {
+        return -1;
+    }
+
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(fd, 0, &its, NULL);
+
+    if (!add_source(decoder, fd, handler, TRUE)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void *event_loop_run(void *arg)
+{
+    OMXH264_decoder *decoder = (OMXH264_decoder *)arg;
+    OMXH264_event_loop *loop = &(decoder->events);
+    struct epoll_event ev[MAX_EVENT_SOURCES + 1];
+    int i, n;
+
+    while (!loop->terminate) {
+        n = epoll_wait(loop->epoll_fd, ev, MAX_EVENT_SOURCES + 1, -1);
+
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            DEBUG_TRACE("epoll_wait failed, errno=%d\n", errno);
+            break;
+        }
+
+        for (i = 0; i < n && !loop->terminate; i++) {
+            OMXH264_event_source *src = (OMXH264_event_source *)ev[i].data.ptr;
+            uint64_t count;
+
+            if (!src) {
+                /* Wakeup. Clear the counter and re-check for termination. */
+                read(loop->wake_fd, &count, sizeof(count));
+                continue;
+            }
+
+            if (src->timer) {
+                read(src->fd, &count, sizeof(count));
+            }
+
+            src->handler(decoder, src->fd, ev[i].events);
+        }
+    }
+
+    return 0;
+}
+
+BOOL event_loop_start(OMXH264_decoder *decoder)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+
+    if (-1 == loop->epoll_fd) {
+        return FALSE;
+    }
+
+    if (pthread_create(&loop->thread, 0, event_loop_run, (void *)decoder) != 0) {
+        loop->thread = (pthread_t)0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void event_loop_wakeup(OMXH264_decoder *decoder)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+    uint64_t one = 1;
+
+    if (-1 != loop->wake_fd) {
+        write(loop->wake_fd, &one, sizeof(one));
+    }
+}
+
+/* Stop the loop thread, waiting for any handler in progress to return,
+ * and release the loop's own descriptors.
+ */
+
+void event_loop_stop(OMXH264_decoder *decoder)
+{
+    OMXH264_event_loop *loop = &(decoder->events);
+    int i;
+
+    loop->terminate = 1;
+
+    if (loop->thread != (pthread_t)0) {
+        event_loop_wakeup(decoder);
+        pthread_join(loop->thread, NULL);
+        loop->thread = (pthread_t)0;
+    }
+
+    for (i = 0; i < loop->num_sources; i++) {
+        if (loop->sources[i].timer) {
+            close(loop->sources[i].fd);
+        }
+    }
+    loop->num_sources = 0;
+
+    if (-1 != loop->wake_fd) {
+        close(loop->wake_fd);
+        loop->wake_fd = -1;
+    }
+
+    if (-1 != loop->epoll_fd) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
@@ -0,0 +1,159 @@
+/***************************************************************************
+*
+*   latency.c
+*
+*   Input-to-cursor latency instrumentation. When CTXH264_LATENCY_STATS
+*   is set to a file name, every mouse event is timestamped on arrival,
+*   after the XQueryPointer/shape check, after the dispmanx submit and at
+*   the following vsync. Samples go into log2 histograms (microseconds)
+*   that are written to the file once a second and when the context
+*   closes, and can also be read with latency_snapshot().
+*
+****************************************************************************/
+
+#include <time.h>
+
+#include "video_gl.h"
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "query",
+    "submit",
+    "vsync"
+};
+
+static struct {
+    BOOL                enabled;
+    const char          *path;
+    pthread_mutex_t     lock;
+    OMXH264_histogram   stage[LATENCY_STAGES];
+    uint64_t            pending_input;  /* Awaiting vsync, or 0. */
+} latency = {
+    FALSE, NULL, PTHREAD_MUTEX_INITIALIZER
+};
+
+BOOL latency_init(void)
+{
+    static BOOL done = FALSE;
+
+    if (!done) {
+        latency.path = getenv("CTXH264_LATENCY_STATS");
+        latency.enabled = (NULL != latency.path);
+        done = TRUE;
+    }
+
+    return latency.enabled;
+}
+
+BOOL latency_enabled(void)
+{
+    return latency.enabled;
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void add_sample(OMXH264_histogram *h, uint64_t us)
+{
+    int bucket = 0;
+
+    /* Bucket n holds samples below 2^(n+1) us. */
+    while (bucket < LATENCY_BUCKETS - 1 && (us >> (bucket + 1))) {
+        bucket++;
+    }
+
+    h->count[bucket]++;
+    h->samples++;
+    h->total_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+void latency_record(int stage, uint64_t input_time)
+{
+    uint64_t now;
+
+    if (!latency.enabled || !input_time) {
+        return;
+    }
+
+    now = latency_now();
+
+    pthread_mutex_lock(&latency.lock);
+    add_sample(&latency.stage[stage], now - input_time);
+    if (LATENCY_SUBMIT == stage) {
+        /* Attribute the next vsync to this update. */
+        latency.pending_input = input_time;
+    }
+    pthread_mutex_unlock(&latency.lock);
+}
+
+/* Registered with vc_dispmanx_vsync_callback() while stats are enabled. */
+
+void latency_vsync(DISPMANX_UPDATE_HANDLE_T update, void *arg)
+{
+    uint64_t now = latency_now();
+
+    pthread_mutex_lock(&latency.lock);
+    if (latency.pending_input) {
+        add_sample(&latency.stage[LATENCY_VSYNC], now - latency.pending_input);
+        latency.pending_input = 0;
+    }
+    pthread_mutex_unlock(&latency.lock);
+}
+
+void latency_snapshot(OMXH264_histogram stages[LATENCY_STAGES])
+{
+    pthread_mutex_lock(&latency.lock);
+    memcpy(stages, latency.stage, sizeof(latency.stage));
+    pthread_mutex_unlock(&latency.lock);
+}
+
+/* Write the histograms to the stats file. A temporary file is renamed over
+ * it, so readers never see a partial snapshot.
+ */
+
+void latency_dump(void)
+{
+    OMXH264_histogram stages[LATENCY_STAGES];
+    char tmp[512];
+    FILE *fp;
+    int i, j;
+
+    if (!latency.enabled) {
+        return;
+    }
+
+    latency_snapshot(stages);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", latency.path);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        return;
+    }
+
+    fprintf(fp, "# input-to-cursor latency, log2 buckets (upper bound in us)\n");
+
+    for (i = 0; i < LATENCY_STAGES; i++) {
+        OMXH264_histogram *h = &stages[i];
+
+        fprintf(fp, "%s samples=%u mean_us=%llu max_us=%u",
+                stage_names[i], h->samples,
+                h->samples ? h->total_us / h->samples : 0ULL, h->max_us);
+
+        for (j = 0; j < LATENCY_BUCKETS; j++) {
+            if (h->count[j]) {
+                fprintf(fp, " <%u:%u", 2U << j, h->count[j]);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+    rename(tmp, latency.path);
+}
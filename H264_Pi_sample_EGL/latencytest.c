@@ -0,0 +1,131 @@
+/***************************************************************************
+*
+*   latencytest.c
+*
+*   Measures input-to-cursor latency through egl.c's mouse path on a host
+*   X server. The pointer is moved with XTest and a byte written to a pipe
+*   stands in for /dev/input/mouse0, so mouse_event() runs on the event
+*   loop thread as on the Pi. dispmanx, EGL and GLES come from teststub/;
+*   the histograms from latency.c are printed at the end.
+*
+*   Usage: Xvfb :99 & DISPLAY=:99 ./latencytest [motions]
+*
+****************************************************************************/
+
+#include <X11/extensions/XTest.h>
+
+/* For mouse_event() and the cursor state, which are static. */
+#include "egl.c"
+
+#define DEFAULT_MOTIONS     2000
+#define MOTION_INTERVAL_US  4000        /* A 250 Hz mouse. */
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "query",
+    "submit",
+    "vsync"
+};
+
+void DEBUG_TRACE(const char *format, ...)
+{
+}
+
+/* Upper bound of the bucket holding the given fraction of samples. */
+
+static unsigned int percentile(const OMXH264_histogram *h, double fraction)
+{
+    unsigned int seen = 0;
+    int i;
+
+    if (!h->samples) {
+        return 0;
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= fraction * h->samples) {
+            break;
+        }
+    }
+
+    return 2U << i;
+}
+
+int main(int argc, char **argv)
+{
+    int motions = argc > 1 ? atoi(argv[1]) : DEFAULT_MOTIONS;
+    OMXH264_histogram stages[LATENCY_STAGES];
+    OMXH264_decoder *decoder;
+    int event, error, major, minor;
+    int mouse[2];
+    int width, height;
+    int i;
+
+    /* Keep any file named by the caller, otherwise write one here. */
+    setenv("CTXH264_LATENCY_STATS", "latencytest.stats", 0);
+    latency_init();
+
+    decoder = (OMXH264_decoder *)calloc(1, sizeof(OMXH264_decoder));
+    decoder->disp = XOpenDisplay(NULL);
+    if (!decoder->disp) {
+        printf("Couldn't open the X display, run under Xvfb.\n");
+        return 1;
+    }
+    if (!XTestQueryExtension(decoder->disp, &event, &error, &major, &minor)) {
+        printf("The X server has no XTest extension.\n");
+        return 1;
+    }
+
+    width = DisplayWidth(decoder->disp, DefaultScreen(decoder->disp));
+    height = DisplayHeight(decoder->disp, DefaultScreen(decoder->disp));
+
+    /* As init_ogl(), but with a pipe for the mouse device. */
+    decoder->ev_disp = XOpenDisplay(DisplayString(decoder->disp));
+    decoder->dispman_display = vc_dispmanx_display_open(0);
+    pthread_mutex_init(&decoder->cursor.lock, NULL);
+
+    if (pipe(mouse) || !event_loop_init(decoder)) {
+        printf("Couldn't set up the event loop.\n");
+        return 1;
+    }
+    fcntl(mouse[0], F_SETFL, O_NONBLOCK);
+    decoder->mouse_fd = mouse[0];
+
+    event_loop_add(decoder, decoder->mouse_fd, mouse_event);
+    vc_dispmanx_vsync_callback(decoder->dispman_display, latency_vsync, NULL);
+    event_loop_start(decoder);
+
+    for (i = 0; i < motions; i++) {
+        /* X has the new position before the device reports it. */
+        XTestFakeMotionEvent(decoder->disp, -1, i % (width / 2), (i * 3) % (height / 2), CurrentTime);
+        XSync(decoder->disp, False);
+
+        if (write(mouse[1], "m", 1) != 1) {
+            break;
+        }
+        usleep(MOTION_INTERVAL_US);
+    }
+
+    event_loop_stop(decoder);
+    vc_dispmanx_vsync_callback(decoder->dispman_display, NULL, NULL);
+    latency_dump();
+    latency_snapshot(stages);
+
+    /* The percentiles are histogram bucket bounds: below this many us. */
+    printf("stage     samples   mean_us    p50_us    p99_us    max_us\n");
+    for (i = 0; i < LATENCY_STAGES; i++) {
+        OMXH264_histogram *h = &stages[i];
+
+        printf("%-8s %8u %9llu %9u %9u %9u\n", stage_names[i], h->samples,
+               h->samples ? h->total_us / h->samples : 0ULL,
+               percentile(h, 0.5), percentile(h, 0.99), h->max_us);
+    }
+
+    close(mouse[0]);
+    close(mouse[1]);
+    XCloseDisplay(decoder->ev_disp);
+    XCloseDisplay(decoder->disp);
+
+    /* Every motion should have reached the dispmanx submit. */
+    return stages[LATENCY_SUBMIT].samples ? 0 : 1;
+}
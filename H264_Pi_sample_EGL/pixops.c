@@ -0,0 +1,974 @@
+/***************************************************************************
+*
+*   pixops.c
+*
+*   Pixel conversion kernels used by the H.264 plugin. The scalar versions
+*   are the reference; the NEON, SSE2 and AVX2 versions must produce
+*   identical output.
+*
+****************************************************************************/
+
+#include <limits.h>
+#include <string.h>
+
+#include "pixops.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PIXOPS_NEON
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#endif
+#elif defined(__SSE2__)
+#define PIXOPS_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXOPS_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+/* XFixes hands out one pixel per "unsigned long". */
+#if ULONG_MAX > 0xffffffffUL
+#define LONG_PIXELS
+#endif
+
+/* Exact division by 255 with rounding, valid for x <= 255 * 255. */
+#define DIV255(x)   ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+static inline uint32_t premultiply(uint32_t p)
+{
+    uint32_t a = p >> 24;
+
+    if (a == 255) {
+        return p;
+    } else if (a == 0) {
+        return 0;
+    }
+
+    return (p & 0xff000000) |
+           (DIV255(((p >> 16) & 0xff) * a) << 16) |
+           (DIV255(((p >> 8) & 0xff) * a) << 8) |
+           DIV255((p & 0xff) * a);
+}
+
+static inline uint32_t convert(uint32_t p, unsigned int flags)
+{
+    if (flags & PIXOPS_SWAP_BGRA) {
+        p = (p >> 24) | ((p >> 8) & 0xff00) | ((p << 8) & 0xff0000) | (p << 24);
+    }
+    if (flags & PIXOPS_OPAQUE) {
+        p |= 0xff000000;
+    }
+
+    return p;
+}
+
+/* Clear the area of the destination not covered by the source image. */
+
+static void pad_argb(uint32_t *dst, int dst_width, int dst_height, int width, int height)
+{
+    int y;
+
+    if (dst_width > width) {
+        for (y = 0; y < height; y++) {
+            memset(dst + (y * dst_width) + width, 0, (dst_width - width) * 4);
+        }
+    }
+
+    if (dst_height > height) {
+        memset(dst + (height * dst_width), 0, (dst_height - height) * dst_width * 4);
+    }
+}
+
+/*****************************************************************************
+ * Scalar reference kernels.
+ *****************************************************************************/
+
+void pixops_cursor_argb_c(uint32_t *dst, int dst_width, int dst_height,
+                          const unsigned long *src, int width, int height,
+                          unsigned int flags)
+{
+    int columns = width < dst_width ? width : dst_width;
+    int x, y;
+
+    height = height < dst_height ? height : dst_height;
+
+    /* Rows of the source are "width" apart, whatever is copied. */
+    for (y = 0; y < height; y++) {
+        uint32_t *out = dst + (y * dst_width);
+        const unsigned long *in = src + (y * width);
+
+        if (flags & PIXOPS_PREMULTIPLY) {
+            for (x = 0; x < columns; x++) {
+                out[x] = premultiply((uint32_t)in[x]);
+            }
+        } else {
+            for (x = 0; x < columns; x++) {
+                out[x] = (uint32_t)in[x];
+            }
+        }
+    }
+
+    pad_argb(dst, dst_width, dst_height, columns, height);
+}
+
+void pixops_copy_argb_c(uint32_t *dst, int dst_stride,
+                        const void *src, int src_stride,
+                        int width, int height, unsigned int flags)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+        const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+        if (flags & (PIXOPS_SWAP_BGRA | PIXOPS_OPAQUE)) {
+            for (x = 0; x < width; x++) {
+                out[x] = convert(in[x], flags);
+            }
+        } else {
+            memcpy(out, in, width * 4);
+        }
+    }
+}
+
+void pixops_fill_c(uint32_t *dst, int dst_stride, int width, int height,
+                   uint32_t value)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+
+        if (value == 0) {
+            memset(out, 0, width * 4);
+        } else {
+            for (x = 0; x < width; x++) {
+                out[x] = value;
+            }
+        }
+    }
+}
+
+/* Rows are moved in the order memmove() would move bytes: last first when
+ * the destination is above the source in memory.
+ */
+
+void pixops_move_c(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                   int width, int height)
+{
+    int y;
+
+    if (dst > src) {
+        for (y = height - 1; y >= 0; y--) {
+            memmove((uint8_t *)dst + (y * dst_stride), (const uint8_t *)src + (y * src_stride), width * 4);
+        }
+    } else {
+        for (y = 0; y < height; y++) {
+            memmove((uint8_t *)dst + (y * dst_stride), (const uint8_t *)src + (y * src_stride), width * 4);
+        }
+    }
+}
+
+int pixops_alpha_span_c(const uint32_t *row, int width, uint32_t mask,
+                        int *first, int *last)
+{
+    int x0, x1;
+
+    for (x0 = 0; x0 < width && !(row[x0] & mask); x0++) {
+    }
+
+    if (x0 == width) {
+        return 0;
+    }
+
+    for (x1 = width - 1; !(row[x1] & mask); x1--) {
+    }
+
+    *first = x0;
+    *last = x1;
+
+    return 1;
+}
+
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d, unsigned int flags)
+{
+    uint32_t a, na, out = 0;
+    int shift;
+
+    s = convert(s, flags & PIXOPS_SWAP_BGRA);
+    a = s >> 24;
+    na = 255 - a;
+
+    if (a == 255) {
+        return s;
+    } else if (a == 0 && !(flags & PIXOPS_PREMULTIPLIED)) {
+        return d;
+    }
+
+    for (shift = 0; shift < 32; shift += 8) {
+        uint32_t sc = (s >> shift) & 0xff;
+        uint32_t dc = (d >> shift) & 0xff;
+        uint32_t c;
+
+        if (flags & PIXOPS_PREMULTIPLIED) {
+            c = sc + DIV255(dc * na);
+            c = c > 255 ? 255 : c;
+        } else {
+            /* Alpha is a * 255 + d_a * (255 - a). */
+            c = DIV255((shift == 24 ? 255 : sc) * a + dc * na);
+        }
+        out |= c << shift;
+    }
+
+    return out;
+}
+
+void pixops_blend_c(uint32_t *dst, int dst_stride,
+                    const void *src, int src_stride,
+                    int width, int height, unsigned int flags)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+        const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+        for (x = 0; x < width; x++) {
+            out[x] = blend_pixel(in[x], out[x], flags);
+        }
+    }
+}
+
+/*****************************************************************************
+ * SIMD kernels. Each processes the bulk of a row and leaves the tail to
+ * the scalar code, returning the number of pixels done.
+ *****************************************************************************/
+
+#if defined(PIXOPS_NEON)
+
+static int narrow_row(uint32_t *out, const unsigned long *in, int width)
+{
+    int x = 0;
+
+#ifdef LONG_PIXELS
+    for (; x + 4 <= width; x += 4) {
+        uint64x2_t a = vld1q_u64((const uint64_t *)(in + x));
+        uint64x2_t b = vld1q_u64((const uint64_t *)(in + x + 2));
+
+        vst1q_u32(out + x, vcombine_u32(vmovn_u64(a), vmovn_u64(b)));
+    }
+#else
+    x = width;
+    memcpy(out, in, width * 4);
+#endif
+
+    return x;
+}
+
+static int premultiply_row(uint32_t *row, int width)
+{
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t p = vld4_u8((const uint8_t *)(row + x));
+        int c;
+
+        /* Lane 3 holds alpha on a little-endian host. */
+        for (c = 0; c < 3; c++) {
+            uint16x8_t t = vmull_u8(p.val[c], p.val[3]);
+            p.val[c] = vraddhn_u16(t, vrshrq_n_u16(t, 8));
+        }
+        vst4_u8((uint8_t *)(row + x), p);
+    }
+
+    return x;
+}
+
+static int copy_row(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    const uint32x4_t amask = vdupq_n_u32((flags & PIXOPS_OPAQUE) ? 0xff000000 : 0);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        uint32x4_t p = vld1q_u32(in + x);
+
+        if (flags & PIXOPS_SWAP_BGRA) {
+            p = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(p)));
+        }
+        vst1q_u32(out + x, vorrq_u32(p, amask));
+    }
+
+    return x;
+}
+
+/* Each block of 16 is loaded in full before any of it is stored, so
+ * moving forwards is safe when "out" is below "in", and backwards when it
+ * is above, however close they are.
+ */
+
+static int move_row_fwd(uint32_t *out, const uint32_t *in, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint32x4_t a = vld1q_u32(in + x);
+        uint32x4_t b = vld1q_u32(in + x + 4);
+        uint32x4_t c = vld1q_u32(in + x + 8);
+        uint32x4_t d = vld1q_u32(in + x + 12);
+
+        vst1q_u32(out + x, a);
+        vst1q_u32(out + x + 4, b);
+        vst1q_u32(out + x + 8, c);
+        vst1q_u32(out + x + 12, d);
+    }
+
+    return x;
+}
+
+/* Returns the number of pixels left at the start of the row. */
+
+static int move_row_back(uint32_t *out, const uint32_t *in, int width)
+{
+    int x = width;
+
+    for (; x >= 16; x -= 16) {
+        uint32x4_t a = vld1q_u32(in + x - 16);
+        uint32x4_t b = vld1q_u32(in + x - 12);
+        uint32x4_t c = vld1q_u32(in + x - 8);
+        uint32x4_t d = vld1q_u32(in + x - 4);
+
+        vst1q_u32(out + x - 16, a);
+        vst1q_u32(out + x - 12, b);
+        vst1q_u32(out + x - 8, c);
+        vst1q_u32(out + x - 4, d);
+    }
+
+    return x;
+}
+
+/* Scalar up to a 16-byte boundary, then 16 pixels per iteration. Returns
+ * how many pixels, from the start, were filled.
+ */
+
+static int fill_row(uint32_t *out, int width, uint32_t value)
+{
+    const uint32x4_t v = vdupq_n_u32(value);
+    int x = 0;
+
+    for (; x < width && ((uintptr_t)(out + x) & 15); x++) {
+        out[x] = value;
+    }
+
+    for (; x + 16 <= width; x += 16) {
+        vst1q_u32(out + x, v);
+        vst1q_u32(out + x + 4, v);
+        vst1q_u32(out + x + 8, v);
+        vst1q_u32(out + x + 12, v);
+    }
+
+    for (; x + 4 <= width; x += 4) {
+        vst1q_u32(out + x, v);
+    }
+
+    return x;
+}
+
+/* Skip whole blocks of 16 pixels with no bits in "mask", forwards from the
+ * start of the row or backwards from its end. Return the number skipped.
+ */
+
+static inline int any_bits(uint32x4_t v)
+{
+    uint32x2_t t = vorr_u32(vget_low_u32(v), vget_high_u32(v));
+
+    return (vget_lane_u32(t, 0) | vget_lane_u32(t, 1)) != 0;
+}
+
+static inline uint32x4_t load16(const uint32_t *p, uint32x4_t m)
+{
+    uint32x4_t v = vorrq_u32(vorrq_u32(vld1q_u32(p), vld1q_u32(p + 4)),
+                             vorrq_u32(vld1q_u32(p + 8), vld1q_u32(p + 12)));
+
+    return vandq_u32(v, m);
+}
+
+static int skip_clear_fwd(const uint32_t *row, int width, uint32_t mask)
+{
+    const uint32x4_t m = vdupq_n_u32(mask);
+    int x = 0;
+
+    for (; x + 16 <= width && !any_bits(load16(row + x, m)); x += 16) {
+    }
+
+    return x;
+}
+
+static int skip_clear_back(const uint32_t *row, int width, uint32_t mask)
+{
+    const uint32x4_t m = vdupq_n_u32(mask);
+    int n = 0;
+
+    for (; n + 16 <= width && !any_bits(load16(row + width - n - 16, m)); n += 16) {
+    }
+
+    return n;
+}
+
+static inline uint8x8_t div255_u16(uint16x8_t t)
+{
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static int blend_row_neon(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    /* Byte lanes of an ARGB pixel are B, G, R, A; BGRA is the reverse. */
+    const int ia = (flags & PIXOPS_SWAP_BGRA) ? 0 : 3;
+    const uint8x8_t v255 = vdup_n_u8(255);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t s = vld4_u8((const uint8_t *)(in + x));
+        uint8x8x4_t d = vld4_u8((const uint8_t *)(out + x));
+        uint8x8_t a = s.val[ia];
+        uint8x8_t na = vsub_u8(v255, a);
+        int c;
+
+        for (c = 0; c < 4; c++) {
+            uint8x8_t sc = s.val[(flags & PIXOPS_SWAP_BGRA) ? 3 - c : c];
+            uint16x8_t t = vmull_u8(d.val[c], na);
+
+            if (flags & PIXOPS_PREMULTIPLIED) {
+                d.val[c] = vqadd_u8(sc, div255_u16(t));
+            } else {
+                t = vmlal_u8(t, (c == 3) ? v255 : sc, a);
+                d.val[c] = div255_u16(t);
+            }
+        }
+        vst4_u8((uint8_t *)(out + x), d);
+    }
+
+    return x;
+}
+
+#elif defined(PIXOPS_SSE2)
+
+static int narrow_row(uint32_t *out, const unsigned long *in, int width)
+{
+    int x = 0;
+
+#ifdef LONG_PIXELS
+    for (; x + 4 <= width; x += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + x + 2));
+
+        /* Keep the low 32 bits of each 64-bit pixel. */
+        a = _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 0, 2, 0));
+        b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 0, 2, 0));
+        _mm_storeu_si128((__m128i *)(out + x), _mm_unpacklo_epi64(a, b));
+    }
+#else
+    x = width;
+    memcpy(out, in, width * 4);
+#endif
+
+    return x;
+}
+
+static inline __m128i premultiply_half(__m128i p)
+{
+    const __m128i c128 = _mm_set1_epi16(128);
+    __m128i a, t;
+
+    /* Broadcast each pixel's alpha across its four 16-bit lanes. */
+    a = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+
+    t = _mm_add_epi16(_mm_mullo_epi16(p, a), c128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static int premultiply_row(uint32_t *row, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xff000000);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i lo = premultiply_half(_mm_unpacklo_epi8(p, zero));
+        __m128i hi = premultiply_half(_mm_unpackhi_epi8(p, zero));
+        __m128i r = _mm_packus_epi16(lo, hi);
+
+        /* Alpha itself is left untouched. */
+        r = _mm_or_si128(_mm_andnot_si128(amask, r), _mm_and_si128(p, amask));
+        _mm_storeu_si128((__m128i *)(row + x), r);
+    }
+
+    return x;
+}
+
+static int copy_row(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    const __m128i amask = _mm_set1_epi32((flags & PIXOPS_OPAQUE) ? 0xff000000 : 0);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(in + x));
+
+        if (flags & PIXOPS_SWAP_BGRA) {
+            /* Swap bytes within each 16-bit lane, then swap the lanes. */
+            p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+            p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(2, 3, 0, 1));
+            p = _mm_shufflehi_epi16(p, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+        _mm_storeu_si128((__m128i *)(out + x), _mm_or_si128(p, amask));
+    }
+
+    return x;
+}
+
+static int move_row_fwd(uint32_t *out, const uint32_t *in, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + x + 4));
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + x + 8));
+        __m128i d = _mm_loadu_si128((const __m128i *)(in + x + 12));
+
+        _mm_storeu_si128((__m128i *)(out + x), a);
+        _mm_storeu_si128((__m128i *)(out + x + 4), b);
+        _mm_storeu_si128((__m128i *)(out + x + 8), c);
+        _mm_storeu_si128((__m128i *)(out + x + 12), d);
+    }
+
+    return x;
+}
+
+static int move_row_back(uint32_t *out, const uint32_t *in, int width)
+{
+    int x = width;
+
+    for (; x >= 16; x -= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + x - 16));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + x - 12));
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + x - 8));
+        __m128i d = _mm_loadu_si128((const __m128i *)(in + x - 4));
+
+        _mm_storeu_si128((__m128i *)(out + x - 16), a);
+        _mm_storeu_si128((__m128i *)(out + x - 12), b);
+        _mm_storeu_si128((__m128i *)(out + x - 8), c);
+        _mm_storeu_si128((__m128i *)(out + x - 4), d);
+    }
+
+    return x;
+}
+
+static int fill_row(uint32_t *out, int width, uint32_t value)
+{
+    const __m128i v = _mm_set1_epi32(value);
+    int x = 0;
+
+    for (; x < width && ((uintptr_t)(out + x) & 15); x++) {
+        out[x] = value;
+    }
+
+    for (; x + 16 <= width; x += 16) {
+        _mm_store_si128((__m128i *)(out + x), v);
+        _mm_store_si128((__m128i *)(out + x + 4), v);
+        _mm_store_si128((__m128i *)(out + x + 8), v);
+        _mm_store_si128((__m128i *)(out + x + 12), v);
+    }
+
+    for (; x + 4 <= width; x += 4) {
+        _mm_store_si128((__m128i *)(out + x), v);
+    }
+
+    return x;
+}
+
+static inline __m128i load16(const uint32_t *p, __m128i m)
+{
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 4)));
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 8)), _mm_loadu_si128((const __m128i *)(p + 12)));
+
+    return _mm_and_si128(_mm_or_si128(a, b), m);
+}
+
+static inline int any_bits(__m128i v)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) != 0xffff;
+}
+
+static int skip_clear_fwd(const uint32_t *row, int width, uint32_t mask)
+{
+    const __m128i m = _mm_set1_epi32(mask);
+    int x = 0;
+
+    for (; x + 16 <= width && !any_bits(load16(row + x, m)); x += 16) {
+    }
+
+    return x;
+}
+
+static int skip_clear_back(const uint32_t *row, int width, uint32_t mask)
+{
+    const __m128i m = _mm_set1_epi32(mask);
+    int n = 0;
+
+    for (; n + 16 <= width && !any_bits(load16(row + width - n - 16, m)); n += 16) {
+    }
+
+    return n;
+}
+
+static inline __m128i div255_epi16(__m128i t)
+{
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/* Two pixels, unpacked to 16-bit lanes. */
+
+static inline __m128i blend_half(__m128i s, __m128i d, unsigned int flags)
+{
+    const __m128i c255 = _mm_set1_epi16(255);
+    __m128i a, na;
+
+    a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    na = _mm_sub_epi16(c255, a);
+
+    if (flags & PIXOPS_PREMULTIPLIED) {
+        return _mm_adds_epu16(s, div255_epi16(_mm_mullo_epi16(d, na)));
+    }
+
+    /* Source alpha lanes become 255, giving a * 255 + d_a * (255 - a). */
+    s = _mm_or_si128(s, _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0));
+    return div255_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, na)));
+}
+
+static int blend_row_sse2(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(in + x));
+        __m128i d = _mm_loadu_si128((const __m128i *)(out + x));
+        __m128i lo, hi;
+
+        if (flags & PIXOPS_SWAP_BGRA) {
+            s = _mm_or_si128(_mm_slli_epi16(s, 8), _mm_srli_epi16(s, 8));
+            s = _mm_shufflelo_epi16(s, _MM_SHUFFLE(2, 3, 0, 1));
+            s = _mm_shufflehi_epi16(s, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+
+        lo = blend_half(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), flags);
+        hi = blend_half(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), flags);
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+    }
+
+    return x;
+}
+
+#if defined(PIXOPS_AVX2)
+
+/* As blend_half/blend_row_sse2, on 8 pixels at a time. Only called when
+ * the CPU reports AVX2.
+ */
+
+__attribute__((target("avx2")))
+static inline __m256i div255_epi16_avx2(__m256i t)
+{
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_half_avx2(__m256i s, __m256i d, unsigned int flags)
+{
+    const __m256i c255 = _mm256_set1_epi16(255);
+    __m256i a, na;
+
+    a = _mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    na = _mm256_sub_epi16(c255, a);
+
+    if (flags & PIXOPS_PREMULTIPLIED) {
+        return _mm256_adds_epu16(s, div255_epi16_avx2(_mm256_mullo_epi16(d, na)));
+    }
+
+    s = _mm256_or_si256(s, _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0));
+    return div255_epi16_avx2(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, na)));
+}
+
+__attribute__((target("avx2")))
+static int blend_row_avx2(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i swap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                         12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(in + x));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(out + x));
+        __m256i lo, hi;
+
+        if (flags & PIXOPS_SWAP_BGRA) {
+            s = _mm256_shuffle_epi8(s, swap);
+        }
+
+        /* Unpack and pack both work within 128-bit lanes, so pixel order
+         * is preserved.
+         */
+        lo = blend_half_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), flags);
+        hi = blend_half_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), flags);
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_packus_epi16(lo, hi));
+    }
+
+    return x;
+}
+
+#endif
+
+#endif
+
+/*****************************************************************************
+ * Blend dispatch, chosen on first use.
+ *****************************************************************************/
+
+typedef int (*BLEND_ROW)(uint32_t *out, const uint32_t *in, int width, unsigned int flags);
+
+static int blend_row_none(uint32_t *out, const uint32_t *in, int width, unsigned int flags)
+{
+    return 0;
+}
+
+static BLEND_ROW blend_row = NULL;
+static const char *blend_name = "c";
+
+static void select_blend(void)
+{
+    BLEND_ROW row = blend_row_none;
+
+#if defined(PIXOPS_NEON)
+#if defined(__arm__)
+    /* 32-bit builds may run on cores without NEON. */
+    if (getauxval(AT_HWCAP) & HWCAP_ARM_NEON)
+#endif
+    {
+        row = blend_row_neon;
+        blend_name = "neon";
+    }
+#elif defined(PIXOPS_SSE2)
+    row = blend_row_sse2;
+    blend_name = "sse2";
+#if defined(PIXOPS_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        row = blend_row_avx2;
+        blend_name = "avx2";
+    }
+#endif
+#endif
+
+    blend_row = row;
+}
+
+void pixops_cursor_argb(uint32_t *dst, int dst_width, int dst_height,
+                        const unsigned long *src, int width, int height,
+                        unsigned int flags)
+{
+#if defined(PIXOPS_NEON) || defined(PIXOPS_SSE2)
+    int columns = width < dst_width ? width : dst_width;
+    int x, y;
+
+    height = height < dst_height ? height : dst_height;
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = dst + (y * dst_width);
+        const unsigned long *in = src + (y * width);
+
+        for (x = narrow_row(out, in, columns); x < columns; x++) {
+            out[x] = (uint32_t)in[x];
+        }
+
+        if (flags & PIXOPS_PREMULTIPLY) {
+            for (x = premultiply_row(out, columns); x < columns; x++) {
+                out[x] = premultiply(out[x]);
+            }
+        }
+    }
+
+    pad_argb(dst, dst_width, dst_height, columns, height);
+#else
+    pixops_cursor_argb_c(dst, dst_width, dst_height, src, width, height, flags);
+#endif
+}
+
+void pixops_copy_argb(uint32_t *dst, int dst_stride,
+                      const void *src, int src_stride,
+                      int width, int height, unsigned int flags)
+{
+#if defined(PIXOPS_NEON) || defined(PIXOPS_SSE2)
+    int x, y;
+
+    if (!(flags & (PIXOPS_SWAP_BGRA | PIXOPS_OPAQUE))) {
+        pixops_copy_argb_c(dst, dst_stride, src, src_stride, width, height, flags);
+        return;
+    }
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+        const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+        for (x = copy_row(out, in, width, flags); x < width; x++) {
+            out[x] = convert(in[x], flags);
+        }
+    }
+#else
+    pixops_copy_argb_c(dst, dst_stride, src, src_stride, width, height, flags);
+#endif
+}
+
+void pixops_fill(uint32_t *dst, int dst_stride, int width, int height,
+                 uint32_t value)
+{
+#if defined(PIXOPS_NEON) || defined(PIXOPS_SSE2)
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+
+        for (x = fill_row(out, width, value); x < width; x++) {
+            out[x] = value;
+        }
+    }
+#else
+    pixops_fill_c(dst, dst_stride, width, height, value);
+#endif
+}
+
+void pixops_move(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                 int width, int height)
+{
+#if defined(PIXOPS_NEON) || defined(PIXOPS_SSE2)
+    int x, y;
+
+    if (dst > src) {
+        /* Bottom row first, right to left. */
+        for (y = height - 1; y >= 0; y--) {
+            uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+            const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+            for (x = move_row_back(out, in, width); x > 0; x--) {
+                out[x - 1] = in[x - 1];
+            }
+        }
+    } else {
+        for (y = 0; y < height; y++) {
+            uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+            const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+            for (x = move_row_fwd(out, in, width); x < width; x++) {
+                out[x] = in[x];
+            }
+        }
+    }
+#else
+    pixops_move_c(dst, dst_stride, src, src_stride, width, height);
+#endif
+}
+
+int pixops_alpha_span(const uint32_t *row, int width, uint32_t mask,
+                      int *first, int *last)
+{
+#if defined(PIXOPS_NEON) || defined(PIXOPS_SSE2)
+    int x0 = skip_clear_fwd(row, width, mask);
+    int x1;
+
+    if (!pixops_alpha_span_c(row + x0, width - x0, mask, first, last)) {
+        return 0;
+    }
+    x0 += *first;
+
+    /* Known to hit at or before x0, so the backwards scan stops there. */
+    x1 = width - 1 - skip_clear_back(row + x0, width - x0, mask);
+    while (!(row[x1] & mask)) {
+        x1--;
+    }
+
+    *first = x0;
+    *last = x1;
+
+    return 1;
+#else
+    return pixops_alpha_span_c(row, width, mask, first, last);
+#endif
+}
+
+void pixops_blend(uint32_t *dst, int dst_stride,
+                  const void *src, int src_stride,
+                  int width, int height, unsigned int flags)
+{
+    int x, y;
+
+    if (!blend_row) {
+        select_blend();
+    }
+
+    for (y = 0; y < height; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)dst + (y * dst_stride));
+        const uint32_t *in = (const uint32_t *)((const uint8_t *)src + (y * src_stride));
+
+        for (x = blend_row(out, in, width, flags); x < width; x++) {
+            out[x] = blend_pixel(in[x], out[x], flags);
+        }
+    }
+}
+
+const char *pixops_blend_impl(void)
+{
+    if (!blend_row) {
+        select_blend();
+    }
+
+    return blend_name;
+}
+
+int pixops_blend_use(const char *name)
+{
+    if (!strcmp(name, "c")) {
+        blend_row = blend_row_none;
+        blend_name = "c";
+        return 1;
+    }
+
+#if defined(PIXOPS_NEON)
+    select_blend();
+    return !strcmp(name, blend_name);
+#elif defined(PIXOPS_SSE2)
+    if (!strcmp(name, "sse2")) {
+        blend_row = blend_row_sse2;
+        blend_name = "sse2";
+        return 1;
+    }
+#if defined(PIXOPS_AVX2)
+    if (!strcmp(name, "avx2")) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            blend_row = blend_row_avx2;
+            blend_name = "avx2";
+            return 1;
+        }
+    }
+#endif
+#endif
+
+    return 0;
+}
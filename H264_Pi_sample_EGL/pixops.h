@@ -0,0 +1,106 @@
+/***************************************************************************
+*
+*   pixops.h
+*
+*   Pixel conversion kernels used by the H.264 plugin. Each kernel has a
+*   scalar reference implementation and NEON/SSE2 versions where the
+*   target supports them. Blending also has an AVX2 version; it picks
+*   the best version for the CPU it runs on.
+*
+****************************************************************************/
+
+#ifndef _PIXOPS_H_
+#define _PIXOPS_H_
+
+#include <stdint.h>
+
+/* Flags for the conversion kernels. */
+
+#define PIXOPS_PREMULTIPLY      0x01    /* Premultiply colour by alpha. */
+#define PIXOPS_SWAP_BGRA        0x02    /* Source is BGRA, convert to ARGB. */
+#define PIXOPS_OPAQUE           0x04    /* Force alpha to 0xff. */
+#define PIXOPS_PREMULTIPLIED    0x08    /* Source colour is premultiplied. */
+
+/* Convert an XFixes cursor image (one "unsigned long" per ARGB pixel, which
+ * is 8 bytes on 64-bit hosts) into a 32-bit ARGB buffer of dst_width x
+ * dst_height pixels. Pixels outside the source image are cleared, so the
+ * destination may be padded to any size at least as large as the source.
+ */
+
+void pixops_cursor_argb(uint32_t *dst, int dst_width, int dst_height,
+                        const unsigned long *src, int width, int height,
+                        unsigned int flags);
+
+/* Copy a width x height block of 32-bit pixels into an ARGB destination,
+ * optionally converting from BGRA and forcing alpha. Strides are in bytes.
+ */
+
+void pixops_copy_argb(uint32_t *dst, int dst_stride,
+                      const void *src, int src_stride,
+                      int width, int height, unsigned int flags);
+
+/* Fill a width x height block with a single 32-bit value. */
+
+void pixops_fill(uint32_t *dst, int dst_stride, int width, int height,
+                 uint32_t value);
+
+/* Move a width x height block of 32-bit pixels. The blocks may overlap,
+ * in which case the result is as if an intermediate buffer was used.
+ */
+
+void pixops_move(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                 int width, int height);
+
+/* Find the first and last pixels of a row with (pixel & mask) != 0, e.g.
+ * the non-transparent span for mask 0xff000000. Returns 0 if there are
+ * none, in which case "first" and "last" are left unchanged.
+ */
+
+int pixops_alpha_span(const uint32_t *row, int width, uint32_t mask,
+                      int *first, int *last);
+
+/* Blend a width x height block of ARGB (or BGRA with PIXOPS_SWAP_BGRA)
+ * pixels over an ARGB destination: colour is s * a + d * (255 - a), or
+ * s + d * (255 - a) with PIXOPS_PREMULTIPLIED, and alpha is always
+ * a + d_a * (255 - a), all in units of 1/255 rounded to nearest.
+ */
+
+void pixops_blend(uint32_t *dst, int dst_stride,
+                  const void *src, int src_stride,
+                  int width, int height, unsigned int flags);
+
+/* Name of the blend implementation in use, e.g. "avx2". */
+
+const char *pixops_blend_impl(void);
+
+/* Use the named blend implementation ("c", "neon", "sse2" or "avx2")
+ * instead of the best one, for tests and benchmarks. Returns 0 if it is
+ * not available on this CPU.
+ */
+
+int pixops_blend_use(const char *name);
+
+/* Scalar reference versions, always available. */
+
+void pixops_cursor_argb_c(uint32_t *dst, int dst_width, int dst_height,
+                          const unsigned long *src, int width, int height,
+                          unsigned int flags);
+
+void pixops_copy_argb_c(uint32_t *dst, int dst_stride,
+                        const void *src, int src_stride,
+                        int width, int height, unsigned int flags);
+
+void pixops_fill_c(uint32_t *dst, int dst_stride, int width, int height,
+                   uint32_t value);
+
+void pixops_move_c(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                   int width, int height);
+
+int pixops_alpha_span_c(const uint32_t *row, int width, uint32_t mask,
+                        int *first, int *last);
+
+void pixops_blend_c(uint32_t *dst, int dst_stride,
+                    const void *src, int src_stride,
+                    int width, int height, unsigned int flags);
+
+#endif /* _PIXOPS_H_ */
@@ -0,0 +1,216 @@
+/***************************************************************************
+*
+*   shm_arena.c
+*
+*   Pool of MIT-SHM segments for XImages. Contexts are opened and closed
+*   on every resize and reconnect, so segments are not given back when an
+*   image is destroyed but kept, still attached to the X server, for the
+*   next image of the same size class. Segments unused for a while are
+*   released. Segments are attached on Receiver's connection, so this is
+*   only done on Receiver's thread: on get and put, and on each push and
+*   close, so that they go while a context sits idle too.
+*
+****************************************************************************/
+
+#include <time.h>
+
+#include "video_gl.h"
+
+static OMXH264_shm_segment segments[SHM_ARENA_SLOTS];
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int created, reused;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* Size classes are 2^k and 3 * 2^(k-1) bytes, from 64KB, so at most a
+ * third is wasted and a small change of geometry usually fits.
+ */
+
+static size_t size_class(size_t size)
+{
+    size_t c;
+
+    for (c = 65536; ; c *= 2) {
+        if (size <= c) {
+            return c;
+        }
+        if (size <= c + (c / 2)) {
+            return c + (c / 2);
+        }
+    }
+}
+
+static void release(OMXH264_shm_segment *seg)
+{
+    DEBUG_TRACE("SHM arena: releasing %u bytes\n", (unsigned int)seg->size);
+
+    XShmDetach(seg->disp, &seg->info);
+    shmdt(seg->info.shmaddr);
+    memset(seg, 0, sizeof(*seg));
+}
+
+static void trim(uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < SHM_ARENA_SLOTS; i++) {
+        if (segments[i].size && !segments[i].in_use && now - segments[i].released >= SHM_ARENA_IDLE_MS) {
+            release(&segments[i]);
+        }
+    }
+}
+
+/* Create a segment and attach it to the X server. */
+
+static BOOL create(OMXH264_shm_segment *seg, Display *disp, size_t size)
+{
+    memset(seg, 0, sizeof(*seg));
+
+    seg->info.shmseg = None;
+    seg->info.readOnly = 0;
+    seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (-1 == seg->info.shmid) {
+        return FALSE;
+    }
+
+    seg->info.shmaddr = (char *)shmat(seg->info.shmid, 0, 0);
+    if ((char *)-1 == seg->info.shmaddr) {
+        shmctl(seg->info.shmid, IPC_RMID, 0);
+        return FALSE;
+    }
+
+    /* Tell the X server to attach the segment. */
+    if (XShmAttach(disp, &seg->info) <= 0) {
+        shmdt(seg->info.shmaddr);
+        shmctl(seg->info.shmid, IPC_RMID, 0);
+        return FALSE;
+    }
+
+    /* Make sure the server has attached before the segment is removed;
+     * it then lasts only as long as the attachments, so it does not remain
+     * if this program dies unexpectedly.
+     */
+    XSync(disp, False);
+    shmctl(seg->info.shmid, IPC_RMID, 0);
+
+    seg->disp = disp;
+    seg->size = size;
+
+    return TRUE;
+}
+
+/* Fill in "info" with a segment of at least "size" bytes, attached to
+ * "disp". Returns FALSE if there is none, to use ordinary memory.
+ */
+
+BOOL shm_arena_get(Display *disp, size_t size, XShmSegmentInfo *info)
+{
+    OMXH264_shm_segment *seg = NULL;
+    size_t want = size_class(size);
+    int i;
+
+    pthread_mutex_lock(&arena_lock);
+
+    trim(now_ms());
+
+    for (i = 0; i < SHM_ARENA_SLOTS; i++) {
+        if (!segments[i].in_use && segments[i].size == want && segments[i].disp == disp) {
+            seg = &segments[i];
+            reused++;
+            break;
+        }
+    }
+
+    if (!seg) {
+        /* A free slot, or else the least recently released segment. */
+        for (i = 0; i < SHM_ARENA_SLOTS; i++) {
+            if (!segments[i].size) {
+                seg = &segments[i];
+                break;
+            }
+            if (!segments[i].in_use && (!seg || segments[i].released < seg->released)) {
+                seg = &segments[i];
+            }
+        }
+
+        if (seg && seg->size) {
+            release(seg);
+        }
+
+        if (!seg || !create(seg, disp, want)) {
+            pthread_mutex_unlock(&arena_lock);
+            return FALSE;
+        }
+        created++;
+    }
+
+    seg->in_use = TRUE;
+    *info = seg->info;
+
+    DEBUG_TRACE("SHM arena: %u bytes for %u, %u created, %u reused\n",
+                (unsigned int)seg->size, (unsigned int)size, created, reused);
+
+    pthread_mutex_unlock(&arena_lock);
+
+    return TRUE;
+}
+
+/* Give back a segment from shm_arena_get(). */
+
+void shm_arena_put(Display *disp, XShmSegmentInfo *info)
+{
+    uint64_t now = now_ms();
+    int i;
+
+    /* The server may still be reading it for an earlier put. */
+    XSync(disp, False);
+
+    pthread_mutex_lock(&arena_lock);
+
+    for (i = 0; i < SHM_ARENA_SLOTS; i++) {
+        if (segments[i].in_use && segments[i].info.shmid == info->shmid) {
+            segments[i].in_use = FALSE;
+            segments[i].released = now;
+            break;
+        }
+    }
+
+    trim(now);
+
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/* Release the segments idle for SHM_ARENA_IDLE_MS. Call from Receiver's
+ * thread, which owns the connection they are attached on.
+ */
+
+void shm_arena_trim(void)
+{
+    pthread_mutex_lock(&arena_lock);
+    trim(now_ms());
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/* Release every segment not in use, e.g. when the plug-in is done. */
+
+void shm_arena_flush(void)
+{
+    int i;
+
+    pthread_mutex_lock(&arena_lock);
+
+    for (i = 0; i < SHM_ARENA_SLOTS; i++) {
+        if (segments[i].size && !segments[i].in_use) {
+            release(&segments[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,48 @@
+/***************************************************************************
+*
+*   EGL/egl.h
+*
+*   Stand-in for the Broadcom EGL header, for building latencytest on a
+*   host without /opt/vc. teststub.c implements these as no-ops.
+*
+****************************************************************************/
+
+#ifndef TESTSTUB_EGL_H
+#define TESTSTUB_EGL_H
+
+typedef unsigned int EGLBoolean;
+typedef int EGLint;
+typedef void *EGLConfig;
+typedef void *EGLContext;
+typedef void *EGLDisplay;
+typedef void *EGLSurface;
+typedef void *EGLClientBuffer;
+
+#define EGL_FALSE               0
+#define EGL_TRUE                1
+#define EGL_ALPHA_SIZE          0x3021
+#define EGL_BLUE_SIZE           0x3022
+#define EGL_GREEN_SIZE          0x3023
+#define EGL_RED_SIZE            0x3024
+#define EGL_DEPTH_SIZE          0x3025
+#define EGL_NONE                0x3038
+#define EGL_SURFACE_TYPE        0x3033
+#define EGL_WINDOW_BIT          0x0004
+
+#define EGL_DEFAULT_DISPLAY     ((void *)0)
+#define EGL_NO_CONTEXT          ((EGLContext)0)
+#define EGL_NO_SURFACE          ((EGLSurface)0)
+
+EGLDisplay eglGetDisplay(void *display_id);
+EGLBoolean eglInitialize(EGLDisplay dpy, EGLint *major, EGLint *minor);
+EGLBoolean eglSaneChooseConfigBRCM(EGLDisplay dpy, const EGLint *attrib_list, EGLConfig *configs, EGLint config_size, EGLint *num_config);
+EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig config, EGLContext share_context, const EGLint *attrib_list);
+EGLSurface eglCreateWindowSurface(EGLDisplay dpy, EGLConfig config, void *win, const EGLint *attrib_list);
+EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx);
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface);
+EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surface);
+EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx);
+EGLBoolean eglTerminate(EGLDisplay dpy);
+EGLint eglGetError(void);
+
+#endif /* TESTSTUB_EGL_H */
@@ -0,0 +1,22 @@
+/***************************************************************************
+*
+*   EGL/eglext.h
+*
+*   Stand-in for the Broadcom EGL extensions header, for building
+*   latencytest on a host without /opt/vc.
+*
+****************************************************************************/
+
+#ifndef TESTSTUB_EGLEXT_H
+#define TESTSTUB_EGLEXT_H
+
+#include "EGL/egl.h"
+
+typedef void *EGLImageKHR;
+
+#define EGL_GL_TEXTURE_2D_KHR   0x30B1
+
+EGLImageKHR eglCreateImageKHR(EGLDisplay dpy, EGLContext ctx, int target, EGLClientBuffer buffer, const EGLint *attrib_list);
+EGLBoolean eglDestroyImageKHR(EGLDisplay dpy, EGLImageKHR image);
+
+#endif /* TESTSTUB_EGLEXT_H */
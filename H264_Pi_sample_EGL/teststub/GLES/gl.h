@@ -0,0 +1,44 @@
+/***************************************************************************
+*
+*   GLES/gl.h
+*
+*   Stand-in for the Broadcom OpenGL ES 1.1 header, for building
+*   latencytest on a host without /opt/vc. teststub.c implements these as
+*   no-ops.
+*
+****************************************************************************/
+
+#ifndef TESTSTUB_GL_H
+#define TESTSTUB_GL_H
+
+typedef signed char GLbyte;
+typedef float GLfloat;
+typedef unsigned int GLuint;
+typedef unsigned int GLenum;
+typedef int GLint;
+typedef int GLsizei;
+
+#define GL_BYTE                 0x1400
+#define GL_UNSIGNED_BYTE        0x1401
+#define GL_FLOAT                0x1406
+#define GL_TRIANGLE_STRIP       0x0005
+#define GL_TEXTURE_2D           0x0DE1
+#define GL_RGBA                 0x1908
+#define GL_NEAREST              0x2600
+#define GL_TEXTURE_MIN_FILTER   0x2801
+#define GL_VERTEX_ARRAY         0x8074
+#define GL_TEXTURE_COORD_ARRAY  0x8078
+
+void glBindTexture(GLenum target, GLuint texture);
+void glDeleteTextures(GLsizei n, const GLuint *textures);
+void glDrawArrays(GLenum mode, GLint first, GLsizei count);
+void glEnable(GLenum cap);
+void glEnableClientState(GLenum array);
+void glGenTextures(GLsizei n, GLuint *textures);
+void glTexCoordPointer(GLint size, GLenum type, GLsizei stride, const void *pointer);
+void glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height,
+                  GLint border, GLenum format, GLenum type, const void *pixels);
+void glTexParameteri(GLenum target, GLenum pname, GLint param);
+void glVertexPointer(GLint size, GLenum type, GLsizei stride, const void *pointer);
+
+#endif /* TESTSTUB_GL_H */
@@ -0,0 +1,36 @@
+/***************************************************************************
+*
+*   ilclient.h
+*
+*   Stand-in for the hello_pi ilclient header, for building latencytest on
+*   a host without /opt/vc. Only the types in video_gl.h are declared; the
+*   cursor path makes no OpenMAX calls.
+*
+****************************************************************************/
+
+#ifndef TESTSTUB_ILCLIENT_H
+#define TESTSTUB_ILCLIENT_H
+
+#include <stdint.h>
+
+typedef void *OMX_HANDLETYPE;
+
+typedef struct {
+    uint8_t     *pBuffer;
+    uint32_t    nAllocLen;
+    uint32_t    nFilledLen;
+    uint32_t    nOffset;
+    uint32_t    nFlags;
+} OMX_BUFFERHEADERTYPE;
+
+typedef struct COMPONENT_T COMPONENT_T;
+typedef struct ILCLIENT_T ILCLIENT_T;
+
+typedef struct {
+    COMPONENT_T *source;
+    int         source_port;
+    COMPONENT_T *sink;
+    int         sink_port;
+} TUNNEL_T;
+
+#endif /* TESTSTUB_ILCLIENT_H */
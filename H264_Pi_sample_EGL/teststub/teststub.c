@@ -0,0 +1,278 @@
+/***************************************************************************
+*
+*   teststub.c
+*
+*   Host implementations of the dispmanx, EGL and GLES calls made by the
+*   cursor path, so that egl.c can run under Xvfb. Handles are counters
+*   and updates complete at once. A thread calls the vsync callback at
+*   60 Hz, so the vsync stage of the latency stats sees a realistic wait;
+*   the other stages measure the X round trips and the plugin's own work.
+*
+****************************************************************************/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "bcm_host.h"
+#include "EGL/egl.h"
+#include "EGL/eglext.h"
+#include "GLES/gl.h"
+
+#define VSYNC_NS    16666667
+
+static uint32_t                 next_handle = 1;
+
+static pthread_mutex_t          vsync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t                vsync_thread;
+static DISPMANX_CALLBACK_FUNC_T vsync_func;
+static void                     *vsync_arg;
+
+static uint32_t new_handle(void)
+{
+    return __sync_fetch_and_add(&next_handle, 1);
+}
+
+/* dispmanx */
+
+DISPMANX_DISPLAY_HANDLE_T vc_dispmanx_display_open(uint32_t device)
+{
+    return new_handle();
+}
+
+int vc_dispmanx_display_close(DISPMANX_DISPLAY_HANDLE_T display)
+{
+    return 0;
+}
+
+DISPMANX_UPDATE_HANDLE_T vc_dispmanx_update_start(int32_t priority)
+{
+    return new_handle();
+}
+
+int vc_dispmanx_update_submit(DISPMANX_UPDATE_HANDLE_T update, DISPMANX_CALLBACK_FUNC_T cb_func, void *cb_arg)
+{
+    if (cb_func) {
+        cb_func(update, cb_arg);
+    }
+    return 0;
+}
+
+int vc_dispmanx_update_submit_sync(DISPMANX_UPDATE_HANDLE_T update)
+{
+    return 0;
+}
+
+DISPMANX_ELEMENT_HANDLE_T vc_dispmanx_element_add(DISPMANX_UPDATE_HANDLE_T update, DISPMANX_DISPLAY_HANDLE_T display,
+                                                  int32_t layer, const VC_RECT_T *dest_rect,
+                                                  DISPMANX_RESOURCE_HANDLE_T src, const VC_RECT_T *src_rect,
+                                                  DISPMANX_PROTECTION_T protection, VC_DISPMANX_ALPHA_T *alpha,
+                                                  void *clamp, VC_IMAGE_TRANSFORM_T transform)
+{
+    return new_handle();
+}
+
+int vc_dispmanx_element_change_attributes(DISPMANX_UPDATE_HANDLE_T update, DISPMANX_ELEMENT_HANDLE_T element,
+                                          uint32_t change_flags, int32_t layer, uint8_t opacity,
+                                          const VC_RECT_T *dest_rect, const VC_RECT_T *src_rect,
+                                          DISPMANX_RESOURCE_HANDLE_T mask, VC_IMAGE_TRANSFORM_T transform)
+{
+    return 0;
+}
+
+int vc_dispmanx_element_modified(DISPMANX_UPDATE_HANDLE_T update, DISPMANX_ELEMENT_HANDLE_T element, const VC_RECT_T *rect)
+{
+    return 0;
+}
+
+int vc_dispmanx_element_remove(DISPMANX_UPDATE_HANDLE_T update, DISPMANX_ELEMENT_HANDLE_T element)
+{
+    return 0;
+}
+
+DISPMANX_RESOURCE_HANDLE_T vc_dispmanx_resource_create(VC_IMAGE_TYPE_T type, uint32_t width, uint32_t height, uint32_t *native_image_handle)
+{
+    return new_handle();
+}
+
+int vc_dispmanx_resource_delete(DISPMANX_RESOURCE_HANDLE_T res)
+{
+    return 0;
+}
+
+int vc_dispmanx_resource_write_data(DISPMANX_RESOURCE_HANDLE_T res, VC_IMAGE_TYPE_T src_type, int src_pitch,
+                                    void *src_address, const VC_RECT_T *rect)
+{
+    return 0;
+}
+
+int vc_dispmanx_rect_set(VC_RECT_T *rect, uint32_t x_offset, uint32_t y_offset, uint32_t width, uint32_t height)
+{
+    rect->x = x_offset;
+    rect->y = y_offset;
+    rect->width = width;
+    rect->height = height;
+    return 0;
+}
+
+static void *vsync_run(void *unused)
+{
+    struct timespec next;
+    DISPMANX_CALLBACK_FUNC_T func;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    do {
+        next.tv_nsec += VSYNC_NS;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        pthread_mutex_lock(&vsync_lock);
+        func = vsync_func;
+        if (func) {
+            func(0, vsync_arg);
+        }
+        pthread_mutex_unlock(&vsync_lock);
+    } while (func);
+
+    return NULL;
+}
+
+/* A callback starts the vsync thread, NULL stops it. */
+
+int vc_dispmanx_vsync_callback(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_CALLBACK_FUNC_T cb_func, void *cb_arg)
+{
+    int start, stop;
+
+    pthread_mutex_lock(&vsync_lock);
+    start = cb_func && !vsync_func;
+    stop = !cb_func && vsync_func;
+    vsync_func = cb_func;
+    vsync_arg = cb_arg;
+    pthread_mutex_unlock(&vsync_lock);
+
+    if (start) {
+        pthread_create(&vsync_thread, NULL, vsync_run, NULL);
+    } else if (stop) {
+        pthread_join(vsync_thread, NULL);
+    }
+
+    return 0;
+}
+
+/* EGL */
+
+EGLDisplay eglGetDisplay(void *display_id)
+{
+    return (EGLDisplay)(uintptr_t)new_handle();
+}
+
+EGLBoolean eglInitialize(EGLDisplay dpy, EGLint *major, EGLint *minor)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglSaneChooseConfigBRCM(EGLDisplay dpy, const EGLint *attrib_list, EGLConfig *configs, EGLint config_size, EGLint *num_config)
+{
+    *configs = (EGLConfig)(uintptr_t)new_handle();
+    *num_config = 1;
+    return EGL_TRUE;
+}
+
+EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig config, EGLContext share_context, const EGLint *attrib_list)
+{
+    return (EGLContext)(uintptr_t)new_handle();
+}
+
+EGLSurface eglCreateWindowSurface(EGLDisplay dpy, EGLConfig config, void *win, const EGLint *attrib_list)
+{
+    return (EGLSurface)(uintptr_t)new_handle();
+}
+
+EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surface)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglTerminate(EGLDisplay dpy)
+{
+    return EGL_TRUE;
+}
+
+EGLint eglGetError(void)
+{
+    return 0x3000;  /* EGL_SUCCESS */
+}
+
+EGLImageKHR eglCreateImageKHR(EGLDisplay dpy, EGLContext ctx, int target, EGLClientBuffer buffer, const EGLint *attrib_list)
+{
+    return (EGLImageKHR)(uintptr_t)new_handle();
+}
+
+EGLBoolean eglDestroyImageKHR(EGLDisplay dpy, EGLImageKHR image)
+{
+    return EGL_TRUE;
+}
+
+/* GLES */
+
+void glBindTexture(GLenum target, GLuint texture)
+{
+}
+
+void glDeleteTextures(GLsizei n, const GLuint *textures)
+{
+}
+
+void glDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+}
+
+void glEnable(GLenum cap)
+{
+}
+
+void glEnableClientState(GLenum array)
+{
+}
+
+void glGenTextures(GLsizei n, GLuint *textures)
+{
+    while (n-- > 0) {
+        *textures++ = new_handle();
+    }
+}
+
+void glTexCoordPointer(GLint size, GLenum type, GLsizei stride, const void *pointer)
+{
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height,
+                  GLint border, GLenum format, GLenum type, const void *pixels)
+{
+}
+
+void glTexParameteri(GLenum target, GLenum pname, GLint param)
+{
+}
+
+void glVertexPointer(GLint size, GLenum type, GLsizei stride, const void *pointer)
+{
+}
@@ -11,6 +11,7 @@
 
 #include <stdarg.h>
 #include "video_gl.h"
+#include "pixops.h"
 
 //#define TRACING_ENABLED
 
@@ -21,9 +22,9 @@ struct H264_decoder	H264_decoder = {
     1920,
     1080,
     60,
-    0, 
+    H264_OPTION_LOSSLESS | H264_OPTION_PREFER_TEXT_RECTS | H264_OPTION_SMALL_FRAME_SUPPORT,
     H264_CHROMA_FORMAT_444,
-    0,                 /* Preferred alpha value for lossless objects. */
+    255,               /* Preferred alpha value for lossless objects. */
     PIXEL_FORMAT_ARGB, /* Preferred pixel format for lossless objects. */
     &v3_init,
     &v3_open_context,
@@ -34,10 +35,26 @@ struct H264_decoder	H264_decoder = {
     &v3_push_frame,
     &v3_close_context,
     &v3_end,
+    MAX_CANVASSES,
+    &v3_create_canvas,
+    &v3_create_h264_context,
+    &v3_get_pointer_for_image,
+    &v3_copy_image,
+    &v3_copy_rect,
+    &v3_fill_rect,
+    &v3_push_canvas,
+    &v3_destroy_canvas,
+    &v3_show_cursor,
+    &v3_hide_cursor,
 };
 
 OMXH264_decoder *hw_decoder = NULL;
 
+/* V2 canvasses; a CANV_context is the index + 1. */
+static OMXH264_canvas canvases[MAX_CANVASSES];
+
+static int next_context_id = 1;
+
 /* All exported by the main process. */
 extern Display *GetICADisplay();
 extern BOOL TwiModeEnableFlag;  /* Seamless enabled? */
@@ -158,7 +175,15 @@ int port_settings_changed(OMXH264_decoder *decoder, int again)
         /* Enable output port. */
         OMX_SendCommand(decoder->image_resize->handle, OMX_CommandPortEnable, decoder->image_resize->out_port, NULL);
 
-        decoder->output_buffer = hw_decoder->fb->data;
+        if (!decoder->output_buffer) {
+            /* Decode into our own buffer. The frame shown is composed from
+             * it and the lossless overlay in fb on push.
+             */
+            if (posix_memalign(&decoder->output_buffer, 16, portdef.nBufferSize) != 0) {
+                decoder->output_buffer = NULL;
+                DEBUG_TRACE("Couldn't allocate decode buffer\n");
+            }
+        }
 
         ret = OMX_UseBuffer(decoder->image_resize->handle, &decoder->outbuf, decoder->image_resize->out_port, NULL, portdef.nBufferSize, decoder->output_buffer);
     }
@@ -207,7 +232,10 @@ void fill_buffer_done(void* data, COMPONENT_T* comp)
     pthread_mutex_unlock(&fill_buffer_done_mutex);
 }
 
-BOOL setup_decoder()
+/* "resize" decodes into memory (seamless, canvasses) rather than
+ * through EGL.
+ */
+BOOL setup_decoder(BOOL resize)
 {
     if (hw_decoder != NULL) {
         return FALSE;
@@ -242,25 +270,36 @@ BOOL setup_decoder()
     hw_decoder->dest_y = 0;
     hw_decoder->ica_window = (Window)0;
     hw_decoder->ica_parent = (Window)0;
-    hw_decoder->window_reader = (pthread_t)0;
-    hw_decoder->mouse_reader = (pthread_t)0;
     hw_decoder->mouse_fd = -1;
-    hw_decoder->terminate_readers = 0;
+    hw_decoder->events.thread = (pthread_t)0;
+    hw_decoder->events.epoll_fd = -1;
+    hw_decoder->events.wake_fd = -1;
+    hw_decoder->events.num_sources = 0;
+    hw_decoder->ev_disp = NULL;
+    hw_decoder->ev_gc = None;
+    hw_decoder->tracked_parent = (Window)0;
     hw_decoder->cursor.X_cur = NULL;
     hw_decoder->cursor.image = NULL;
     hw_decoder->cursor.lx = hw_decoder->cursor.ly = 0;
+    hw_decoder->cursor.recreate = FALSE;
+    pthread_mutex_init(&hw_decoder->cursor.lock, NULL);
     hw_decoder->fb = 0;
     hw_decoder->size = 0;
     hw_decoder->old_ptr = NULL;
     hw_decoder->egl_render = NULL;
     hw_decoder->image_resize = NULL;
     hw_decoder->renderer_init = 0;
+    memset(&hw_decoder->overlay, 0, sizeof(hw_decoder->overlay));
+    memset(&hw_decoder->small_frames, 0, sizeof(hw_decoder->small_frames));
+    memset(&hw_decoder->damage, 0, sizeof(hw_decoder->damage));
+    hw_decoder->h264_context = H264_INVALID_CONTEXT;
+    hw_decoder->canvas = CANV_INVALID_CONTEXT;
 
     /* If we're in seamless, do not use EGL rendering. */
-    comp_details **comp_out = TwiModeEnableFlag ? &(hw_decoder->image_resize) : &(hw_decoder->egl_render);
+    comp_details **comp_out = resize ? &(hw_decoder->image_resize) : &(hw_decoder->egl_render);
 
     *comp_out = init_component(hw_decoder, 
-                               TwiModeEnableFlag ? "resize" : "egl_render", 
+                               resize ? "resize" : "egl_render", 
                                ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_OUTPUT_BUFFERS, 
                                OMX_IndexParamImageInit);
     if (!(*comp_out)) {
@@ -270,6 +309,7 @@ BOOL setup_decoder()
     set_tunnel(hw_decoder->tunnel, hw_decoder->image_decode->component, hw_decoder->image_decode->out_port, (*comp_out)->component, (*comp_out)->in_port);
 
     memset(&hw_decoder->shm_info, 0, sizeof(hw_decoder->shm_info));
+    hw_decoder->shm_info.shmid = -1;
 
     ilclient_change_component_state(hw_decoder->image_decode->component, OMX_StateIdle);
 
@@ -306,17 +346,11 @@ static void close_decoder()
             deinit_ogl(hw_decoder);
             components[1] = hw_decoder->egl_render->component;
         } else if (hw_decoder->image_resize) {
-            if (-1 != hw_decoder->shm_info.shmid) {
-                XShmDetach(hw_decoder->disp, &hw_decoder->shm_info);
-                /* Free shared memory. */
-                shmdt(hw_decoder->shm_info.shmaddr);
-                shmctl(hw_decoder->shm_info.shmid, IPC_RMID, 0);
-            }
+            ximage_destroy(hw_decoder->disp, hw_decoder->fb, &hw_decoder->shm_info, hw_decoder->old_ptr);
 
-            if (hw_decoder->fb) {
-                hw_decoder->fb->data = hw_decoder->old_ptr;
-                XDestroyImage(hw_decoder->fb);
-            }
+            free(hw_decoder->output_buffer);
+            hw_decoder->output_buffer = NULL;
+            overlay_destroy(&hw_decoder->overlay);
             components[1] = hw_decoder->image_resize->component;
         }
 
@@ -338,11 +372,27 @@ static void close_decoder()
     
         OMX_Deinit();
 
+        damage_free(&hw_decoder->damage);
+        pthread_mutex_destroy(&hw_decoder->cursor.lock);
         free(hw_decoder);
         hw_decoder = NULL;
     }
 }
 
+/* Call from the thread that drives the context, as for the v3_ entry
+ * points; an overlay that was never created has an empty cache.
+ */
+
+void ctxh264_bitmap_cache_stats(struct ctxh264_bitmap_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if (hw_decoder) {
+        bitmap_cache_add_stats(&hw_decoder->overlay.cache, stats);
+        bitmap_cache_add_stats(&hw_decoder->small_frames.cache, stats);
+    }
+}
+
 int decode_frame(OMXH264_decoder *decoder, unsigned char *data, int size, int last)
 {
     static OMX_BUFFERHEADERTYPE *buf = 0;
@@ -476,18 +526,31 @@ void v3_end ()
 {
     DEBUG_TRACE("V3_END, pthread=0x%x\n", pthread_self());
     close_decoder();
+    shm_arena_flush();
+}
+
+/* V2.1: Receiver wants the cursor shown or hidden, e.g. around full-screen
+ * video. The state is kept across contexts by egl.c.
+ */
+void v3_show_cursor()
+{
+    show_egl_cursor(hw_decoder && hw_decoder->egl_render ? hw_decoder : NULL);
+}
+
+void v3_hide_cursor()
+{
+    hide_egl_cursor(hw_decoder && hw_decoder->egl_render ? hw_decoder : NULL);
 }
 
 H264_context v3_open_context(int width, int height, void* codec_data, int len, unsigned int options)
 {
     DEBUG_TRACE("V3_OPEN, pthread=0x%x\n", pthread_self());
-    static int id = 1;
 
     /* Close the existing context if it exists. */
     close_decoder();
 
     /* Set up decoder and create context. */
-    if (!setup_decoder()) {
+    if (!setup_decoder(TwiModeEnableFlag)) {
         /* Couldn't set up decoder. */
         return H264_INVALID_CONTEXT;
     }
@@ -497,99 +560,100 @@ H264_context v3_open_context(int width, int height, void* codec_data, int len, u
         hw_decoder->width = width;
         hw_decoder->height = height;
 
+        damage_init(&hw_decoder->damage, width, height);
+        overlay_create(&hw_decoder->overlay, width, height);
+
         if (hw_decoder->egl_render) {
+            overlay_create(&hw_decoder->small_frames, width, height);
+
             /* Ensure that EGL is initialized on the same thread.
              * Not doing so could result in resources not being deallocated.
              */
             init_ogl(hw_decoder);
         } else if (hw_decoder->image_resize) {
             /* Seamless. */
-            int major, minor;
-            Bool pixmaps;
-            
-            /* Try to use MIT-SHM. */
-            BOOL g_using_shm = XShmQueryExtension(hw_decoder->disp) &&
-                          XShmQueryVersion(hw_decoder->disp, &major, &minor, &pixmaps);
-
-            DEBUG_TRACE("shm=%d\n", g_using_shm);
-
-            if (g_using_shm) {
-                /* Use MIT-SHM. */
-                hw_decoder->fb = XShmCreateImage(hw_decoder->disp, DefaultVisualOfScreen(hw_decoder->scr),
-                          DefaultDepthOfScreen(hw_decoder->scr), ZPixmap, NULL, &hw_decoder->shm_info,
-                          width, height);
-                if (hw_decoder->fb) {
-                    hw_decoder->size = hw_decoder->fb->bytes_per_line * height;
-                }
-            } else {
-                /* Use XPutImage. */
-                hw_decoder->fb = XCreateImage(hw_decoder->disp, DefaultVisualOfScreen(hw_decoder->scr),
-                          DefaultDepthOfScreen(hw_decoder->scr), ZPixmap, 0, NULL, width, height,
-                          32, 0);
-                if (hw_decoder->fb) {
-                    hw_decoder->size = hw_decoder->fb->bytes_per_line * height;
-                }
-            }
-
-            if (hw_decoder->size > 0) {
-                hw_decoder->shm_info.shmid = -1;
-                if (g_using_shm) {
-                    /* Allocated shared memory, aligned on a 16 byte boundary. */
-                    hw_decoder->shm_info.shmseg = None;
-                    hw_decoder->shm_info.readOnly = 0;
-                    hw_decoder->shm_info.shmid = shmget(IPC_PRIVATE, hw_decoder->size + 32, IPC_CREAT | 0600);
-                    hw_decoder->shm_info.shmaddr = (char *)shmat(hw_decoder->shm_info.shmid, 0, 0);
-
-                    /* Tell the X server to attach the segment.
-                     */
-                    if (XShmAttach(hw_decoder->disp, &hw_decoder->shm_info) > 0) {
-                        hw_decoder->fb->data = (char *)hw_decoder->shm_info.shmaddr;
-                        /* Mark the shared memory for removal now, so that it does
-                         * not remain if this program dies unexpectedly.
-                         */
-                        shmctl(hw_decoder->shm_info.shmid, IPC_RMID, 0);
-                    } else {                    
-                        /* Error - free shared memory. */
-                        shmdt(hw_decoder->shm_info.shmaddr);
-                        shmctl(hw_decoder->shm_info.shmid, IPC_RMID, 0);
-                        hw_decoder->shm_info.shmid = -1;
-                    }
-                }
-
-                if (-1 == hw_decoder->shm_info.shmid) {
-                    /* Use traditional memory for XPutImage(). This memory is freed
-                     * by XDestroyImage();
-                     */
-                    hw_decoder->fb->data = (char *)malloc(hw_decoder->size + 32);
-                    hw_decoder->old_ptr = (void *)hw_decoder->fb->data;
-                }
-                /* Align. */
-                hw_decoder->fb->data = (char *)(((unsigned int)(hw_decoder->fb->data) + 15) & ~0x0F);
+            hw_decoder->fb = ximage_create(hw_decoder->disp, hw_decoder->scr, width, height,
+                                           &hw_decoder->shm_info, &hw_decoder->old_ptr);
+            if (hw_decoder->fb) {
+                hw_decoder->size = hw_decoder->fb->bytes_per_line * height;
             }
         }
 
-        return id++;
+        hw_decoder->h264_context = next_context_id++;
+        return hw_decoder->h264_context;
     }
 
 	return H264_INVALID_CONTEXT;
 }
 
+/* There is one decoder. Calls naming a context that was refused or has
+ * since been closed must not reach whichever context now has it.
+ */
+static BOOL live_context(H264_context Ctx)
+{
+    return hw_decoder && Ctx != H264_INVALID_CONTEXT && hw_decoder->h264_context == Ctx;
+}
+
 void v3_close_context(H264_context Ctx)
 {
-    DEBUG_TRACE("V3_CLOSE, pthread=0x%x\n", pthread_self());
-    close_decoder();
+    DEBUG_TRACE("V3_CLOSE %u, pthread=0x%x\n", Ctx, pthread_self());
+
+    if (live_context(Ctx)) {
+        close_decoder();
+    }
+    shm_arena_trim();
+}
+
+/* Seamless: small frames are drawn straight into the decoded frame. The
+ * next H.264 frame replaces the whole buffer, which purges them.
+ */
+static void compose_small_frame(OMXH264_decoder *decoder, struct image_buf *obj)
+{
+    SIGNED_RECT rect;
+    uint8_t *dst;
+    unsigned int flags = PIXOPS_OPAQUE;
+
+    rect.left = max(obj->dst_x, 0);
+    rect.top = max(obj->dst_y, 0);
+    rect.right = min(obj->dst_x + (int)obj->width, decoder->width);
+    rect.bottom = min(obj->dst_y + (int)obj->height, decoder->height);
+
+    if (!decoder->output_buffer || rect.left >= rect.right || rect.top >= rect.bottom) {
+        return;
+    }
+
+    dst = (uint8_t *)decoder->output_buffer + (rect.top * decoder->stride) + (rect.left * 4);
+
+    if (IMAGE_OP_SMALL_FRAME_SOLID_FILL == obj->lossless_op) {
+        pixops_fill((uint32_t *)dst, decoder->stride, rect.right - rect.left, rect.bottom - rect.top,
+                    0xff000000 | obj->col);
+    } else if (obj->bits) {
+        if (PIXEL_FORMAT_BGRA == obj->pixel_format) {
+            flags |= PIXOPS_SWAP_BGRA;
+        }
+        pixops_copy_argb((uint32_t *)dst, decoder->stride,
+                         (uint8_t *)obj->bits + ((rect.top - obj->dst_y) * obj->stride) + ((rect.left - obj->dst_x) * 4),
+                         obj->stride, rect.right - rect.left, rect.bottom - rect.top, flags);
+    }
+
+    damage_add(&decoder->damage, &rect);
 }
 
 bool v3_start_frame(H264_context Ctx, unsigned int encoded_size, SIGNED_RECT dirty_rects[], unsigned int num_rects)
 {
     unsigned int i;
 
+    if (!live_context(Ctx)) {
+        return 0;
+    }
+
     /* Save the dirty rects for this frame. */
-    if (num_rects > 0) {
+    if (num_rects > 0 && num_rects <= sizeof(hw_decoder->dirty_rects) / sizeof(hw_decoder->dirty_rects[0])) {
         for (i = 0; i < num_rects; i++) {
             hw_decoder->dirty_rects[i] = dirty_rects[i];        
         }
         hw_decoder->num_rects = num_rects;
+        hw_decoder->dirty_given = TRUE;
     } else {
         /* No dirty rect means entire context needs updating. */
         hw_decoder->dirty_rects[0].left = 0;
@@ -597,6 +661,22 @@ bool v3_start_frame(H264_context Ctx, unsigned int encoded_size, SIGNED_RECT dir
         hw_decoder->dirty_rects[0].right = hw_decoder->width;
         hw_decoder->dirty_rects[0].bottom = hw_decoder->height;
         hw_decoder->num_rects = 1;
+        hw_decoder->dirty_given = FALSE;
+    }
+
+    /* Seamless must also re-push the last frame on expose; dispmanx
+     * elements keep showing it by themselves. A canvas keeps its pixels,
+     * and is only told once the frame is decoded (v3_decode_frame()).
+     */
+    if (hw_decoder->canvas == CANV_INVALID_CONTEXT && (encoded_size > 0 || hw_decoder->image_resize)) {
+        for (i = 0; i < hw_decoder->num_rects; i++) {
+            damage_add(&hw_decoder->damage, &hw_decoder->dirty_rects[i]);
+        }
+    }
+
+    if (encoded_size > 0) {
+        /* A new H.264 frame replaces any small frames. */
+        overlay_clear(&hw_decoder->small_frames);
     }
 
 	return 1;
@@ -604,40 +684,109 @@ bool v3_start_frame(H264_context Ctx, unsigned int encoded_size, SIGNED_RECT dir
 
 bool v3_decode_frame(H264_context Ctx, void* H264_data, int len, bool last)
 {
-    decode_frame(hw_decoder, H264_data, len, last);
+    unsigned int i;
+
+    if (!live_context(Ctx)) {
+        return 0;
+    }
+
+    if (0 == decode_frame(hw_decoder, H264_data, len, last) && last &&
+        hw_decoder->canvas != CANV_INVALID_CONTEXT) {
+        /* The resizer output is in, to go to the canvas before whatever is
+         * drawn there next.
+         */
+        for (i = 0; i < hw_decoder->num_rects; i++) {
+            damage_add(&hw_decoder->damage, &hw_decoder->dirty_rects[i]);
+        }
+    }
 
 	return 1;
 }
 
 bool v3_compose_with_fb(H264_context Ctx, struct image_buf *fb, SIGNED_RECT interesting_rects[], unsigned int num_rects)
 {
+    if (!live_context(Ctx)) {
+        return 0;
+    }
+
+    if (num_rects > 0) {
+        overlay_compose_fb(&hw_decoder->overlay, fb, interesting_rects, num_rects);
+    } else {
+        /* Whole buffer: skip the tiles known to be empty, other than
+         * those under the frame's dirty rects.
+         */
+        overlay_compose_fb_tiles(&hw_decoder->overlay, fb, hw_decoder->dirty_rects,
+                                 hw_decoder->dirty_given ? hw_decoder->num_rects : 0);
+    }
+
 	return 1;
 }
 
 bool v3_compose_with_rects(H264_context Ctx, struct image_buf rects[], unsigned int num_rects, bool last)
 {
+    unsigned int i;
+
+    if (!live_context(Ctx)) {
+        return 0;
+    }
+
+    /* Applied to the overlay's CPU copy; it is shown on push. */
+    for (i = 0; i < num_rects; i++) {
+        switch (rects[i].lossless_op) {
+        case IMAGE_OP_DRAW_LOSSLESS:
+            overlay_draw(&hw_decoder->overlay, &rects[i]);
+            break;
+        case IMAGE_OP_DELETE_LOSSLESS:
+            overlay_erase(&hw_decoder->overlay, &rects[i]);
+            break;
+        case IMAGE_OP_SMALL_FRAME_BITMAP:
+        case IMAGE_OP_SMALL_FRAME_SOLID_FILL:
+            if (hw_decoder->egl_render) {
+                if (IMAGE_OP_SMALL_FRAME_BITMAP == rects[i].lossless_op) {
+                    overlay_draw(&hw_decoder->small_frames, &rects[i]);
+                } else {
+                    overlay_fill(&hw_decoder->small_frames, &rects[i]);
+                }
+            } else if (hw_decoder->image_resize) {
+                compose_small_frame(hw_decoder, &rects[i]);
+            }
+            break;
+        }
+    }
+
 	return 1;
 }
 
-static bool intersects(SIGNED_RECT *r1, SIGNED_RECT *r2, SIGNED_RECT *r3)
+/* Seamless: build the shown frame for "rect" from the decoded frame and
+ * the lossless overlay.
+ */
+static void compose_rect(OMXH264_decoder *decoder, SIGNED_RECT *rect)
 {
-    r3->top = max(r1->top, r2->top);
-    r3->bottom = min(r1->bottom, r2->bottom);
-    if (r3->top >= r3->bottom) {
-        return 0;
+    int left = max(rect->left, 0);
+    int top = max(rect->top, 0);
+    int right = min(rect->right, decoder->width);
+    int bottom = min(rect->bottom, decoder->height);
+    int bpl = decoder->fb->bytes_per_line;
+
+    if (left >= right || top >= bottom) {
+        return;
     }
 
-    r3->left = max(r1->left, r2->left);
-    r3->right = min(r1->right, r2->right);
-    if (r3->left >= r3->right) {
-        return 0;
+    if (decoder->output_buffer && decoder->stride > 0) {
+        pixops_copy_argb((uint32_t *)(decoder->fb->data + (top * bpl)) + left, bpl,
+                         (uint8_t *)decoder->output_buffer + (top * decoder->stride) + (left * 4), decoder->stride,
+                         right - left, bottom - top, 0);
     }
 
-    return 1;
+    overlay_compose(&decoder->overlay, decoder->fb->data, bpl, rect);
 }
 
 bool v3_push_frame(H264_context Ctx, struct window_info windows[], unsigned int num_windows, bool wait, bool *pushed)
 {
+    if (!live_context(Ctx)) {
+        return 0;
+    }
+
     if (hw_decoder->egl_render) {
         /* Non-seamless rendering. */
         if ((1 == num_windows) && (0 == hw_decoder->ica_window)) {
@@ -660,88 +809,285 @@ bool v3_push_frame(H264_context Ctx, struct window_info windows[], unsigned int
                 n = 0;
             }
 
-            move_egl_display(hw_decoder, TRUE);
+            move_egl_display(hw_decoder, hw_decoder->disp, TRUE);
+        }
+
+        /* Only redraw for a new decoded frame. */
+        if (damage_present_all(&hw_decoder->damage)) {
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            eglSwapBuffers(hw_decoder->display, hw_decoder->surface);
         }
 
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        eglSwapBuffers(hw_decoder->display, hw_decoder->surface);
+        overlay_flush(&hw_decoder->small_frames, NULL);
+        overlay_flush(&hw_decoder->overlay, NULL);
 
-    } else if (hw_decoder->image_resize) {
+    } else if (hw_decoder->image_resize && hw_decoder->fb) {
 
         static GC gc = None;
-        unsigned int i;
-        int j;
+        SIGNED_RECT rects[DAMAGE_MAX_RECTS];
+        int j, n;
 
         if (gc == None) {
             /* Create a re-usable graphics context. */
             gc = XCreateGC(hw_decoder->disp, DefaultRootWindow(hw_decoder->disp), 0, 0);
         }
 
+        /* Areas where only lossless text changed must be shown too. */
+        overlay_flush(&hw_decoder->overlay, &hw_decoder->damage);
+
+        n = damage_rects(&hw_decoder->damage, rects, DAMAGE_MAX_RECTS);
+        damage_account(&hw_decoder->damage, rects, n);
+
+        for (j = 0; j < n; j++) {
+            compose_rect(hw_decoder, &rects[j]);
+        }
+
         /* Show composed frame buffer. We must work out, based on the dirty rects.
          * what portions of the window(s) require updating.
          */
-
-        for (i = 0; i < num_windows; i++) {
-	        Window X_window = windows[i].id;
-            SIGNED_RECT window_rect = windows[i].rect;
-
-            /* Check if any of the dirty rects lie within this window. */
-            for (j = 0; j < hw_decoder->num_rects; j++) {
-                SIGNED_RECT dirty_rect = hw_decoder->dirty_rects[j];
-                SIGNED_RECT overlap;
-
-                if (intersects(&window_rect, &dirty_rect, &overlap)) {
-                    int width, height, src_x, src_y, dest_x, dest_y;
-
-                    if (-1 != hw_decoder->shm_info.shmid) {
-                        /* No special alignment required. */
-                        width = overlap.right - overlap.left;
-                        height = overlap.bottom - overlap.top;
-
-                        src_x = overlap.left;
-                        src_y = overlap.top;
-
-                        dest_x = windows[i].target_x + overlap.left;
-                        dest_y = windows[i].target_y + overlap.top;
-
-                        XShmPutImage(hw_decoder->disp, 
-                                X_window, gc, hw_decoder->fb,
-                                src_x,
-                                src_y,
-                                dest_x,
-                                dest_y,
-                                width, 
-                                height, 
-                                1);
-                    } else {
-                        /* XPutImage - no special alignment required. */
-                        width = overlap.right - overlap.left;
-                        height = overlap.bottom - overlap.top;
-
-                        src_x = overlap.left;
-                        src_y = overlap.top;
-
-                        dest_x = windows[i].target_x + overlap.left;
-                        dest_y = windows[i].target_y + overlap.top;
-
-                        XPutImage(hw_decoder->disp, 
-                                X_window, gc, hw_decoder->fb,
-                                src_x,
-                                src_y,
-                                dest_x,
-                                dest_y,
-                                width, 
-                                height);
-                        /* No need to wait for syncrhonization with XPutImage(). */
-                    }
-                }
-            }
-     	}
+        ximage_put(hw_decoder->disp, gc, hw_decoder->fb, &hw_decoder->shm_info,
+                   windows, num_windows, rects, n);
     }
 
+    /* Idle segments are released here, on Receiver's thread. */
+    shm_arena_trim();
+
     if (pushed) {
         *pushed = 1;
     }
 
 	return 1;
 }
+
+/************************ V2 CONVERGED MODE SUPPORT **********************/
+
+static OMXH264_canvas *get_canvas(CANV_context cxt)
+{
+    if (cxt < 1 || cxt > MAX_CANVASSES || !canvases[cxt - 1].in_use) {
+        return NULL;
+    }
+
+    return &canvases[cxt - 1];
+}
+
+/* Canvasses are ARGB whatever "pix_format" says. One mapped to a dispmanx
+ * display (see canvas_display()) is placed relative to the first canvas
+ * on that display, so each monitor of its own starts at the origin.
+ */
+CANV_context v3_create_canvas(int width, int height, LLPixelFormat pix_format, int x_off, int y_off)
+{
+    int i, j;
+
+    DEBUG_TRACE("V3_CREATE_CANVAS %dx%d at %d,%d\n", width, height, x_off, y_off);
+
+    for (i = 0; i < MAX_CANVASSES; i++) {
+        if (!canvases[i].in_use) {
+            int display = canvas_display(i);
+            int dst_x = 0, dst_y = 0;
+
+            for (j = 0; display >= 0 && j < MAX_CANVASSES; j++) {
+                if (canvases[j].in_use && canvases[j].display_num == display) {
+                    dst_x = x_off - canvases[j].x_off;
+                    dst_y = y_off - canvases[j].y_off;
+                    break;
+                }
+            }
+
+            if (!canvas_create(&canvases[i], GetICADisplay(), width, height, x_off, y_off,
+                               display, dst_x, dst_y)) {
+                break;
+            }
+            return i + 1;
+        }
+    }
+
+    return CANV_INVALID_CONTEXT;
+}
+
+/* The H.264 region is decoded through the resizer into memory, like
+ * seamless, with the lossless overlay over it, and committed to the canvas
+ * before the next operation on that canvas (see commit_decoded()).
+ */
+H264_context v3_create_h264_context(CANV_context cxt, SIGNED_RECT dest, ChromaFormat fmt)
+{
+    DEBUG_TRACE("V3_CREATE_H264_CONTEXT on %u, pthread=0x%x\n", cxt, pthread_self());
+
+    if (!get_canvas(cxt)) {
+        return H264_INVALID_CONTEXT;
+    }
+
+    if (hw_decoder && hw_decoder->h264_context != H264_INVALID_CONTEXT) {
+        /* One decoder: video on a second canvas is refused. */
+        DEBUG_TRACE("Context %u is still open\n", hw_decoder->h264_context);
+        return H264_INVALID_CONTEXT;
+    }
+
+    close_decoder();
+
+    if (!setup_decoder(TRUE)) {
+        return H264_INVALID_CONTEXT;
+    }
+
+    hw_decoder->width = dest.right - dest.left;
+    hw_decoder->height = dest.bottom - dest.top;
+    hw_decoder->canvas = cxt;
+    hw_decoder->canvas_rect = dest;
+
+    damage_init(&hw_decoder->damage, hw_decoder->width, hw_decoder->height);
+    overlay_create(&hw_decoder->overlay, hw_decoder->width, hw_decoder->height);
+
+    hw_decoder->h264_context = next_context_id++;
+    return hw_decoder->h264_context;
+}
+
+/* Copy what the H.264 context decoded, and the lossless overlay over it,
+ * into its canvas. Rects are in the context's coordinates, clipped to the
+ * canvas.
+ */
+static void decoded_to_canvas(OMXH264_decoder *decoder, OMXH264_canvas *canvas)
+{
+    SIGNED_RECT rects[DAMAGE_MAX_RECTS];
+    int x = decoder->canvas_rect.left, y = decoder->canvas_rect.top;
+    int i, n;
+
+    overlay_flush(&decoder->overlay, &decoder->damage);
+
+    n = damage_rects(&decoder->damage, rects, DAMAGE_MAX_RECTS);
+    damage_account(&decoder->damage, rects, n);
+
+    if (!canvas->bits) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        SIGNED_RECT *rect = &rects[i];
+        SIGNED_RECT shown;
+
+        rect->left = max(rect->left, -x);
+        rect->top = max(rect->top, -y);
+        rect->right = min(rect->right, canvas->width - x);
+        rect->bottom = min(rect->bottom, canvas->height - y);
+        if (rect->left >= rect->right || rect->top >= rect->bottom) {
+            continue;
+        }
+
+        if (decoder->output_buffer && decoder->stride > 0) {
+            canvas_draw(canvas, x + rect->left, y + rect->top,
+                        (uint8_t *)decoder->output_buffer + (rect->top * decoder->stride) + (rect->left * 4),
+                        decoder->stride, rect->right - rect->left, rect->bottom - rect->top, 0);
+        }
+
+        overlay_compose(&decoder->overlay, canvas->bits + (y * canvas->stride) + (x * 4), canvas->stride, rect);
+
+        shown.left = x + rect->left;
+        shown.top = y + rect->top;
+        shown.right = x + rect->right;
+        shown.bottom = y + rect->bottom;
+        damage_add(&canvas->damage, &shown);
+    }
+}
+
+/* Called before anything reads or writes canvas "cxt", so that drawing
+ * there lands over the video drawn before it rather than under it.
+ */
+static void commit_decoded(CANV_context cxt)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    if (canvas && hw_decoder && hw_decoder->canvas == cxt) {
+        decoded_to_canvas(hw_decoder, canvas);
+    }
+}
+
+/* Lets Receiver decode bitmaps straight into the canvas (see
+ * canvas_pointer()).
+ */
+void *v3_get_pointer_for_image(CANV_context cxt, SIGNED_RECT dest, int *stride)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    commit_decoded(cxt);
+
+    if (!canvas || !stride) {
+        return NULL;
+    }
+
+    return canvas_pointer(canvas, &dest, stride);
+}
+
+bool v3_copy_image(CANV_context cxt, SIGNED_RECT dest, struct image_buf *source)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    if (!canvas) {
+        return 0;
+    }
+
+    commit_decoded(cxt);
+    canvas_copy_image(canvas, &dest, source);
+
+    return 1;
+}
+
+bool v3_copy_rect(CANV_context dest_cxt, SIGNED_RECT dest, CANV_context src_cxt, SIGNED_RECT source)
+{
+    OMXH264_canvas *canvas = get_canvas(dest_cxt);
+    OMXH264_canvas *src = get_canvas(src_cxt);
+
+    if (!canvas || !src) {
+        return 0;
+    }
+
+    commit_decoded(src_cxt);
+    commit_decoded(dest_cxt);
+    canvas_copy_rect(canvas, &dest, src, &source);
+
+    return 1;
+}
+
+bool v3_fill_rect(CANV_context cxt, SIGNED_RECT rect, unsigned int rgb)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    if (!canvas) {
+        return 0;
+    }
+
+    commit_decoded(cxt);
+    canvas_fill(canvas, &rect, rgb);
+
+    return 1;
+}
+
+bool v3_push_canvas(CANV_context cxt, struct window_info windows[], unsigned int num_windows)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    if (!canvas) {
+        return 0;
+    }
+
+    /* Anything decoded since the last canvas operation. */
+    commit_decoded(cxt);
+    shm_arena_trim();
+
+    return canvas_push(canvas, GetICADisplay(), windows, num_windows);
+}
+
+void v3_destroy_canvas(CANV_context cxt)
+{
+    OMXH264_canvas *canvas = get_canvas(cxt);
+
+    DEBUG_TRACE("V3_DESTROY_CANVAS %u\n", cxt);
+
+    if (!canvas) {
+        return;
+    }
+
+    if (hw_decoder && hw_decoder->canvas == cxt) {
+        /* Receiver should have closed it first. */
+        hw_decoder->canvas = CANV_INVALID_CONTEXT;
+    }
+
+    canvas_destroy(canvas, GetICADisplay());
+}
@@ -62,8 +62,193 @@ typedef struct _OMXH264_cursor
     int                         width, height;
     int                         xhot, yhot;
     int                         lx, ly;
+    BOOL                        recreate;
+    pthread_mutex_t             lock;       /* Reader thread vs show/hide. */
 } OMXH264_cursor;
 
+/* Tile damage (damage.c). */
+
+#define DAMAGE_TILE         64
+#define DAMAGE_MAX_RECTS    64      /* Rects handed out per present. */
+
+typedef struct _OMXH264_damage
+{
+    uint32_t                    *bits;      /* One bit per tile. */
+    int                         width, height;
+    int                         tiles_x, tiles_y;
+    int                         words_x;    /* Words per row of tiles. */
+    BOOL                        empty;      /* Known to be clear. */
+    unsigned int                presents;
+    unsigned int                last_pixels;
+    unsigned long long          pixels;     /* Pushed, over all presents. */
+} OMXH264_damage;
+
+/* Cache of converted lossless bitmaps (bitmap_cache.c). */
+
+#define BITMAP_CACHE_SLOTS      512
+#define BITMAP_CACHE_PROBE      8
+#define BITMAP_CACHE_BYTES      (4 * 1024 * 1024)
+#define BITMAP_CACHE_MAX_ENTRY  (256 * 1024)
+
+/* Counters, for ctxh264_bitmap_cache_stats(). */
+
+struct ctxh264_bitmap_cache_stats {
+    unsigned long long          lookups;
+    unsigned long long          hits;
+    unsigned long long          skips;          /* Hits already on screen. */
+    unsigned long long          collisions;     /* Same key, other pixels. */
+    unsigned long long          bytes_saved;    /* Converted bytes copied on hits. */
+    size_t                      bytes_used;
+    unsigned int                entries;
+};
+
+typedef struct _OMXH264_bitmap
+{
+    uint64_t                    key;        /* bitmap_hash(). */
+    uint32_t                    *pixels;    /* Converted, width x height. */
+    uint32_t                    *source;    /* As sent, to check hits. */
+    int                         width, height;
+    int                         pixel_format;
+    unsigned int                last_used;
+    int                         x, y;       /* Where last drawn... */
+    uint32_t                    stamp;      /* ...and the overlay stamp it got. */
+} OMXH264_bitmap;
+
+typedef struct _OMXH264_bitmap_cache
+{
+    OMXH264_bitmap              slots[BITMAP_CACHE_SLOTS];
+    unsigned int                clock;
+    struct ctxh264_bitmap_cache_stats stats;
+} OMXH264_bitmap_cache;
+
+/* Lossless overlay (overlay.c). */
+
+#define OVERLAY_LAYER       1000    /* Above video, below cursor. */
+#define SMALL_FRAME_LAYER   500     /* Above video, below text. */
+#define OVERLAY_TILE        64      /* Pixels, for the used-tile summary. */
+
+typedef struct _OMXH264_overlay
+{
+    void                        *image;     /* CPU copy, ARGB. */
+    DISPMANX_RESOURCE_HANDLE_T  resource;
+    DISPMANX_ELEMENT_HANDLE_T   element;    /* 0 in seamless mode. */
+    uint32_t                    vc_image_ptr;
+    int                         width, height;
+    int                         stride;     /* Bytes. */
+    OMXH264_damage              damage;     /* Awaiting upload. */
+    unsigned char               *tiles;     /* Non-zero if tile may be non-transparent. */
+    uint32_t                    *stamps;    /* Stamp of the last write to each tile. */
+    int                         tiles_x, tiles_y;
+    uint32_t                    stamp;
+    unsigned char               *fb_tiles;  /* What the last scan of the lossless fb found. */
+    const void                  *fb_bits;   /* The fb it was of. */
+    int                         fb_stride;
+    int                         fb_refresh; /* Tile row of empty tiles to check next. */
+    OMXH264_bitmap_cache        cache;
+    BOOL                        opaque;     /* Shown ignoring alpha. */
+    DISPMANX_CALLBACK_FUNC_T    flushed;    /* Update from overlay_flush() done. */
+    void                        *flushed_arg;
+} OMXH264_overlay;
+
+/* Pooled MIT-SHM segments (shm_arena.c). */
+
+#define SHM_ARENA_SLOTS     8
+#define SHM_ARENA_IDLE_MS   30000   /* Released after this long unused. */
+
+typedef struct _OMXH264_shm_segment
+{
+    XShmSegmentInfo             info;
+    Display                     *disp;      /* Attached to. */
+    size_t                      size;       /* 0 if the slot is empty. */
+    BOOL                        in_use;
+    uint64_t                    released;   /* ms, when last given back. */
+} OMXH264_shm_segment;
+
+/* V2 canvasses (canvas.c). */
+
+#define MAX_CANVASSES       4
+#define CANVAS_LAYER        0
+
+typedef struct _OMXH264_canvas
+{
+    BOOL                        in_use;
+    int                         width, height;
+    int                         x_off, y_off;   /* From the display origin. */
+    uint8_t                     *bits;          /* ARGB. */
+    int                         stride;         /* Bytes. */
+    OMXH264_damage              damage;         /* Awaiting push. */
+
+    /* Shown through X... */
+    XImage                      *fb;
+    XShmSegmentInfo             shm_info;
+    void                        *old_ptr;
+    GC                          gc;
+
+    /* ...or by its own dispmanx element (CTXH264_CANVAS_DISPLAYS). */
+    int                         display_num;
+    DISPMANX_DISPLAY_HANDLE_T   display;
+    OMXH264_overlay             output;         /* image is the canvas memory. */
+    pthread_mutex_t             lock;
+    pthread_cond_t              done;
+    BOOL                        in_flight;      /* Last push not yet applied. */
+} OMXH264_canvas;
+
+struct _OMXH264_decoder;
+
+/* Event loop (event_loop.c). Handlers run on the loop thread. */
+
+#define MAX_EVENT_SOURCES   8
+
+typedef void (*EVENT_HANDLER)(struct _OMXH264_decoder *decoder, int fd, unsigned int events);
+
+typedef struct _OMXH264_event_source
+{
+    int                         fd;
+    EVENT_HANDLER               handler;
+    BOOL                        timer;      /* timerfd owned by the loop. */
+} OMXH264_event_source;
+
+typedef struct _OMXH264_event_loop
+{
+    pthread_t                   thread;
+    int                         epoll_fd;
+    int                         wake_fd;    /* eventfd for wakeup/shutdown. */
+    volatile int                terminate;
+    int                         num_sources;
+    OMXH264_event_source        sources[MAX_EVENT_SOURCES];
+} OMXH264_event_loop;
+
+/* Input-to-cursor latency histograms (latency.c). */
+
+#define LATENCY_BUCKETS     24
+
+enum {
+    LATENCY_QUERY,          /* Input arrival to pointer/shape check done. */
+    LATENCY_SUBMIT,         /* Input arrival to dispmanx submit returned. */
+    LATENCY_VSYNC,          /* Input arrival to the following vsync. */
+    LATENCY_STAGES
+};
+
+typedef struct _OMXH264_histogram
+{
+    unsigned int                count[LATENCY_BUCKETS];
+    unsigned int                samples;
+    unsigned int                max_us;
+    unsigned long long          total_us;
+} OMXH264_histogram;
+
+/* Samples are taken only when enabled by latency_init(); the histograms
+ * are dumped periodically or read with latency_snapshot().
+ */
+
+BOOL latency_init(void);
+BOOL latency_enabled(void);
+uint64_t latency_now(void);
+void latency_record(int stage, uint64_t input_time);
+void latency_vsync(DISPMANX_UPDATE_HANDLE_T update, void *arg);
+void latency_snapshot(OMXH264_histogram stages[LATENCY_STAGES]);
+void latency_dump(void);
+
 typedef struct _comp_details {
     COMPONENT_T    *component;
     OMX_HANDLETYPE  handle;
@@ -83,10 +268,14 @@ typedef struct _OMXH264_decoder {
 
     /* Cursor support in EGL mode. */
     OMXH264_cursor  cursor;
-    pthread_t       mouse_reader;
     int             mouse_fd;
-    pthread_t       window_reader;
-    int             terminate_readers;
+
+    /* Mouse and window tracking, on the event loop thread. */
+    OMXH264_event_loop events;
+    Display         *ev_disp;       /* Loop thread's own X connection. */
+    GC              ev_gc;
+    Window          tracked_parent;
+
     Display         *disp;
     Screen          *scr;
     Window          ica_window;
@@ -95,6 +284,10 @@ typedef struct _OMXH264_decoder {
     /* Watermark. */
     OMXH264_watermark watermark;
 
+    /* Lossless text, and small frames until the next H.264 frame. */
+    OMXH264_overlay overlay;
+    OMXH264_overlay small_frames;
+
     /* XImage for seamless. */
     XImage          *fb;
     unsigned int    size;
@@ -102,9 +295,18 @@ typedef struct _OMXH264_decoder {
     int             shm_id;
     void            *old_ptr;
 
-    /* Dirty rects. */
+    /* The id handed out for this context; calls for any other are stale. */
+    H264_context    h264_context;
+
+    /* V2: canvas the H.264 context is on, and where. */
+    CANV_context    canvas;
+    SIGNED_RECT     canvas_rect;
+
+    /* Dirty rects from start_frame, and what is still to be shown. */
     SIGNED_RECT     dirty_rects[31];
     int             num_rects;
+    BOOL            dirty_given;    /* Not just the whole context. */
+    OMXH264_damage  damage;
 
     int             dest_x;
     int             dest_y;
@@ -126,9 +328,79 @@ typedef struct _OMXH264_decoder {
     GLuint          tex;
 } OMXH264_decoder;
 
-void move_egl_display(OMXH264_decoder *decoder, BOOL force);
+void DEBUG_TRACE(const char *format, ...);
+
+void move_egl_display(OMXH264_decoder *decoder, Display *disp, BOOL force);
 void init_ogl(OMXH264_decoder *decoder);
 void deinit_ogl(OMXH264_decoder *decoder);
+void show_egl_cursor(OMXH264_decoder *decoder);
+void hide_egl_cursor(OMXH264_decoder *decoder);
+
+BOOL damage_init(OMXH264_damage *dmg, int width, int height);
+void damage_free(OMXH264_damage *dmg);
+void damage_add(OMXH264_damage *dmg, SIGNED_RECT *rect);
+void damage_add_all(OMXH264_damage *dmg);
+BOOL damage_empty(OMXH264_damage *dmg);
+int damage_rects(OMXH264_damage *dmg, SIGNED_RECT *rects, int max_rects);
+void damage_account(OMXH264_damage *dmg, SIGNED_RECT *rects, int num_rects);
+BOOL damage_present_all(OMXH264_damage *dmg);
+
+uint64_t bitmap_hash(struct image_buf *obj);
+void bitmap_cache_free(OMXH264_bitmap_cache *cache);
+OMXH264_bitmap *bitmap_cache_find(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj);
+OMXH264_bitmap *bitmap_cache_insert(OMXH264_bitmap_cache *cache, uint64_t key, struct image_buf *obj,
+                                    const uint32_t *pixels, int stride);
+void bitmap_cache_add_stats(OMXH264_bitmap_cache *cache, struct ctxh264_bitmap_cache_stats *stats);
+
+/* Exported, for callers that look it up with dlsym(). Sums the caches of
+ * the overlays of the open context.
+ */
+
+void ctxh264_bitmap_cache_stats(struct ctxh264_bitmap_cache_stats *stats);
+
+BOOL overlay_create(OMXH264_overlay *ov, int width, int height);
+BOOL overlay_show(OMXH264_overlay *ov, DISPMANX_DISPLAY_HANDLE_T display, int layer, VC_RECT_T *dst);
+void overlay_move(OMXH264_overlay *ov, DISPMANX_UPDATE_HANDLE_T update, VC_RECT_T *dst);
+void overlay_destroy(OMXH264_overlay *ov);
+void overlay_draw(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_erase(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_fill(OMXH264_overlay *ov, struct image_buf *obj);
+void overlay_clear(OMXH264_overlay *ov);
+void overlay_compose_fb(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT rects[], unsigned int num_rects);
+void overlay_compose_fb_tiles(OMXH264_overlay *ov, struct image_buf *fb, SIGNED_RECT changed[], unsigned int num_changed);
+int overlay_flush(OMXH264_overlay *ov, OMXH264_damage *changed);
+void overlay_compose(OMXH264_overlay *ov, void *dst, int dst_stride, SIGNED_RECT *rect);
+
+BOOL shm_arena_get(Display *disp, size_t size, XShmSegmentInfo *info);
+void shm_arena_put(Display *disp, XShmSegmentInfo *info);
+void shm_arena_trim(void);
+void shm_arena_flush(void);
+
+XImage *ximage_create(Display *disp, Screen *scr, int width, int height,
+                      XShmSegmentInfo *shm_info, void **old_ptr);
+void ximage_destroy(Display *disp, XImage *image, XShmSegmentInfo *shm_info, void *old_ptr);
+void ximage_put(Display *disp, GC gc, XImage *image, XShmSegmentInfo *shm_info,
+                struct window_info windows[], unsigned int num_windows,
+                SIGNED_RECT rects[], int num_rects);
+int canvas_display(int index);
+BOOL canvas_create(OMXH264_canvas *canvas, Display *disp, int width, int height, int x_off, int y_off,
+                   int display, int dst_x, int dst_y);
+void canvas_destroy(OMXH264_canvas *canvas, Display *disp);
+void canvas_draw(OMXH264_canvas *canvas, int x, int y, const void *bits, int stride,
+                 int width, int height, unsigned int flags);
+void *canvas_pointer(OMXH264_canvas *canvas, SIGNED_RECT *dest, int *stride);
+void canvas_copy_image(OMXH264_canvas *canvas, SIGNED_RECT *dest, struct image_buf *source);
+void canvas_copy_rect(OMXH264_canvas *canvas, SIGNED_RECT *dest, OMXH264_canvas *src, SIGNED_RECT *source);
+void canvas_fill(OMXH264_canvas *canvas, SIGNED_RECT *dest, unsigned int rgb);
+BOOL canvas_push(OMXH264_canvas *canvas, Display *disp, struct window_info windows[], unsigned int num_windows);
+
+BOOL event_loop_init(OMXH264_decoder *decoder);
+BOOL event_loop_add(OMXH264_decoder *decoder, int fd, EVENT_HANDLER handler);
+void event_loop_remove(OMXH264_decoder *decoder, int fd);
+int event_loop_add_timer(OMXH264_decoder *decoder, int interval_ms, EVENT_HANDLER handler);
+BOOL event_loop_start(OMXH264_decoder *decoder);
+void event_loop_wakeup(OMXH264_decoder *decoder);
+void event_loop_stop(OMXH264_decoder *decoder);
 
 bool v3_init();
 H264_context v3_open_context(int width, int height, void *codec_data, int len, unsigned int options);
@@ -138,4 +410,15 @@ bool v3_compose_with_fb(H264_context Ctx, struct image_buf *fb, SIGNED_RECT inte
 bool v3_compose_with_rects(H264_context Ctx, struct image_buf text_rects[], unsigned int num_rects, bool last);
 bool v3_push_frame(H264_context cxt, struct window_info windows[], unsigned int num_windows, bool wait, bool *pushed);
 void v3_close_context(H264_context Ctx);
+CANV_context v3_create_canvas(int width, int height, LLPixelFormat pix_format, int x_off, int y_off);
+H264_context v3_create_h264_context(CANV_context cxt, SIGNED_RECT dest, ChromaFormat fmt);
+void *v3_get_pointer_for_image(CANV_context cxt, SIGNED_RECT dest, int *stride);
+bool v3_copy_image(CANV_context cxt, SIGNED_RECT dest, struct image_buf *source);
+bool v3_copy_rect(CANV_context dest_cxt, SIGNED_RECT dest, CANV_context src_cxt, SIGNED_RECT source);
+bool v3_fill_rect(CANV_context cxt, SIGNED_RECT rect, unsigned int rgb);
+bool v3_push_canvas(CANV_context cxt, struct window_info windows[], unsigned int num_windows);
+void v3_destroy_canvas(CANV_context cxt);
+
 void v3_end ();
+void v3_show_cursor();
+void v3_hide_cursor();
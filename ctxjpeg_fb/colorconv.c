@@ -0,0 +1,193 @@
+/***************************************************************************
+ *
+ * colorconv.c
+ *
+ * Expansion of libjpeg output rows to 32-bit pixels. The scalar versions
+ * are the reference; the NEON and SSE2 versions must produce identical
+ * output.
+ *
+ ***************************************************************************/
+
+#include "colorconv.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define COLORCONV_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define COLORCONV_SSE2
+#include <emmintrin.h>
+#endif
+
+void colorconv_rgb_xrgb_c(uint32_t *dst, const uint8_t *src, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++, src += 3) {
+        dst[x] = (src[0] << 16) | (src[1] << 8) | src[2];
+    }
+}
+
+void colorconv_rgb_xbgr_c(uint32_t *dst, const uint8_t *src, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++, src += 3) {
+        dst[x] = (src[2] << 16) | (src[1] << 8) | src[0];
+    }
+}
+
+void colorconv_gray_xrgb_c(uint32_t *dst, const uint8_t *src, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        dst[x] = src[x] * 0x010101;
+    }
+}
+
+/*****************************************************************************
+ * SIMD kernels. Each converts the bulk of a row, 16 pixels at a time, and
+ * leaves the tail to the scalar code, returning the number of pixels done.
+ * They assume a little-endian host.
+ *****************************************************************************/
+
+#if defined(COLORCONV_NEON)
+
+static int rgb_row(uint32_t *out, const uint8_t *in, int width, int swap)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t p = vld3q_u8(in + (x * 3));
+        uint8x16x4_t q;
+
+        /* Bytes of 0x00RRGGBB are B, G, R, 0 in memory. */
+        q.val[0] = p.val[swap ? 0 : 2];
+        q.val[1] = p.val[1];
+        q.val[2] = p.val[swap ? 2 : 0];
+        q.val[3] = vdupq_n_u8(0);
+        vst4q_u8((uint8_t *)(out + x), q);
+    }
+
+    return x;
+}
+
+static int gray_row(uint32_t *out, const uint8_t *in, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t q;
+
+        q.val[0] = q.val[1] = q.val[2] = vld1q_u8(in + x);
+        q.val[3] = vdupq_n_u8(0);
+        vst4q_u8((uint8_t *)(out + x), q);
+    }
+
+    return x;
+}
+
+#elif defined(COLORCONV_SSE2)
+
+/* Four pixels from the first 12 bytes of "t", as 0x00BBGGRR. */
+
+static inline __m128i spread4(__m128i t)
+{
+    __m128i a = _mm_unpacklo_epi32(t, _mm_srli_si128(t, 3));
+    __m128i b = _mm_unpacklo_epi32(_mm_srli_si128(t, 6), _mm_srli_si128(t, 9));
+
+    return _mm_and_si128(_mm_unpacklo_epi64(a, b), _mm_set1_epi32(0x00ffffff));
+}
+
+/* Exchange the red and blue bytes of 0x00BBGGRR. */
+
+static inline __m128i swap_rb(__m128i p)
+{
+    const __m128i low = _mm_set1_epi32(0xff);
+
+    return _mm_or_si128(_mm_and_si128(p, _mm_set1_epi32(0xff00)),
+                        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, low), 16),
+                                     _mm_and_si128(_mm_srli_epi32(p, 16), low)));
+}
+
+static int rgb_row(uint32_t *out, const uint8_t *in, int width, int swap)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *s = in + (x * 3);
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i p[4];
+        int i;
+
+        /* Realign so each vector starts with four whole pixels. */
+        p[0] = spread4(a);
+        p[1] = spread4(_mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4)));
+        p[2] = spread4(_mm_or_si128(_mm_srli_si128(b, 8), _mm_slli_si128(c, 8)));
+        p[3] = spread4(_mm_srli_si128(c, 4));
+
+        for (i = 0; i < 4; i++) {
+            _mm_storeu_si128((__m128i *)(out + x + (i * 4)), swap ? p[i] : swap_rb(p[i]));
+        }
+    }
+
+    return x;
+}
+
+static int gray_row(uint32_t *out, const uint8_t *in, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *)(in + x));
+        __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+        __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+        __m128i g0_lo = _mm_unpacklo_epi8(g, zero);
+        __m128i g0_hi = _mm_unpackhi_epi8(g, zero);
+
+        _mm_storeu_si128((__m128i *)(out + x), _mm_unpacklo_epi16(gg_lo, g0_lo));
+        _mm_storeu_si128((__m128i *)(out + x + 4), _mm_unpackhi_epi16(gg_lo, g0_lo));
+        _mm_storeu_si128((__m128i *)(out + x + 8), _mm_unpacklo_epi16(gg_hi, g0_hi));
+        _mm_storeu_si128((__m128i *)(out + x + 12), _mm_unpackhi_epi16(gg_hi, g0_hi));
+    }
+
+    return x;
+}
+
+#endif
+
+void colorconv_rgb_xrgb(uint32_t *dst, const uint8_t *src, int width)
+{
+#if defined(COLORCONV_NEON) || defined(COLORCONV_SSE2)
+    int x = rgb_row(dst, src, width, 0);
+
+    colorconv_rgb_xrgb_c(dst + x, src + (x * 3), width - x);
+#else
+    colorconv_rgb_xrgb_c(dst, src, width);
+#endif
+}
+
+void colorconv_rgb_xbgr(uint32_t *dst, const uint8_t *src, int width)
+{
+#if defined(COLORCONV_NEON) || defined(COLORCONV_SSE2)
+    int x = rgb_row(dst, src, width, 1);
+
+    colorconv_rgb_xbgr_c(dst + x, src + (x * 3), width - x);
+#else
+    colorconv_rgb_xbgr_c(dst, src, width);
+#endif
+}
+
+void colorconv_gray_xrgb(uint32_t *dst, const uint8_t *src, int width)
+{
+#if defined(COLORCONV_NEON) || defined(COLORCONV_SSE2)
+    int x = gray_row(dst, src, width);
+
+    colorconv_gray_xrgb_c(dst + x, src + x, width - x);
+#else
+    colorconv_gray_xrgb_c(dst, src, width);
+#endif
+}
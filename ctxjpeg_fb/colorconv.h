@@ -0,0 +1,32 @@
+/***************************************************************************
+ *
+ * colorconv.h
+ *
+ * Expansion of the rows libjpeg returns, when it can not return 32-bit
+ * pixels itself, to the requested output format. Each conversion has a
+ * scalar reference and NEON/SSE2 versions where the target supports them.
+ * The unused byte of each output pixel is zero.
+ *
+ ***************************************************************************/
+
+#ifndef COLORCONV_H
+#define COLORCONV_H
+
+#include <stdint.h>
+
+/* Packed RGB to PIXEL_XRGB (0x00RRGGBB). */
+
+void colorconv_rgb_xrgb(uint32_t *dst, const uint8_t *src, int width);
+void colorconv_rgb_xrgb_c(uint32_t *dst, const uint8_t *src, int width);
+
+/* Packed RGB to PIXEL_XBGR (0x00BBGGRR). */
+
+void colorconv_rgb_xbgr(uint32_t *dst, const uint8_t *src, int width);
+void colorconv_rgb_xbgr_c(uint32_t *dst, const uint8_t *src, int width);
+
+/* Grey to either format. */
+
+void colorconv_gray_xrgb(uint32_t *dst, const uint8_t *src, int width);
+void colorconv_gray_xrgb_c(uint32_t *dst, const uint8_t *src, int width);
+
+#endif /* COLORCONV_H */
@@ -0,0 +1,140 @@
+/***************************************************************************
+ *
+ * colorconvtest.c
+ *
+ * Checks the row conversions of colorconv.c against their scalar
+ * references, for every width up to MAX_WIDTH with the source and
+ * destination at each alignment, and that nothing is written past the
+ * end of the row. Then reports each conversion in MPix/s, as built and as
+ * the scalar reference.
+ *
+ * Usage: colorconvtest [-b]     (-b: benchmark only)
+ *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "colorconv.h"
+
+#define MAX_WIDTH       299
+#define SRC_OFFSETS     16              /* Bytes. */
+#define DST_OFFSETS     4               /* Pixels. */
+#define GUARD           8               /* Pixels checked after the row. */
+#define GUARD_VALUE     0xdeadbeef
+
+#define BENCH_WIDTH     1920
+#define BENCH_SECONDS   0.2
+
+typedef void (*CONVERT)(uint32_t *dst, const uint8_t *src, int width);
+
+typedef struct {
+    const char  *name;
+    CONVERT      convert;
+    CONVERT      reference;
+    int          components;
+} CONVERSION;
+
+static const CONVERSION conversions[] = {
+    { "rgb_xrgb",  colorconv_rgb_xrgb,  colorconv_rgb_xrgb_c,  3 },
+    { "rgb_xbgr",  colorconv_rgb_xbgr,  colorconv_rgb_xbgr_c,  3 },
+    { "gray_xrgb", colorconv_gray_xrgb, colorconv_gray_xrgb_c, 1 },
+};
+
+#define NUM_CONVERSIONS (int)(sizeof(conversions) / sizeof(conversions[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+static int test(const CONVERSION *conv)
+{
+    static uint8_t  src[(MAX_WIDTH * 3) + SRC_OFFSETS];
+    static uint32_t out[MAX_WIDTH + DST_OFFSETS + GUARD];
+    static uint32_t ref[MAX_WIDTH + DST_OFFSETS + GUARD];
+    int             failures = 0;
+    int             width, src_offset, dst_offset, i;
+
+    for (width = 0; width <= MAX_WIDTH; width++) {
+        for (src_offset = 0; src_offset < SRC_OFFSETS; src_offset++) {
+            for (dst_offset = 0; dst_offset < DST_OFFSETS; dst_offset++) {
+                for (i = 0; i < (int)sizeof(src); i++) {
+                    src[i] = rand();
+                }
+                for (i = 0; i < (int)(sizeof(out) / sizeof(out[0])); i++) {
+                    out[i] = ref[i] = GUARD_VALUE;
+                }
+
+                conv->convert(out + dst_offset, src + src_offset, width);
+                conv->reference(ref + dst_offset, src + src_offset, width);
+
+                /* The guards are the same in both, so this covers them. */
+                if (memcmp(out, ref, sizeof(out))) {
+                    printf("FAIL %s width %d, source +%d, destination +%d\n",
+                           conv->name, width, src_offset, dst_offset);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures;
+}
+
+static double mpix_per_second(CONVERT convert, uint32_t *dst, const uint8_t *src)
+{
+    double start = now(), seconds;
+    long   rows = 0;
+
+    do {
+        convert(dst, src, BENCH_WIDTH);
+        rows++;
+        seconds = now() - start;
+    } while (seconds < BENCH_SECONDS);
+
+    return (rows * (double)BENCH_WIDTH) / (seconds * 1e6);
+}
+
+static void benchmark(void)
+{
+    static uint8_t  src[BENCH_WIDTH * 3];
+    static uint32_t dst[BENCH_WIDTH];
+    int             i;
+
+    for (i = 0; i < (int)sizeof(src); i++) {
+        src[i] = rand();
+    }
+
+    printf("conversion    MPix/s    scalar  (%d pixel rows)\n", BENCH_WIDTH);
+    for (i = 0; i < NUM_CONVERSIONS; i++) {
+        printf("%-10s %9.1f %9.1f\n", conversions[i].name,
+               mpix_per_second(conversions[i].convert, dst, src),
+               mpix_per_second(conversions[i].reference, dst, src));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+    int i;
+
+    if (argc < 2 || strcmp(argv[1], "-b")) {
+        for (i = 0; i < NUM_CONVERSIONS; i++) {
+            failures += test(&conversions[i]);
+        }
+        printf("%s: %d failures\n\n", failures ? "FAILED" : "passed", failures);
+    }
+
+    benchmark();
+
+    return failures ? 1 : 0;
+}
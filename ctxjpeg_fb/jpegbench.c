@@ -0,0 +1,695 @@
+/***************************************************************************
+ *
+ * jpegbench.c
+ *
+ * Benchmark for a JPEG decoder plug-in, run outside a session. The plug-in
+ * is loaded with dlopen() and driven through its JPEG_decoder structure,
+ * as Receiver would, over a corpus of tiles made at start-up with libjpeg:
+ * text, photo, grayscale, restart markers and odd sizes.
+ *
+ * Each tile is decoded in each of the modes the plug-in supports: direct
+ * (start_decode() then finish_decode()), cropped, batched and asynchronous
+ * with a completion descriptor. For each, throughput in MPix/s, latency
+ * percentiles per tile and heap allocations per tile are reported. The
+ * small tiles are then decoded directly with the plug-in's memory arena and
+ * with CTXJPEG_FB_NO_ARENA set, for time and allocations per tile. Finally
+ * the whole corpus is decoded in batches with 1 to N worker threads (one
+ * thread decodes directly, as batches need two). Both comparisons run each
+ * case in a child process, as the plug-in reads its environment only when
+ * loaded.
+ *
+ * Usage: jpegbench [-d seconds] [-t max_threads] [plug-in]
+ *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <jpeglib.h>
+
+#include "jpeg_decode.h"
+
+#define MAX_GROUP       16              /* Requests in a batch. */
+#define SMALL_TILE      (256 * 256)     /* Pixels, for the arena comparison. */
+#define MAX_SAMPLES     (256 * 1024)    /* Latencies kept per test. */
+#define MIN_ROUNDS      5
+
+enum { MODE_DIRECT, MODE_CROPPED, MODE_BATCH, MODE_ASYNC, MODES };
+
+static const char *mode_names[MODES] = { "direct", "cropped", "batch", "async" };
+
+typedef struct {
+    const char     *name;
+    int             width, height;
+    int             components;         /* 1 or 3. */
+    int             h_samp, v_samp;     /* Of luma, for 3 components. */
+    int             quality;
+    int             restart_rows;
+    int             content;            /* CONTENT_*. */
+    unsigned char  *jpeg;
+    unsigned long   size;
+} TILE;
+
+enum { CONTENT_TEXT, CONTENT_PHOTO };
+
+static TILE corpus[] = {
+    { "icon",     16,   16,   3, 1, 1, 85, 0, CONTENT_PHOTO },
+    { "text",     256,  64,   3, 1, 1, 90, 0, CONTENT_TEXT },
+    { "photo",    256,  256,  3, 2, 2, 75, 0, CONTENT_PHOTO },
+    { "gray",     256,  256,  1, 1, 1, 75, 0, CONTENT_PHOTO },
+    { "odd",      317,  93,   3, 2, 1, 80, 0, CONTENT_PHOTO },
+    { "strip",    1920, 256,  3, 2, 2, 75, 0, CONTENT_TEXT },
+    { "restart",  1920, 1080, 3, 2, 2, 75, 1, CONTENT_PHOTO },
+};
+
+#define CORPUS_SIZE     (int)(sizeof(corpus) / sizeof(corpus[0]))
+
+typedef struct {
+    unsigned long long  tiles;
+    unsigned long long  pixels;
+    unsigned long long  allocations;
+    unsigned long long  errors;
+    double              seconds;
+    double              p50, p90, p99;  /* Microseconds. */
+} RESULT;
+
+static struct JPEG_decoder *decoder;
+static double               test_seconds = 0.5;
+
+/***************************************************************************
+ *
+ * Heap allocations, counted by wrapping malloc(), calloc() and realloc()
+ * for the whole process, including the plug-in and libjpeg. The real
+ * functions are found with dlsym(), which may itself allocate, so the
+ * first few requests come from a static buffer.
+ *
+ ***************************************************************************/
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void  (*real_free)(void *);
+
+static unsigned long long   allocations;
+static char                 bootstrap[8192];
+static size_t               bootstrap_used;
+
+static void *bootstrap_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > sizeof(bootstrap)) {
+        return NULL;
+    }
+    p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+
+    return p;
+}
+
+static int find_allocator(void)
+{
+    static int finding;
+
+    if (!real_malloc && !finding) {
+        finding = 1;
+        real_calloc = dlsym(RTLD_NEXT, "calloc");
+        real_realloc = dlsym(RTLD_NEXT, "realloc");
+        real_free = dlsym(RTLD_NEXT, "free");
+        real_malloc = dlsym(RTLD_NEXT, "malloc");
+        finding = 0;
+    }
+
+    return real_malloc != NULL;
+}
+
+void *malloc(size_t size)
+{
+    if (!find_allocator()) {
+        return bootstrap_alloc(size);
+    }
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (!find_allocator() || !real_calloc) {
+        return bootstrap_alloc(n * size);   /* Zeroed, being static. */
+    }
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return real_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if ((char *)ptr >= bootstrap && (char *)ptr < bootstrap + sizeof(bootstrap)) {
+        void *p = malloc(size);
+
+        if (p) {
+            size_t left = bootstrap + sizeof(bootstrap) - (char *)ptr;
+
+            memcpy(p, ptr, size < left ? size : left);
+        }
+        return p;
+    }
+    if (!find_allocator()) {
+        return NULL;
+    }
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if ((char *)ptr >= bootstrap && (char *)ptr < bootstrap + sizeof(bootstrap)) {
+        return;
+    }
+    if (ptr && find_allocator()) {
+        real_free(ptr);
+    }
+}
+
+static unsigned long long allocation_count(void)
+{
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+/***************************************************************************
+ *
+ * The corpus.
+ *
+ ***************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+/* A row of black on white glyphs in 8x12 cells, or smooth gradients with
+ * a little noise.
+ */
+
+static void make_row(const TILE *tile, int y, unsigned char *row)
+{
+    static unsigned int noise = 12345;
+    int                 x, c;
+
+    for (x = 0; x < tile->width; x++) {
+        unsigned char v[3];
+
+        if (tile->content == CONTENT_TEXT) {
+            unsigned int glyph = ((x / 8) * 2654435761U) ^ ((y / 12) * 40503U);
+            int          gx = x % 8, gy = y % 12;
+            int          ink = gx < 5 && gy < 7 && ((glyph >> ((gx * 7 + gy) % 31)) & 1);
+
+            v[0] = v[1] = v[2] = ink ? 20 : 245;
+            if (ink && (glyph & 0x300) == 0x300) {
+                v[2] = 200;                     /* Some coloured text. */
+            }
+        } else {
+            noise = noise * 1103515245 + 12345;
+            v[0] = 128 + 100 * sin(x * 0.031 + y * 0.017) + ((noise >> 16) & 7);
+            v[1] = 128 + 100 * sin(x * 0.023 - y * 0.029) + ((noise >> 20) & 7);
+            v[2] = 128 + 100 * cos((x + y) * 0.011) + ((noise >> 24) & 7);
+        }
+
+        for (c = 0; c < tile->components; c++) {
+            row[(x * tile->components) + c] = v[c];
+        }
+    }
+}
+
+static void make_corpus(void)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    unsigned char              *row;
+    int                         i, y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    for (i = 0; i < CORPUS_SIZE; i++) {
+        TILE *tile = &corpus[i];
+
+        row = malloc(tile->width * 3);
+        tile->jpeg = NULL;
+        tile->size = 0;
+        jpeg_mem_dest(&cinfo, &tile->jpeg, &tile->size);
+
+        cinfo.image_width = tile->width;
+        cinfo.image_height = tile->height;
+        cinfo.input_components = tile->components;
+        cinfo.in_color_space = (tile->components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, tile->quality, TRUE);
+        cinfo.restart_in_rows = tile->restart_rows;
+        if (tile->components == 3) {
+            cinfo.comp_info[0].h_samp_factor = tile->h_samp;
+            cinfo.comp_info[0].v_samp_factor = tile->v_samp;
+        }
+
+        jpeg_start_compress(&cinfo, TRUE);
+        for (y = 0; y < tile->height; y++) {
+            make_row(tile, y, row);
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        free(row);
+    }
+
+    jpeg_destroy_compress(&cinfo);
+}
+
+/***************************************************************************
+ *
+ * Running the tests.
+ *
+ ***************************************************************************/
+
+static int supported(int mode)
+{
+    switch (mode) {
+    case MODE_CROPPED:
+        return (decoder->output_formats & (CROP_OUTPUT_X_OFFSET | CROP_OUTPUT_Y_OFFSET)) ==
+               (CROP_OUTPUT_X_OFFSET | CROP_OUTPUT_Y_OFFSET);
+    case MODE_BATCH:
+        return (decoder->completion_handling & BATCH_DECODING) && decoder->batch_decode;
+    case MODE_ASYNC:
+        return (decoder->completion_handling & (BACKGROUND_DECODING | COMPLETION_FD)) ==
+               (BACKGROUND_DECODING | COMPLETION_FD) && decoder->complete_request;
+    default:
+        return 1;
+    }
+}
+
+/* Set up a request for a tile, the middle quarter of it if cropped. */
+
+static void set_request(struct JPEG_request *request, const TILE *tile, int mode, void *buffer)
+{
+    memset(request, 0, sizeof(*request));
+    request->v2.image = tile->jpeg;
+    request->v2.size = tile->size;
+    request->v2.buffer = buffer;
+    request->v2.width = tile->width;
+    request->v2.height = tile->height;
+    request->v2.stride = tile->width * 4;
+    request->v2.format = PIXEL_XRGB;
+    request->v2.completion_sig = -1;
+    request->v2.completion_fd = (mode == MODE_ASYNC) ? 0 : -1;
+    request->output_size = tile->width * tile->height * 4;
+
+    if (mode == MODE_CROPPED) {
+        request->v2.crop_x = tile->width / 4;
+        request->v2.crop_y = tile->height / 4;
+        request->v2.crop_width = (tile->width + 1) / 2;
+        request->v2.crop_height = (tile->height + 1) / 2;
+    } else {
+        request->v2.crop_width = tile->width;
+        request->v2.crop_height = tile->height;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/* Decode the tiles, in turn, for at least "test_seconds". */
+
+static void run_test(int mode, TILE *tiles[], int num_tiles, RESULT *result)
+{
+    struct JPEG_request  requests[MAX_GROUP];
+    double               started[MAX_GROUP];
+    void                *buffers[MAX_GROUP];
+    double              *samples = malloc(MAX_SAMPLES * sizeof(double));
+    size_t               largest = 0;
+    unsigned long long   first_allocation;
+    unsigned int         num_samples = 0, rounds = 0;
+    int                  group = 1, next = 0, i;
+    double               start, t;
+
+    memset(result, 0, sizeof(*result));
+
+    if (mode == MODE_BATCH || mode == MODE_ASYNC) {
+        group = decoder->concurrency;
+        if (group < 2) {
+            group = 2;
+        }
+        if (group > MAX_GROUP) {
+            group = MAX_GROUP;
+        }
+        if (decoder->queue_limit && (unsigned int)group > decoder->queue_limit) {
+            group = decoder->queue_limit;
+        }
+    }
+    for (i = 0; i < num_tiles; i++) {
+        size_t bytes = tiles[i]->width * tiles[i]->height * 4;
+
+        if (bytes > largest) {
+            largest = bytes;
+        }
+    }
+    for (i = 0; i < group; i++) {
+        buffers[i] = malloc(largest);
+    }
+
+    first_allocation = allocation_count();
+    start = now();
+
+    do {
+        for (i = 0; i < group; i++) {
+            set_request(&requests[i], tiles[next], mode, buffers[i]);
+            next = (next + 1) % num_tiles;
+        }
+
+        switch (mode) {
+        case MODE_BATCH:
+            t = now();
+            decoder->batch_decode(requests, group);
+            t = now() - t;
+            for (i = 0; i < group; i++) {
+                started[i] = t;
+            }
+            break;
+
+        case MODE_ASYNC: {
+            int pending = 0, fd = -1;
+
+            for (i = 0; i < group; i++) {
+                started[i] = now();
+                decoder->start_decode(&requests[i]);
+                if (requests[i].v2.status == JPEG_BUSY) {
+                    fd = requests[i].v2.completion_fd;
+                    pending++;
+                } else {
+                    started[i] = now() - started[i];
+                }
+            }
+            while (pending > 0) {
+                struct pollfd        pfd = { fd, POLLIN, 0 };
+                struct JPEG_request *done;
+
+                poll(&pfd, 1, 1000);
+                while ((done = decoder->complete_request())) {
+                    i = done - requests;
+                    started[i] = now() - started[i];
+                    pending--;
+                }
+            }
+            break;
+        }
+
+        default:
+            t = now();
+            decoder->start_decode(&requests[0]);
+            decoder->finish_decode(&requests[0]);
+            started[0] = now() - t;
+            break;
+        }
+
+        for (i = 0; i < group; i++) {
+            if (requests[i].v2.status != JPEG_SUCCESS) {
+                result->errors++;
+            }
+            result->tiles++;
+            result->pixels += (unsigned long long)requests[i].v2.crop_width * requests[i].v2.crop_height;
+            if (num_samples < MAX_SAMPLES) {
+                samples[num_samples++] = started[i] * 1e6;
+            }
+        }
+        rounds++;
+    } while (rounds < MIN_ROUNDS || now() - start < test_seconds);
+
+    result->seconds = now() - start;
+    result->allocations = allocation_count() - first_allocation;
+
+    qsort(samples, num_samples, sizeof(double), compare_doubles);
+    result->p50 = samples[(num_samples * 50) / 100];
+    result->p90 = samples[(num_samples * 90) / 100];
+    result->p99 = samples[(num_samples * 99) / 100];
+
+    for (i = 0; i < group; i++) {
+        free(buffers[i]);
+    }
+    free(samples);
+}
+
+static double mpix_per_second(const RESULT *result)
+{
+    return result->pixels / (result->seconds * 1e6);
+}
+
+static int load(const char *library)
+{
+    void *lib = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+
+    if (!lib) {
+        fprintf(stderr, "jpegbench: %s\n", dlerror());
+        return 0;
+    }
+    decoder = (struct JPEG_decoder *)dlsym(lib, "JPEG_decoder");
+    if (!decoder) {
+        fprintf(stderr, "jpegbench: no JPEG_decoder in %s\n", library);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Every tile in every mode, with the default number of threads. */
+
+static int run_table(const char *library)
+{
+    RESULT result;
+    int    mode, i;
+
+    if (!load(library)) {
+        return 1;
+    }
+
+    printf("%s: concurrency %u, completion 0x%x, output 0x%x\n\n", library,
+           decoder->concurrency, decoder->completion_handling, decoder->output_formats);
+    printf("mode     tile          size   bytes    tiles   MPix/s   p50 us   p90 us   p99 us  allocs  errors\n");
+
+    for (mode = 0; mode < MODES; mode++) {
+        if (!supported(mode)) {
+            printf("%-8s (not supported)\n", mode_names[mode]);
+            continue;
+        }
+        for (i = 0; i < CORPUS_SIZE; i++) {
+            TILE *tile = &corpus[i];
+
+            run_test(mode, &tile, 1, &result);
+            printf("%-8s %-8s %4dx%-4d %7lu %8llu %8.1f %8.1f %8.1f %8.1f %7.1f %7llu\n",
+                   mode_names[mode], tile->name, tile->width, tile->height, tile->size,
+                   result.tiles, mpix_per_second(&result), result.p50, result.p90, result.p99,
+                   (double)result.allocations / result.tiles, result.errors);
+        }
+    }
+    fflush(stdout);
+
+    return 0;
+}
+
+/* Each small tile decoded directly, in a child with or without the
+ * arena. Fills in "results", with no tiles for the others. Returns 0 on
+ * failure.
+ */
+
+static int run_arena(const char *library, int arena, RESULT results[CORPUS_SIZE])
+{
+    size_t  size = CORPUS_SIZE * sizeof(RESULT);
+    int     pipefd[2], status, ok = 0, i;
+    pid_t   pid;
+
+    if (pipe(pipefd) < 0) {
+        return 0;
+    }
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+        close(pipefd[0]);
+        memset(results, 0, size);
+        if (arena) {
+            unsetenv("CTXJPEG_FB_NO_ARENA");
+        } else {
+            setenv("CTXJPEG_FB_NO_ARENA", "1", 1);
+        }
+        if (!load(library)) {
+            _exit(1);
+        }
+        for (i = 0; i < CORPUS_SIZE; i++) {
+            TILE *tile = &corpus[i];
+
+            if (tile->width * tile->height <= SMALL_TILE) {
+                run_test(MODE_DIRECT, &tile, 1, &results[i]);
+            }
+        }
+        if (write(pipefd[1], results, size) != (ssize_t)size) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+    if (pid > 0) {
+        ok = (read(pipefd[0], results, size) == (ssize_t)size);
+    }
+    close(pipefd[0]);
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+
+    return ok;
+}
+
+/* A batch of the whole corpus, in a child with "threads" worker threads.
+ * Returns MPix/s, or a negative value on failure.
+ */
+
+static double run_scaling(const char *library, int threads)
+{
+    TILE   *tiles[CORPUS_SIZE];
+    RESULT  result;
+    double  mpix = -1;
+    int     pipefd[2], status, i;
+    pid_t   pid;
+
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+        char count[16];
+
+        close(pipefd[0]);
+        snprintf(count, sizeof(count), "%d", threads);
+        setenv("CTXJPEG_FB_THREADS", count, 1);
+        if (load(library)) {
+            for (i = 0; i < CORPUS_SIZE; i++) {
+                tiles[i] = &corpus[i];
+            }
+            run_test(supported(MODE_BATCH) ? MODE_BATCH : MODE_DIRECT, tiles, CORPUS_SIZE, &result);
+            mpix = result.errors ? -1 : mpix_per_second(&result);
+        }
+        if (write(pipefd[1], &mpix, sizeof(mpix)) != sizeof(mpix)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+    if (pid > 0 && read(pipefd[0], &mpix, sizeof(mpix)) != sizeof(mpix)) {
+        mpix = -1;
+    }
+    close(pipefd[0]);
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+
+    return mpix;
+}
+
+int main(int argc, char **argv)
+{
+    const char *library = "./ctxjpeg_fb.so";
+    long        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    RESULT      with[CORPUS_SIZE], without[CORPUS_SIZE];
+    double      base = 0;
+    pid_t       pid;
+    int         opt, threads, next, status, i;
+
+    while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            test_seconds = atof(optarg);
+            break;
+        case 't':
+            max_threads = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d seconds] [-t max_threads] [plug-in]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        library = argv[optind];
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    make_corpus();
+
+    /* Each run loads the plug-in in a new process. */
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        _exit(run_table(library));
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        return 1;
+    }
+
+    printf("\ntile      arena us  allocs   malloc us  allocs  (direct, CTXJPEG_FB_NO_ARENA for malloc)\n");
+    if (run_arena(library, 1, with) && run_arena(library, 0, without)) {
+        for (i = 0; i < CORPUS_SIZE; i++) {
+            if (!with[i].tiles || !without[i].tiles) {
+                continue;
+            }
+            printf("%-8s %9.1f %7.1f %11.1f %7.1f\n", corpus[i].name,
+                   (with[i].seconds * 1e6) / with[i].tiles, (double)with[i].allocations / with[i].tiles,
+                   (without[i].seconds * 1e6) / without[i].tiles,
+                   (double)without[i].allocations / without[i].tiles);
+        }
+    } else {
+        printf("failed\n");
+    }
+
+    printf("\nthreads   MPix/s  speedup  (batch of the whole corpus)\n");
+    for (threads = 1; threads <= max_threads; threads = next) {
+        double mpix = run_scaling(library, threads);
+
+        /* Doubling, finishing with max_threads. */
+        next = threads * 2;
+        if (threads < max_threads && next > max_threads) {
+            next = max_threads;
+        }
+
+        if (mpix < 0) {
+            printf("%7d   failed\n", threads);
+            continue;
+        }
+        if (threads == 1) {
+            base = mpix;
+        }
+        printf("%7d %8.1f %8.2f\n", threads, mpix, base > 0 ? mpix / base : 0);
+    }
+
+    return 0;
+}
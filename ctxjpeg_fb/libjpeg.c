@@ -10,15 +10,32 @@
 *
 ****************************************************************************/
 
+#define _GNU_SOURCE             /* For RTLD_DEFAULT. */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <jpeglib.h>
 #include <setjmp.h>
 #include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "jpeg_decode.h"
 #include "srcmgr.h"
+#include "memmgr.h"
 #include "errmgr.h"
+#include "pool.h"
+#include "tjapi.h"
+#include "colorconv.h"
+#include "tilecache.h"
+#include "strips.h"
+#include "schedule.h"
+
+/* The output pixel format part of a request's "format". */
+#define OUTPUT_FORMAT(f)    ((f) & 0xffff)
 
 /* Forward declarations. */
 static void start_decode(struct JPEG_request *);
@@ -32,9 +49,11 @@ static void batch_decode(struct JPEG_request request[], int num_requests);
 
 struct JPEG_decoder JPEG_decoder = {
     TRADITIONAL_JPEG,           /* Input formats. */
-    PIXEL_XRGB,                 /* Output pixel formats - just the one. */
-    0,                          /* No parallel processing. */
-    1,                          /* No internal concurrency. */
+    PIXEL_XRGB | PIXEL_XBGR |   /* Output pixel formats, */
+    CROP_OUTPUT_X_OFFSET |      /* and cropping. */
+    CROP_OUTPUT_Y_OFFSET,
+    0,                          /* Background and batches, see init_decoder(). */
+    1,                          /* One per core, see init_decoder(). */
     0,                          /* No internal queueing. */
     4,                          /* Alignment preference. */
     start_decode,               /* Entry points. */
@@ -49,8 +68,62 @@ static boolean use_turbo = TRUE;
 /* Batch decode debugging enabled? */
 static boolean batchDebugging = FALSE;
 
-/* Debug direct decode cropping enabled? */
-static boolean debug_cropping = FALSE;
+/* Partial decoding in libjpeg-turbo 1.5 and later, looked up at load time
+ * so the plug-in still works with libjpeg.
+ */
+
+typedef JDIMENSION (*SKIP_SCANLINES_FN)(j_decompress_ptr, JDIMENSION);
+typedef void       (*CROP_SCANLINE_FN)(j_decompress_ptr, JDIMENSION *, JDIMENSION *);
+
+static SKIP_SCANLINES_FN    skip_scanlines;
+static CROP_SCANLINE_FN     crop_scanline;
+
+/* Each thread keeps a decompressor, with its error manager, for all the
+ * images it decodes, rather than creating one for each. Its per-image
+ * memory comes from an arena unless CTXJPEG_FB_NO_ARENA is set.
+ * Whole images are decoded with the TurboJPEG API when libturbojpeg is
+ * installed, unless CTXJPEG_FB_NO_TJAPI is set.
+ */
+
+typedef struct {
+    struct jpeg_decompress_struct cinfo;
+    CTXS_JPEG_ERROR_MANAGER       jerr;
+    boolean                       created;
+    void                         *tj;       /* TurboJPEG handle. */
+} DECODER;
+
+static pthread_key_t        decoder_key;
+static boolean              use_arena = TRUE;
+static boolean              use_tjapi = FALSE;
+
+/* Split large images at restart markers, unless CTXJPEG_FB_NO_STRIPS is set. */
+static boolean              use_strips = FALSE;
+
+/* Background decoding: the descriptor made readable as requests complete,
+ * and the completed requests not yet returned by complete_request().
+ * Workers push onto "completed" without a lock; only the caller's thread
+ * takes them off, a whole list at a time, into "delivering", so there is
+ * no ABA problem.
+ *
+ * The status of a request whose completion is reported through the
+ * descriptor is held here, pointed to by "priv", until complete_request()
+ * returns it: the caller may take a request that is not JPEG_BUSY when
+ * start_decode() returns as already complete, and never look for it.
+ */
+
+typedef struct COMPLETION {
+    struct COMPLETION   *next;
+    struct JPEG_request *request;
+    int                  status;
+} COMPLETION;
+
+static int                  completion_fd = -1;
+static COMPLETION          *completed;
+static COMPLETION          *delivering;
+
+/* For finish_decode(), when no notification is wanted. */
+static pthread_mutex_t      finish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       finished = PTHREAD_COND_INITIALIZER;
 
 
 /*****************************************************************************
@@ -83,6 +156,51 @@ LibJpegCustomErrorExit(j_common_ptr cinfo)
     longjmp(pErrorManager->SetJumpStackState,-1);
 }
 
+static void destroy_decoder(void *arg)
+{
+    DECODER *decoder = (DECODER *)arg;
+
+    if (decoder->created) {
+        jpeg_destroy_decompress(&decoder->cinfo);
+        memmgr_jpeg_arena_free((j_common_ptr)&decoder->cinfo);
+    }
+    tjapi_destroy(decoder->tj);
+    free(decoder);
+}
+
+/* Return this thread's decoder, with the error manager in place. The
+ * decompress structure is created by the caller, once it has called setjmp().
+ */
+
+static DECODER *get_decoder(void)
+{
+    DECODER *decoder = (DECODER *)pthread_getspecific(decoder_key);
+
+    if (!decoder) {
+        decoder = (DECODER *)calloc(1, sizeof(DECODER));
+        if (!decoder) {
+            return NULL;
+        }
+        if (pthread_setspecific(decoder_key, decoder)) {
+            free(decoder);
+            return NULL;
+        }
+
+        /* Create the error handler, and overwrite the default error handler
+         * exit function.
+         */
+
+        decoder->cinfo.err = jpeg_std_error((struct jpeg_error_mgr *)&decoder->jerr);
+        decoder->jerr.OriginalErrorManager.error_exit = LibJpegCustomErrorExit;
+
+        if (use_tjapi) {
+            decoder->tj = tjapi_create();
+        }
+    }
+
+    return decoder;
+}
+
 /* Initialisation entry point.  Called by the OS on load. */
 
 __attribute__((constructor)) static void init_decoder()
@@ -134,6 +252,23 @@ done:
 
     jpeg_destroy_compress( &cinfo );
 
+    /* Decode in the background on the worker pool, reporting completion
+     * through an eventfd.
+     */
+
+    completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completion_fd >= 0) {
+        JPEG_decoder.concurrency = pool_size();
+        JPEG_decoder.completion_handling |= BACKGROUND_DECODING | COMPLETION_FD;
+    }
+
+    /* Decode batches on the worker pool, one JPEG per thread. */
+
+    if (pool_size() > 1) {
+        JPEG_decoder.concurrency = pool_size();
+        JPEG_decoder.completion_handling |= BATCH_DECODING;
+    }
+
     /* If the "CTXJPEG_FB_SW_BATCH_SIZE" env. variable is set, then tell
      * Receiver we are able to process batches of JPEGs. This is especially
      * useful for batch decode debugging and test. This parameter should be set
@@ -151,46 +286,78 @@ done:
         }
     }
 
-    /* Debug cropping enabled? */
+    /* Cropping is done by decoding fewer lines and columns, quicker with
+     * the libjpeg-turbo functions for that, if present.
+     */
+
+    /* Per-thread decompressors. */
+
+    pthread_key_create(&decoder_key, destroy_decoder);
+    use_arena = (NULL == getenv("CTXJPEG_FB_NO_ARENA"));
+    use_tjapi = (NULL == getenv("CTXJPEG_FB_NO_TJAPI")) && tjapi_init();
+    use_strips = (pool_size() > 1) && (NULL == getenv("CTXJPEG_FB_NO_STRIPS"));
 
-    debug_cropping = (NULL != getenv("CTXJPEG_FB_SW_DEBUG_CROPPING"));
-    if (debug_cropping) {
-        JPEG_decoder.output_formats |= CROP_OUTPUT_X_OFFSET | CROP_OUTPUT_Y_OFFSET;
-        printf("Enabling debug cropping support.\n");
+    /* Cache decoded tiles if "CTXJPEG_FB_TILE_CACHE" gives a budget in MB. */
+
+    char *tileCache = getenv("CTXJPEG_FB_TILE_CACHE");
+    if (tileCache && atoi(tileCache) > 0) {
+        tilecache_init((size_t)atoi(tileCache) << 20);
     }
 
+    skip_scanlines = (SKIP_SCANLINES_FN)dlsym(RTLD_DEFAULT, "jpeg_skip_scanlines");
+    crop_scanline = (CROP_SCANLINE_FN)dlsym(RTLD_DEFAULT, "jpeg_crop_scanline");
 }
 
+static JDIMENSION min_lines(JDIMENSION a, JDIMENSION b)
+{
+    return a < b ? a : b;
+}
 
-static void start_decode(struct JPEG_request *request)
+/* Discard "rows" lines, reading them into "row" if they can not be skipped. */
+
+static void skip_rows(j_decompress_ptr cinfo, JDIMENSION rows, JSAMPARRAY row)
 {
-    struct jpeg_decompress_struct cinfo;        /* libjpeg decoding context */
-    CTXS_JPEG_ERROR_MANAGER       jerr;         /* Custom error manager */
+    if (skip_scanlines) {
+        skip_scanlines(cinfo, rows);
+    } else {
+        while (rows--) {
+            jpeg_read_scanlines(cinfo, row, 1);
+        }
+    }
+}
+
+
+static int decode_image(struct JPEG_request *request)
+{
+    DECODER                      *decoder;      /* This thread's decoder */
+    j_decompress_ptr              cinfo;        /* libjpeg decoding context */
     int                           jmpRet;       /* Return value of setjmp() */
     unsigned char                *pBmpRow;
     JSAMPARRAY					  scanlineBuffer[2];
-    int                           decode_height;
-    int                           stride;
-    unsigned                      char *old_buf = 0, *waste = 0;
-    boolean                       cropped = FALSE;
+    JDIMENSION                    crop_x, crop_y;
+    JDIMENSION                    crop_width, crop_height;
+    boolean                       xbgr;         /* PIXEL_XBGR wanted */
     
-    if (!request || !request->v2.image || !request->v2.buffer) {
-        if (request)
-            request->v2.status = JPEG_BAD_PARAM;
-        return;
+    if (!request->v2.image || !request->v2.buffer) {
+        return JPEG_BAD_PARAM;
     }
+    xbgr = (OUTPUT_FORMAT(request->v2.format) == PIXEL_XBGR);
     
-    /* Create the error handler. */
-    
-    cinfo.err = jpeg_std_error((struct jpeg_error_mgr *)&jerr);
+    decoder = get_decoder();
+    if (!decoder) {
+        return JPEG_INTERNAL;
+    }
+    cinfo = &decoder->cinfo;
 
-    /* Overwrite the default error handler exit function. */
+    /* Whole images in one call, if possible. */
+
+    if (decoder->tj && tjapi_decode(decoder->tj, request, xbgr)) {
+        return JPEG_SUCCESS;
+    }
 
-    jerr.OriginalErrorManager.error_exit = LibJpegCustomErrorExit;
-    
     /*Save stack state*/
 
-    jmpRet = setjmp(jerr.SetJumpStackState);
+    jmpRet = setjmp(decoder->jerr.SetJumpStackState);
 
     if (jmpRet != 0)
     {
@@ -200,27 +367,36 @@ static void start_decode(struct JPEG_request *request)
 #ifdef DEBUG
         char buf[JMSG_LENGTH_MAX];
 
-        cinfo.err->format_message((j_common_ptr)&cinfo, buf);
+        cinfo->err->format_message((j_common_ptr)cinfo, buf);
         fprintf(stderr, "Error occured in libJPEG: %s\n", buf);
 #endif /* DEBUG */
 
-        /* Clean up.  Don't delete the decompress structure in the
-         * exception handler since we can get an infinite loop.
+        /* Clean up, leaving the decompress structure ready for the next
+         * image. Don't delete it in the exception handler since we can
+         * get an infinite loop.
          */
 
-        request->v2.status = JPEG_INTERNAL;
-        return;
+        if (decoder->created) {
+            jpeg_abort_decompress(cinfo);
+        }
+        return JPEG_INTERNAL;
     }
 
-    /* Create decompression manager. */
+    /* Create decompression manager, the first time on this thread. */
 
-    jpeg_create_decompress(&cinfo);
+    if (!decoder->created) {
+        jpeg_create_decompress(cinfo);
+        decoder->created = TRUE;
+        if (use_arena) {
+            memmgr_jpeg_arena((j_common_ptr)cinfo);
+        }
+    }
 
     /* Associate the JPEG data with the decompression manager
      * and the callback function.
      */
     
-    srcmgr_jpeg_memory_src(&cinfo, request->v2.image, request->v2.size);
+    srcmgr_jpeg_memory_src(cinfo, request->v2.image, request->v2.size);
 
     /* Read the file header, setting the default compression parameters. */
 
@@ -229,209 +405,347 @@ static void start_decode(struct JPEG_request *request)
      **************************************
      */
 
-    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
         /*There was an error reading the file header*/
 
         fprintf(stderr, "jpeg_read_header() failed\n");
-        jpeg_destroy_decompress(&cinfo);
-        request->v2.status =  JPEG_BAD_DATA;
-        return;
+        jpeg_abort_decompress(cinfo);
+        return JPEG_BAD_DATA;
     }
 
     if (use_turbo) {
 	    /* We've established that libjpeg-turbo is available. Specify
-	       an output colour space of BGRX (4-bytes), avoiding the need
-	       for a 24-to-32 bit colour space conversion. */
-	    cinfo.out_color_space = 9; /* JCS_EXT_BGRX */
+	       an output colour space of BGRX, or RGBX for PIXEL_XBGR
+	       (4-bytes), avoiding the need for a 24-to-32 bit colour space
+	       conversion. */
+	    cinfo->out_color_space = xbgr ? 7 /* JCS_EXT_RGBX */ : 9; /* JCS_EXT_BGRX */
     }
 
-    if (!jpeg_start_decompress(&cinfo)) {
-        jpeg_destroy_decompress(&cinfo);
-        request->v2.status = JPEG_BAD_DATA;
-        return;
+    if (!jpeg_start_decompress(cinfo)) {
+        jpeg_abort_decompress(cinfo);
+        return JPEG_BAD_DATA;
     }
 
-    /* Check if we need to crop. If so, decode to a temporary buffer
-     * then do a "fake" direct decode to the original buffer for
-     * x-direction cropping.
-     */
+    /* Decode only the requested rectangle, straight into the buffer. */
 
-    if (   debug_cropping
-        && (request->v2.crop_x > 0 || request->v2.crop_y > 0 || request->v2.crop_width != cinfo.image_width)
-       ) {
-        waste = (unsigned char *)
-                    malloc(cinfo.image_width * cinfo.image_height * 4);
-        old_buf = request->v2.buffer;
+    crop_x = request->v2.crop_x;
+    crop_y = request->v2.crop_y;
+    crop_width = request->v2.crop_width;
+    crop_height = request->v2.crop_height;
 
-        /* Decode to our waste buffer. */
+    if (   crop_x + crop_width > cinfo->output_width
+        || crop_y + crop_height > cinfo->output_height) {
+        jpeg_abort_decompress(cinfo);
+        return JPEG_BAD_PARAM;
+    }
+    if (!crop_width || !crop_height) {
+        jpeg_abort_decompress(cinfo);
+        return JPEG_SUCCESS;
+    }
 
-        request->v2.buffer = waste;
+    pBmpRow = request->v2.buffer;  /* Point at first scanline in output. */
 
-        /* Decode all the image. */
+    if (use_turbo) {
+        JDIMENSION xoffset = 0, width = cinfo->output_width;
 
-        decode_height = cinfo.image_height;
-        stride = cinfo.image_width * 4;
-        cropped = TRUE;
-    } else {
-        decode_height = request->v2.crop_height;
-        stride = request->v2.stride;
-    }
+        /* Decode only the iMCU columns that hold the crop. The decoded
+         * rows then start at "xoffset", left of crop_x, and may be wider
+         * than wanted. A column either side is included, as upsampling
+         * smooths across it, so the edges match a full decode.
+         */
 
-    if (use_turbo) {
-        pBmpRow = request->v2.buffer;  /* Point at first scanline in output. */
-        scanlineBuffer[0] = (JSAMPARRAY)pBmpRow;
+        if (crop_scanline && (crop_x > 0 || crop_width < cinfo->output_width)) {
+            xoffset = crop_x > 0 ? crop_x - 1 : 0;
+            width = crop_x + crop_width - xoffset;
+            if (crop_x + crop_width < cinfo->output_width) {
+                width++;
+            }
+            crop_scanline(cinfo, &xoffset, &width);
+        }
+
+        /* A row buffer, for skipping without jpeg_skip_scanlines() and when
+         * the decoded rows are not exactly the crop.
+         */
 
-        /* Decode all lines. */
+        scanlineBuffer[0] = (cinfo->mem->alloc_sarray)((j_common_ptr)cinfo,
+                                                      JPOOL_IMAGE, width * 4, 1);
+        skip_rows(cinfo, crop_y, scanlineBuffer[0]);
 
-        while (cinfo.output_scanline < decode_height) {
-            jpeg_read_scanlines(&cinfo, (JSAMPARRAY)scanlineBuffer, 1);
-            pBmpRow += stride;
-            scanlineBuffer[0] = (JSAMPARRAY)pBmpRow;
+        if (xoffset == crop_x && width == crop_width) {
+            /* Decode directly to the output. */
+
+            while (cinfo->output_scanline < crop_y + crop_height) {
+                jpeg_read_scanlines(cinfo, (JSAMPARRAY)&pBmpRow, 1);
+                pBmpRow += request->v2.stride;
+            }
+        } else {
+            unsigned char *pSource = scanlineBuffer[0][0] + ((crop_x - xoffset) * 4);
+
+            while (cinfo->output_scanline < crop_y + crop_height) {
+                jpeg_read_scanlines(cinfo, scanlineBuffer[0], 1);
+                memcpy(pBmpRow, pSource, crop_width * 4);
+                pBmpRow += request->v2.stride;
+            }
         }
     } else {
         /* Bail out on unhandled image formats. */
 
-        if ((JCS_RGB       != cinfo.out_color_space) &&
-            (JCS_GRAYSCALE != cinfo.out_color_space)) {
+        if ((JCS_RGB       != cinfo->out_color_space) &&
+            (JCS_GRAYSCALE != cinfo->out_color_space)) {
             fprintf(stderr, "libjpeg: unsupported image format %d\n",
-                    cinfo.out_color_space);
+                    cinfo->out_color_space);
 
             /* Clean up and return error code. */
 	        
-            jpeg_destroy_decompress(&cinfo);        
-            request->v2.status = JPEG_BAD_PARAM;
-            return;
+            jpeg_abort_decompress(cinfo);
+            return JPEG_BAD_PARAM;
         }
 
         /*
-         * Allocate the scanline buffer: this buffer receives a
-         * single scanline from the JPEG.  Note that an allocation failure will
-         * call the errorexit handler which will longjmp us back to
-         * the error handler at the start of the function
+         * Allocate the scanline buffer: this buffer receives as many
+         * scanlines as libjpeg produces at a time.  Note that an allocation
+         * failure will call the errorexit handler which will longjmp us back
+         * to the error handler at the start of the function
          */
 
-        scanlineBuffer[0] = (cinfo.mem->alloc_sarray)(
-                                (j_common_ptr)&cinfo,
+        scanlineBuffer[0] = (cinfo->mem->alloc_sarray)(
+                                (j_common_ptr)cinfo,
                                 JPOOL_IMAGE,
-                                cinfo.image_width * cinfo.output_components,
-                                1);
+                                cinfo->image_width * cinfo->output_components,
+                                cinfo->rec_outbuf_height);
+
+        /* Skip the rows above the crop. */
+
+        skip_rows(cinfo, crop_y, scanlineBuffer[0]);
 
         /*
-         * Now we process each scanline in the image.
-         * As we read each scanline from the JPEG library,
-         * we add it to the bitmap data buffer
+         * Now we process the scanlines of the crop.
+         * As we read scanlines from the JPEG library,
+         * we add their cropped part to the bitmap data buffer
          */
-	     
-        pBmpRow = request->v2.buffer;  /* Point at first scanline in output. */
-
-        /* Decode the requested number of lines. */
 
-        while (cinfo.output_scanline < decode_height) {
-            JDIMENSION       column;            /* Current column in image. */
-            unsigned int    *pBmpCol;           /* Pointer to column in BMP. */
+        while (cinfo->output_scanline < crop_y + crop_height) {
+            JDIMENSION       lines, line;
             unsigned char   *pSource;           /* Pointer to source data. */
-	        
-            pBmpCol = (unsigned int *)pBmpRow;  /* Next output location. */
 
-            /* Read a single scanline from the JPEG image. */
+            /* Read up to rec_outbuf_height scanlines from the JPEG image. */
 
-            jpeg_read_scanlines(&cinfo, scanlineBuffer[0], 1);
-            pSource = scanlineBuffer[0][0];
-	        
-            /* Now add this scanline to the bitmap. */
-
-            if (JCS_RGB == cinfo.out_color_space) {
-                for (column = cinfo.image_width; column > 0; column--) {
-                    *pBmpCol = (((*pSource << 8) + pSource[1]) << 8) +
-                                   pSource[2];
-                    ++pBmpCol;
-                    pSource += 3;
-                }
-            } else {
-                unsigned char b;
+            lines = jpeg_read_scanlines(cinfo, scanlineBuffer[0],
+                                        min_lines(cinfo->rec_outbuf_height,
+                                                  crop_y + crop_height - cinfo->output_scanline));
+
+            /* Now add them to the bitmap. */
 
-                for (column = cinfo.image_width; column > 0; column--) {
-                    b = *pSource++;
-                    *pBmpCol++ = (((b << 8) + b) << 8) + b;
+            for (line = 0; line < lines; line++) {
+                pSource = scanlineBuffer[0][line] + (crop_x * cinfo->output_components);
+
+                if (JCS_GRAYSCALE == cinfo->out_color_space) {
+                    colorconv_gray_xrgb((uint32_t *)pBmpRow, pSource, crop_width);
+                } else if (xbgr) {
+                    colorconv_rgb_xbgr((uint32_t *)pBmpRow, pSource, crop_width);
+                } else {
+                    colorconv_rgb_xrgb((uint32_t *)pBmpRow, pSource, crop_width);
                 }
+                pBmpRow += request->v2.stride;
             }
-            pBmpRow += stride;
         }
     }
 
     /* As per libjpeg documentation, jpeg_finish_decompress should not be
-       called if we've finished with the object early. This can occur when
-       only a partial number of lines is required.
-       Instead, jpeg_abort_compress() should be called.
+       called if we've finished with the object early. This happens when
+       the crop does not reach the last line.
+       Instead, jpeg_abort_decompress() should be called.
      */
 
-    if (cinfo.output_height < cinfo.image_height) {
+    if (cinfo->output_scanline < cinfo->output_height) {
         /* Decoded part of the image, call abort. */
 
-        jpeg_abort_decompress(&cinfo);
+        jpeg_abort_decompress(cinfo);
     } else {
-        jpeg_finish_decompress(&cinfo);
+        jpeg_finish_decompress(cinfo);
     }
-    jpeg_destroy_decompress(&cinfo);
 
-    if (cropped) {
-        int            y;
-        unsigned char *ptr = old_buf;
+    return JPEG_SUCCESS;
+}
 
-        /* Now we've got to copy to form the cropped JPEG. */
+/* Decode, or copy from the tile cache if this image has been seen. Large
+ * images with restart markers are decoded in strips on several threads.
+ */
 
-        for (y = 0; y < request->v2.crop_height; y++) {
-            unsigned char *img_ptr;
-            /* Find the correct point in the source image. */
+static int decode(struct JPEG_request *request)
+{
+    int status = -1;
 
-            img_ptr = request->v2.buffer +
-                        ((y + request->v2.crop_y) * cinfo.image_width * 4) +
-                        (request->v2.crop_x * 4);
+    if (tilecache_lookup(request)) {
+        return JPEG_SUCCESS;
+    }
 
-            /* Copy the full or partial scanline. */
+    if (   use_strips
+        && request->v2.crop_width * request->v2.crop_height >= STRIPS_MIN_PIXELS) {
+        status = strips_decode(request, pool_size(), decode_image);
+    }
+    if (status < 0) {
+        status = decode_image(request);
+    }
+    if (status == JPEG_SUCCESS) {
+        tilecache_insert(request);
+    }
+
+    return status;
+}
 
-            memcpy(ptr, img_ptr, request->v2.crop_width * 4);
+/* Background decoding on a worker thread. */
 
-            /* Advance ptr. */
-            ptr += request->v2.stride;
+static void decode_background(void *item)
+{
+    struct JPEG_request *request = (struct JPEG_request *)item;
+    COMPLETION          *completion = (COMPLETION *)request->v2.priv;
+    int                  status = decode(request);
+    uint64_t             one = 1;
+
+    if (completion) {
+        /* Reported through the descriptor. */
+
+        completion->status = status;
+        completion->next = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&completed, &completion->next,
+                                            completion, TRUE,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
         }
-        /* Free waste buffer. */
+        if (write(completion_fd, &one, sizeof(one)) < 0) {
+            /* Counter saturated; the descriptor is readable anyway. */
+        }
+        return;
+    }
+
+    /* Wake finish_decode(). Nothing may touch the request once a waiter
+     * has seen its status.
+     */
+
+    pthread_mutex_lock(&finish_lock);
+    __atomic_store_n(&request->v2.status, status, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&finished);
+    pthread_mutex_unlock(&finish_lock);
+}
+
+static void start_decode(struct JPEG_request *request)
+{
+    if (!request) {
+        return;
+    }
 
-        free(request->v2.buffer);
+    if (completion_fd >= 0) {
+        /* The caller sets completion_fd to -1 if it will not use it,
+         * and then polls or calls finish_decode().
+         */
 
-        /* Ensure we return the correct buffer! */
+        COMPLETION *completion = NULL;
 
-        request->v2.buffer = old_buf;
+        if (request->v2.completion_fd != -1) {
+            completion = (COMPLETION *)malloc(sizeof(*completion));
+            if (completion) {
+                completion->request = request;
+                request->v2.completion_fd = completion_fd;
+            }
+        }
+        request->v2.priv = completion;
+        request->v2.status = JPEG_BUSY;
+        if (   (completion || request->v2.completion_fd == -1)
+            && pool_submit(decode_background, request)) {
+            return;
+        }
+        free(completion);
+        request->v2.priv = NULL;
     }
-    request->v2.status = JPEG_SUCCESS;
+
+    /* Synchronous. */
+
+    request->v2.status = decode(request);
 }
 
-/* Dummy functions for handling non-existent non-blocking requests. */
+/* Wait for a background request, when no notification was asked for. */
 
 static void finish_decode(struct JPEG_request *request)
 {
+    if (!request || __atomic_load_n(&request->v2.status, __ATOMIC_ACQUIRE) != JPEG_BUSY) {
+        return;
+    }
+
+    pthread_mutex_lock(&finish_lock);
+    while (request->v2.status == JPEG_BUSY) {
+        pthread_cond_wait(&finished, &finish_lock);
+    }
+    pthread_mutex_unlock(&finish_lock);
 }
 
+/* Called when completion_fd is readable: return one completed request,
+ * or NULL. The descriptor is left readable while more are waiting.
+ */
+
 static struct JPEG_request *complete_request(void)
 {
-    return NULL;
+    struct JPEG_request *request = NULL;
+    COMPLETION          *completion, *list;
+    uint64_t             count;
+
+    if (!delivering) {
+        /* Reset the count before taking the list, so a completion that
+         * is not taken still leaves the descriptor readable.
+         */
+
+        if (read(completion_fd, &count, sizeof(count)) < 0) {
+            /* Nothing signalled, but look anyway. */
+        }
+        list = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+
+        /* Reverse it, to return requests in order of completion. */
+
+        while (list) {
+            completion = list;
+            list = completion->next;
+            completion->next = delivering;
+            delivering = completion;
+        }
+    }
+
+    completion = delivering;
+    if (completion) {
+        delivering = completion->next;
+        request = completion->request;
+        request->v2.priv = NULL;
+        request->v2.status = completion->status;
+        free(completion);
+
+        if (delivering) {
+            count = 1;
+            if (write(completion_fd, &count, sizeof(count)) < 0) {
+                /* Already readable. */
+            }
+        }
+    }
+
+    return request;
+}
+
+static void decode_item(void *item)
+{
+    struct JPEG_request *request = (struct JPEG_request *)item;
+
+    request->v2.status = decode(request);
 }
 
-/* Synchronous batch decoding implementation. This function simply processes
- * the batch of JPEGs serially, and is only useful for debugging purposes. 
+/* Synchronous batch decoding implementation. The JPEGs of the batch are
+ * decoded in parallel on the worker pool, largest first; each has its own
+ * libjpeg context, so they are independent.
  */
 
 static void batch_decode(struct JPEG_request request[], int num_requests)
 {
-    int i;
-
     if (batchDebugging) {
         /* Report the number of JPEGs in this batch. */
 
         printf("ctxjpeg_fb::batch_decode(%d)\n", num_requests); 
     }
-    
-    for (i = 0; i < num_requests; i++) {
-        start_decode(&request[i]);
-    }
+
+    schedule_batch(decode_item, request, num_requests);
 }
@@ -0,0 +1,259 @@
+/******************************************************************************
+ * memmgr.c
+ *
+ * Arena for libjpeg's per-image memory pool. A decompressor that is kept
+ * for many images allocates the same working memory for each of them, and
+ * frees it again at the end. Here the per-image allocations come from a
+ * block that is rewound rather than freed, so once the block has grown to
+ * fit an image no memory is allocated for the next one.
+ *
+ * This is done by wrapping the allocation methods of the memory manager
+ * libjpeg creates. Permanent allocations and virtual arrays are left to
+ * libjpeg.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <jpeglib.h>
+
+#include "memmgr.h"
+
+/* libjpeg-turbo aligns allocations for its SIMD code, and pads sample rows
+ * to twice that, as some kernels work past the end of a row. Do the same.
+ */
+
+#define ARENA_ALIGN         32
+#define ARENA_ROW_ALIGN     (2 * ARENA_ALIGN)
+#define ARENA_MIN_BLOCK     65536
+
+#define ROUND_UP(n, a)      (((n) + (a) - 1) & ~(size_t)((a) - 1))
+
+typedef struct ARENA_BLOCK {
+    struct ARENA_BLOCK     *next;       /* Earlier, full, blocks. */
+    size_t                  size;
+    size_t                  used;
+    char                   *base;       /* Aligned start of the space. */
+} ARENA_BLOCK;
+
+typedef struct {
+    struct jpeg_memory_mgr  original;   /* libjpeg's own methods. */
+    ARENA_BLOCK            *blocks;     /* Newest first. */
+} ARENA;
+
+/* The arena hangs off client_data, which libjpeg leaves to the application. */
+
+#define ARENA_OF(cinfo)     ((ARENA *)(cinfo)->client_data)
+
+static ARENA_BLOCK *new_block(ARENA *arena, size_t size)
+{
+    ARENA_BLOCK *block;
+
+    block = (ARENA_BLOCK *)malloc(ROUND_UP(sizeof(ARENA_BLOCK), ARENA_ALIGN) + size + ARENA_ALIGN);
+    if (!block) {
+        return NULL;
+    }
+    block->base = (char *)ROUND_UP((size_t)(block + 1), ARENA_ALIGN);
+    block->size = size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    return block;
+}
+
+/* Allocate from the arena, or return NULL to fall back on libjpeg. */
+
+static void *arena_alloc(ARENA *arena, size_t size)
+{
+    ARENA_BLOCK *block = arena->blocks;
+    void        *p;
+
+    size = ROUND_UP(size, ARENA_ALIGN);
+    if (!block || block->used + size > block->size) {
+        block = new_block(arena, size > ARENA_MIN_BLOCK ? size : ARENA_MIN_BLOCK);
+        if (!block) {
+            return NULL;
+        }
+    }
+
+    p = block->base + block->used;
+    block->used += size;
+
+    return p;
+}
+
+/* Start again at the beginning. If the image needed more than one block,
+ * replace them with one that holds it all.
+ */
+
+static void arena_rewind(ARENA *arena)
+{
+    ARENA_BLOCK *block = arena->blocks;
+    size_t       total = 0;
+
+    if (!block) {
+        return;
+    }
+
+    if (block->next) {
+        while ((block = arena->blocks)) {
+            total += block->size;
+            arena->blocks = block->next;
+            free(block);
+        }
+        new_block(arena, total);
+    } else {
+        block->used = 0;
+    }
+}
+
+static void *
+alloc_small(j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+    void *p = NULL;
+
+    if (pool_id == JPOOL_IMAGE) {
+        p = arena_alloc(ARENA_OF(cinfo), sizeofobject);
+    }
+
+    return p ? p : ARENA_OF(cinfo)->original.alloc_small(cinfo, pool_id, sizeofobject);
+}
+
+static void *
+alloc_large(j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+    void *p = NULL;
+
+    if (pool_id == JPOOL_IMAGE) {
+        p = arena_alloc(ARENA_OF(cinfo), sizeofobject);
+    }
+
+    return p ? p : ARENA_OF(cinfo)->original.alloc_large(cinfo, pool_id, sizeofobject);
+}
+
+/* A two-dimensional array, as row pointers and contiguous rows. */
+
+static void **
+alloc_rows(j_common_ptr cinfo, size_t row_size, JDIMENSION numrows)
+{
+    ARENA      *arena = ARENA_OF(cinfo);
+    void      **rows;
+    char       *data;
+    JDIMENSION  i;
+
+    rows = (void **)arena_alloc(arena, numrows * sizeof(void *));
+    data = rows ? (char *)arena_alloc(arena, numrows * row_size) : NULL;
+    if (!data) {
+        return NULL;
+    }
+
+    for (i = 0; i < numrows; i++) {
+        rows[i] = data + (i * row_size);
+    }
+
+    return rows;
+}
+
+static JSAMPARRAY
+alloc_sarray(j_common_ptr cinfo, int pool_id,
+             JDIMENSION samplesperrow, JDIMENSION numrows)
+{
+    JSAMPARRAY rows = NULL;
+
+    if (pool_id == JPOOL_IMAGE) {
+        rows = (JSAMPARRAY)alloc_rows(cinfo, ROUND_UP(samplesperrow * sizeof(JSAMPLE), ARENA_ROW_ALIGN), numrows);
+    }
+
+    return rows ? rows : ARENA_OF(cinfo)->original.alloc_sarray(cinfo, pool_id, samplesperrow, numrows);
+}
+
+static JBLOCKARRAY
+alloc_barray(j_common_ptr cinfo, int pool_id,
+             JDIMENSION blocksperrow, JDIMENSION numrows)
+{
+    JBLOCKARRAY rows = NULL;
+
+    if (pool_id == JPOOL_IMAGE) {
+        rows = (JBLOCKARRAY)alloc_rows(cinfo, ROUND_UP(blocksperrow * sizeof(JBLOCK), ARENA_ALIGN), numrows);
+    }
+
+    return rows ? rows : ARENA_OF(cinfo)->original.alloc_barray(cinfo, pool_id, blocksperrow, numrows);
+}
+
+static void
+free_pool(j_common_ptr cinfo, int pool_id)
+{
+    if (pool_id == JPOOL_IMAGE) {
+        arena_rewind(ARENA_OF(cinfo));
+    }
+
+    ARENA_OF(cinfo)->original.free_pool(cinfo, pool_id);
+}
+
+/*****************************************************************************
+ * memmgr_jpeg_arena
+ *
+ * Make the per-image allocations of a newly created decompressor come from
+ * an arena. If the arena can not be set up, libjpeg allocates as usual.
+ *
+ * Parameters
+ *
+ * cinfo: Pointer to decompression structure, client_data unused
+ *
+ * Returns
+ *
+ * This function has no return value
+ *****************************************************************************/
+
+void
+memmgr_jpeg_arena(j_common_ptr cinfo)
+{
+    ARENA *arena = (ARENA *)calloc(1, sizeof(ARENA));
+
+    if (!arena) {
+        return;
+    }
+
+    arena->original = *cinfo->mem;
+    cinfo->client_data = arena;
+
+    cinfo->mem->alloc_small  = alloc_small;
+    cinfo->mem->alloc_large  = alloc_large;
+    cinfo->mem->alloc_sarray = alloc_sarray;
+    cinfo->mem->alloc_barray = alloc_barray;
+    cinfo->mem->free_pool    = free_pool;
+}
+
+/*****************************************************************************
+ * memmgr_jpeg_arena_free
+ *
+ * Free the arena, after the decompressor has been destroyed.
+ *
+ * Parameters
+ *
+ * cinfo: Pointer to decompression structure
+ *
+ * Returns
+ *
+ * This function has no return value
+ *****************************************************************************/
+
+void
+memmgr_jpeg_arena_free(j_common_ptr cinfo)
+{
+    ARENA       *arena = ARENA_OF(cinfo);
+    ARENA_BLOCK *block;
+
+    if (!arena) {
+        return;
+    }
+
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        free(block);
+    }
+    free(arena);
+    cinfo->client_data = NULL;
+}
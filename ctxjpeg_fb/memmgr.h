@@ -0,0 +1,26 @@
+/*****************************************************************************
+ * memmgr.h
+ *
+ * Include file for the arena memory manager
+ *
+ *****************************************************************************/
+
+#ifndef MEMMGR_H
+#define MEMMGR_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void
+memmgr_jpeg_arena(j_common_ptr cinfo);
+
+void
+memmgr_jpeg_arena_free(j_common_ptr cinfo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MEMMGR_H */
@@ -0,0 +1,171 @@
+/***************************************************************************
+ *
+ * pool.c
+ *
+ * Persistent worker threads. The threads are started on first use and
+ * then wait on a queue of jobs for the life of the process, so a batch
+ * costs a wakeup rather than thread creation.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define POOL_MAX_THREADS    16
+#define POOL_QUEUE          64          /* Jobs; a power of 2. */
+
+typedef struct {
+    POOL_FN     fn;
+    void       *item;
+    int        *pending;                /* Decremented when done. */
+} POOL_JOB;
+
+static pthread_once_t   once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   work = PTHREAD_COND_INITIALIZER;    /* Jobs queued. */
+static pthread_cond_t   done = PTHREAD_COND_INITIALIZER;    /* Job finished. */
+static pthread_cond_t   space = PTHREAD_COND_INITIALIZER;   /* Queue not full. */
+
+static POOL_JOB         queue[POOL_QUEUE];
+static unsigned int     head, tail;     /* Next to take, next to fill. */
+static int              num_threads;
+
+int pool_size(void)
+{
+    static int size;
+
+    if (!size) {
+        char *threads = getenv("CTXJPEG_FB_THREADS");
+        long n = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (n < 1) {
+            n = 1;
+        } else if (n > POOL_MAX_THREADS) {
+            n = POOL_MAX_THREADS;
+        }
+        size = (int)n;
+    }
+
+    return size;
+}
+
+/* Call with the lock held, and a job queued. */
+
+static void run_one(void)
+{
+    POOL_JOB job = queue[head++ % POOL_QUEUE];
+
+    pthread_cond_signal(&space);
+    pthread_mutex_unlock(&lock);
+
+    job.fn(job.item);
+
+    pthread_mutex_lock(&lock);
+    if (job.pending && --*job.pending == 0) {
+        pthread_cond_broadcast(&done);
+    }
+}
+
+static void *worker(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (head == tail) {
+            pthread_cond_wait(&work, &lock);
+        }
+        run_one();
+    }
+
+    return NULL;
+}
+
+static void start(void)
+{
+    pthread_attr_t attr;
+    pthread_t      thread;
+    int            i;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < pool_size(); i++) {
+        if (pthread_create(&thread, &attr, worker, NULL) == 0) {
+            num_threads++;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/* Call with the lock held. */
+
+static void queue_job(POOL_FN fn, void *item, int *pending)
+{
+    while (tail - head == POOL_QUEUE) {
+        pthread_cond_wait(&space, &lock);
+    }
+
+    queue[tail % POOL_QUEUE].fn = fn;
+    queue[tail % POOL_QUEUE].item = item;
+    queue[tail % POOL_QUEUE].pending = pending;
+    tail++;
+
+    pthread_cond_signal(&work);
+}
+
+int pool_submit(POOL_FN fn, void *item)
+{
+    pthread_once(&once, start);
+
+    if (!num_threads) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    queue_job(fn, item, NULL);
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+void pool_batch(POOL_FN fn, void *items, size_t item_size, int num_items)
+{
+    int pending = num_items;
+    int i;
+
+    pthread_once(&once, start);
+
+    if (!num_threads) {
+        /* No threads could be started. */
+        for (i = 0; i < num_items; i++) {
+            fn((char *)items + (i * item_size));
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    for (i = 0; i < num_items; i++) {
+        /* Batches may be started by workers, so help rather than wait
+         * for room in the queue.
+         */
+        while (tail - head == POOL_QUEUE) {
+            run_one();
+        }
+        queue_job(fn, (char *)items + (i * item_size), &pending);
+    }
+
+    /* Help until the queue is empty, then wait for the rest. */
+    while (pending > 0) {
+        if (head != tail) {
+            run_one();
+        } else {
+            pthread_cond_wait(&done, &lock);
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,35 @@
+/***************************************************************************
+ *
+ * pool.h
+ *
+ * Persistent worker threads, used to decode several JPEGs in parallel
+ * or in the background.
+ *
+ ***************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef void (*POOL_FN)(void *item);
+
+/* Number of worker threads: the number of online cores, or the value of
+ * CTXJPEG_FB_THREADS if set.
+ */
+
+int pool_size(void);
+
+/* Queue a call of fn(item) and return without waiting for it. Returns 0,
+ * having done nothing, if there are no worker threads.
+ */
+
+int pool_submit(POOL_FN fn, void *item);
+
+/* Call fn() for each of "num_items" items of "item_size" bytes, in
+ * parallel, returning when all are done. The calling thread helps.
+ */
+
+void pool_batch(POOL_FN fn, void *items, size_t item_size, int num_items);
+
+#endif /* POOL_H */
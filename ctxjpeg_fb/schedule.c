@@ -0,0 +1,164 @@
+/***************************************************************************
+ *
+ * schedule.c
+ *
+ * Batches mix tiny icons with large strips. Taken in the order given, a
+ * big JPEG near the end leaves the other threads idle while one decodes
+ * it, so each JPEG's cost is estimated from its frame header and size,
+ * and the batch is queued longest first. The workers take the next job
+ * from the queue as they become free, which balances the rest.
+ *
+ ***************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "schedule.h"
+
+/* Fixed cost of a JPEG, in pixels: a 16x16 tile takes about as long as
+ * a thousand more pixels of a larger one.
+ */
+
+#define SCHEDULE_OVERHEAD      1024
+
+typedef struct {
+    struct JPEG_request *request;
+    POOL_FN              fn;
+    unsigned long long   cost;
+    uint64_t             ns;            /* Decode time. */
+} SCHEDULE_JOB;
+
+static pthread_mutex_t  schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ctxjpeg_fb_schedule_stats stats;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* Estimate the decode time in pixels, from the frame header if one is
+ * found before the scan, else from the crop.
+ */
+
+static unsigned long long estimate(const struct JPEG_request *request)
+{
+    const unsigned char *data = request->v2.image;
+    unsigned int         size = request->v2.size;
+    unsigned int         p = 2;
+    unsigned long long   pixels = (unsigned long long)request->v2.crop_width * request->v2.crop_height;
+
+    while (data && p + 9 <= size && data[p] == 0xff) {
+        unsigned char marker = data[p + 1];
+
+        if (marker == 0xda) {
+            break;                              /* SOS */
+        }
+        if (   marker >= 0xc0 && marker <= 0xcf
+            && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            unsigned int height = (data[p + 5] << 8) | data[p + 6];
+            unsigned int width = (data[p + 7] << 8) | data[p + 8];
+
+            /* Rows above the crop are still entropy decoded, those below
+             * are not. Progressive images take about twice as long.
+             */
+
+            if (height && width && request->v2.crop_y + request->v2.crop_height <= height) {
+                pixels = (unsigned long long)width * (request->v2.crop_y + request->v2.crop_height);
+            }
+            if (marker == 0xc2 || marker == 0xc6) {
+                pixels *= 2;
+            }
+            break;
+        }
+        p += 2 + ((data[p + 2] << 8) | data[p + 3]);
+    }
+
+    return SCHEDULE_OVERHEAD + pixels + size;
+}
+
+/* Longest first, then in the order given. */
+
+static int compare_jobs(const void *a, const void *b)
+{
+    const SCHEDULE_JOB *ja = (const SCHEDULE_JOB *)a;
+    const SCHEDULE_JOB *jb = (const SCHEDULE_JOB *)b;
+
+    if (ja->cost != jb->cost) {
+        return ja->cost < jb->cost ? 1 : -1;
+    }
+
+    return ja->request < jb->request ? -1 : 1;
+}
+
+static void run_job(void *item)
+{
+    SCHEDULE_JOB *job = (SCHEDULE_JOB *)item;
+    uint64_t   start = now_ns();
+
+    job->fn(job->request);
+    job->ns = now_ns() - start;
+}
+
+void schedule_batch(POOL_FN fn, struct JPEG_request request[], int num_requests)
+{
+    SCHEDULE_JOB *jobs;
+    uint64_t   start, makespan, busy = 0, longest = 0, ideal;
+    int        threads = pool_size() < num_requests ? pool_size() : num_requests;
+    int        i;
+
+    if (num_requests < 1) {
+        return;
+    }
+
+    jobs = malloc(num_requests * sizeof(SCHEDULE_JOB));
+    if (!jobs) {
+        pool_batch(fn, request, sizeof(request[0]), num_requests);
+        return;
+    }
+
+    for (i = 0; i < num_requests; i++) {
+        jobs[i].request = &request[i];
+        jobs[i].fn = fn;
+        jobs[i].cost = estimate(&request[i]);
+        jobs[i].ns = 0;
+    }
+    qsort(jobs, num_requests, sizeof(SCHEDULE_JOB), compare_jobs);
+
+    start = now_ns();
+    pool_batch(run_job, jobs, sizeof(SCHEDULE_JOB), num_requests);
+    makespan = now_ns() - start;
+
+    for (i = 0; i < num_requests; i++) {
+        busy += jobs[i].ns;
+        if (jobs[i].ns > longest) {
+            longest = jobs[i].ns;
+        }
+    }
+    ideal = busy / threads;
+    if (ideal < longest) {
+        ideal = longest;
+    }
+
+    free(jobs);
+
+    pthread_mutex_lock(&schedule_lock);
+    stats.batches++;
+    stats.requests += num_requests;
+    stats.makespan_us += makespan / 1000;
+    stats.ideal_us += ideal / 1000;
+    stats.busy_us += busy / 1000;
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void ctxjpeg_fb_schedule_stats(struct ctxjpeg_fb_schedule_stats *out)
+{
+    pthread_mutex_lock(&schedule_lock);
+    *out = stats;
+    pthread_mutex_unlock(&schedule_lock);
+}
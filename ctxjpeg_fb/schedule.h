@@ -0,0 +1,38 @@
+/***************************************************************************
+ *
+ * schedule.h
+ *
+ * Ordering the JPEGs of a batch across the worker threads.
+ *
+ ***************************************************************************/
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include "jpeg_decode.h"
+#include "pool.h"
+
+/* Counters, for ctxjpeg_fb_schedule_stats(). Times are in microseconds; the
+ * ideal for a batch is the larger of its total decode time spread evenly
+ * over the threads, and its longest JPEG.
+ */
+
+struct ctxjpeg_fb_schedule_stats {
+    unsigned long long  batches;
+    unsigned long long  requests;
+    unsigned long long  makespan_us;    /* Start of batch to last finished. */
+    unsigned long long  ideal_us;
+    unsigned long long  busy_us;        /* Sum of the decode times. */
+};
+
+/* Call fn() for each request of the batch on the worker pool, the most
+ * expensive first, returning when all are done.
+ */
+
+void schedule_batch(POOL_FN fn, struct JPEG_request request[], int num_requests);
+
+/* Exported, for callers that look it up with dlsym(). */
+
+void ctxjpeg_fb_schedule_stats(struct ctxjpeg_fb_schedule_stats *stats);
+
+#endif /* SCHEDULE_H */
@@ -59,12 +59,15 @@ srcmgr_jpeg_memory_src(
     struct jpeg_source_mgr     *pSourceManager;  /*Pointer to source manager*/
 
 
-    /* Allocate a new jpeg_source_mgr structure. */
-
+    /* Allocate a new jpeg_source_mgr structure, unless the decompressor
+     * is being reused and already has one.
+     */
 
-    cinfo->src = (*cinfo->mem->alloc_small)((j_common_ptr) cinfo,
-                                            JPOOL_PERMANENT,
-                                            sizeof(struct jpeg_source_mgr));
+    if (cinfo->src == NULL) {
+        cinfo->src = (*cinfo->mem->alloc_small)((j_common_ptr) cinfo,
+                                                JPOOL_PERMANENT,
+                                                sizeof(struct jpeg_source_mgr));
+    }
 
     pSourceManager = cinfo->src;
 
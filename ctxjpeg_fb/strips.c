@@ -0,0 +1,398 @@
+/***************************************************************************
+ *
+ * strips.c
+ *
+ * A large JPEG with restart markers (DRI) is decoded on several threads.
+ * Decoding restarts at each marker, so a run of MCU rows that begins at
+ * one can be decoded on its own: each strip is made into a smaller JPEG,
+ * from the original headers with the height changed and the entropy-coded
+ * data of its rows, and decoded into its own rows of the output.
+ *
+ * With vertically subsampled chroma, upsampling a row uses its neighbours,
+ * so strips are decoded with extra rows above and below that are cropped
+ * off, and the result is the same as a single decode.
+ *
+ * Only baseline and extended Huffman images in a single interleaved scan
+ * are split; anything else is left to the serial decoder.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strips.h"
+#include "pool.h"
+
+#define MARKER_SOF0     0xc0
+#define MARKER_SOF1     0xc1
+#define MARKER_DHT      0xc4
+#define MARKER_JPG      0xc8
+#define MARKER_DAC      0xcc
+#define MARKER_SOF15    0xcf
+#define MARKER_RST0     0xd0
+#define MARKER_RST7     0xd7
+#define MARKER_SOI      0xd8
+#define MARKER_EOI      0xd9
+#define MARKER_SOS      0xda
+#define MARKER_DNL      0xdc
+#define MARKER_DRI      0xdd
+
+/* Where things are in the compressed image. */
+
+typedef struct {
+    const unsigned char *data;
+    unsigned int         size;
+    unsigned int         header_size;       /* Up to the entropy-coded data. */
+    unsigned int         height_offset;     /* Of the height in the SOF. */
+    unsigned int         scan_end;          /* Offset of the EOI marker. */
+    unsigned int         width, height;
+    unsigned int         mcu_width, mcu_height;
+    unsigned int         mcus_per_row, mcu_rows;
+    unsigned int         restart_interval;  /* In MCUs. */
+    int                  v_subsampled;
+    unsigned int         num_restarts;
+    unsigned int        *restarts;          /* Offsets of the RST markers. */
+} LAYOUT;
+
+typedef struct {
+    struct JPEG_request  request;
+    STRIP_DECODE         decode;
+    unsigned char       *jpeg;
+    int                  status;
+} STRIP;
+
+#define GET16(p)    (((p)[0] << 8) | (p)[1])
+
+/* Read the headers, up to the start of scan. Returns 0 if the image can
+ * not be split.
+ */
+
+static int parse_headers(LAYOUT *layout)
+{
+    const unsigned char *data = layout->data;
+    unsigned int         p = 2, len, i;
+    unsigned int         components = 0, h_max = 0, v_max = 0;
+    unsigned char        sampling[4];
+
+    if (layout->size < 4 || data[0] != 0xff || data[1] != MARKER_SOI) {
+        return 0;
+    }
+
+    for (;;) {
+        const unsigned char *seg;
+        unsigned char        marker;
+
+        if (p + 4 > layout->size || data[p] != 0xff) {
+            return 0;
+        }
+        while (data[p + 1] == 0xff && p + 5 <= layout->size) {
+            p++;                                /* Fill bytes. */
+        }
+        marker = data[p + 1];
+        len = GET16(data + p + 2);
+        if (len < 2 || p + 2 + len > layout->size) {
+            return 0;
+        }
+        seg = data + p + 4;
+
+        switch (marker) {
+        case MARKER_SOF0:
+        case MARKER_SOF1:
+            if (len < 8 || seg[0] != 8) {
+                return 0;
+            }
+            layout->height_offset = p + 5;
+            layout->height = GET16(seg + 1);
+            layout->width = GET16(seg + 3);
+            components = seg[5];
+            if (!components || components > 4 || len < 8 + (3 * components)) {
+                return 0;
+            }
+            for (i = 0; i < components; i++) {
+                unsigned char hv = seg[6 + (3 * i) + 1];
+
+                sampling[i] = hv;
+                if ((hv >> 4) > h_max) {
+                    h_max = hv >> 4;
+                }
+                if ((hv & 15) > v_max) {
+                    v_max = hv & 15;
+                }
+            }
+            break;
+
+        case MARKER_DRI:
+            if (len < 4) {
+                return 0;
+            }
+            layout->restart_interval = GET16(seg);
+            break;
+
+        case MARKER_SOS:
+            /* All components in the one scan. */
+            if (!components || seg[0] != components) {
+                return 0;
+            }
+            layout->header_size = p + 2 + len;
+            goto found;
+
+        case MARKER_DNL:
+            return 0;
+
+        default:
+            /* Other frame types: progressive, lossless, arithmetic. */
+            if (   marker >= MARKER_SOF0 && marker <= MARKER_SOF15
+                && marker != MARKER_DHT && marker != MARKER_JPG && marker != MARKER_DAC) {
+                return 0;
+            }
+            break;
+        }
+
+        p += 2 + len;
+    }
+
+found:
+    if (!layout->width || !layout->height || !layout->restart_interval || !h_max || !v_max) {
+        return 0;
+    }
+
+    /* A single component scan has one block per MCU. */
+    if (components == 1) {
+        h_max = v_max = 1;
+    }
+    layout->mcu_width = 8 * h_max;
+    layout->mcu_height = 8 * v_max;
+    layout->mcus_per_row = (layout->width + layout->mcu_width - 1) / layout->mcu_width;
+    layout->mcu_rows = (layout->height + layout->mcu_height - 1) / layout->mcu_height;
+
+    layout->v_subsampled = 0;
+    for (i = 0; i < components && components > 1; i++) {
+        if ((sampling[i] & 15) != v_max) {
+            layout->v_subsampled = 1;
+        }
+    }
+
+    return 1;
+}
+
+/* Find the restart markers in the scan, which must be followed by EOI.
+ * Returns 0 if they are not as expected.
+ */
+
+static int index_restarts(LAYOUT *layout)
+{
+    const unsigned char *data = layout->data;
+    unsigned int         p = layout->header_size, allocated = 0;
+    unsigned int         expected;
+
+    for (;;) {
+        const unsigned char *ff = memchr(data + p, 0xff, layout->size - p);
+        unsigned char        marker;
+
+        if (!ff || (unsigned int)(ff - data) + 1 >= layout->size) {
+            return 0;                           /* Truncated. */
+        }
+        p = ff - data;
+        marker = data[p + 1];
+
+        if (marker == 0 || marker == 0xff) {
+            p += (marker == 0) ? 2 : 1;         /* Stuffed byte, or fill. */
+        } else if (marker >= MARKER_RST0 && marker <= MARKER_RST7) {
+            if (marker != MARKER_RST0 + (layout->num_restarts & 7)) {
+                return 0;
+            }
+            if (layout->num_restarts == allocated) {
+                unsigned int *more;
+
+                allocated = allocated ? 2 * allocated : 256;
+                more = realloc(layout->restarts, allocated * sizeof(unsigned int));
+                if (!more) {
+                    return 0;
+                }
+                layout->restarts = more;
+            }
+            layout->restarts[layout->num_restarts++] = p;
+            p += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (data[p + 1] != MARKER_EOI) {
+        return 0;                               /* Another scan. */
+    }
+    layout->scan_end = p;
+
+    expected = ((layout->mcus_per_row * layout->mcu_rows) - 1) / layout->restart_interval;
+
+    return layout->num_restarts == expected;
+}
+
+/* Start and end of the data of restart interval "i". */
+
+static unsigned int interval_start(const LAYOUT *layout, unsigned int i)
+{
+    return i ? layout->restarts[i - 1] + 2 : layout->header_size;
+}
+
+static unsigned int interval_end(const LAYOUT *layout, unsigned int i)
+{
+    return i < layout->num_restarts ? layout->restarts[i] : layout->scan_end;
+}
+
+/* Make a JPEG of MCU rows [first, last), which start at restart markers,
+ * unless "last" is the end of the image. Returns its size, or 0.
+ */
+
+static unsigned int make_strip(const LAYOUT *layout, unsigned int first,
+                               unsigned int last, unsigned char **jpeg)
+{
+    unsigned int   i0 = (first * layout->mcus_per_row) / layout->restart_interval;
+    unsigned int   i1 = (last == layout->mcu_rows) ? layout->num_restarts + 1 :
+                        (last * layout->mcus_per_row) / layout->restart_interval;
+    unsigned int   height, size, i;
+    unsigned char *out;
+
+    size = layout->header_size + 2;
+    for (i = i0; i < i1; i++) {
+        size += interval_end(layout, i) - interval_start(layout, i) + 2;
+    }
+
+    out = *jpeg = malloc(size);
+    if (!out) {
+        return 0;
+    }
+
+    memcpy(out, layout->data, layout->header_size);
+    height = last * layout->mcu_height;
+    if (height > layout->height) {
+        height = layout->height;
+    }
+    height -= first * layout->mcu_height;
+    out[layout->height_offset] = height >> 8;
+    out[layout->height_offset + 1] = height & 0xff;
+    out += layout->header_size;
+
+    /* Copy the intervals, numbering the markers between them from RST0. */
+    for (i = i0; i < i1; i++) {
+        unsigned int start = interval_start(layout, i);
+        unsigned int len = interval_end(layout, i) - start;
+
+        if (i > i0) {
+            *out++ = 0xff;
+            *out++ = MARKER_RST0 + ((i - i0 - 1) & 7);
+        }
+        memcpy(out, layout->data + start, len);
+        out += len;
+    }
+    *out++ = 0xff;
+    *out++ = MARKER_EOI;
+
+    return size;
+}
+
+static void decode_strip(void *item)
+{
+    STRIP *strip = (STRIP *)item;
+
+    strip->status = strip->decode(&strip->request);
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+    while (b) {
+        unsigned int t = a % b;
+
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+int strips_decode(struct JPEG_request *request, int max_strips, STRIP_DECODE decode)
+{
+    LAYOUT       layout;
+    STRIP       *strips;
+    unsigned int step, steps, overlap, num, k;
+    int          status = -1;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.data = request->v2.image;
+    layout.size = request->v2.size;
+
+    if (   !layout.data || !request->v2.buffer
+        || !parse_headers(&layout)
+        || request->v2.crop_x || request->v2.crop_y
+        || request->v2.crop_width != layout.width
+        || request->v2.crop_height != layout.height
+        || !index_restarts(&layout)) {
+        free(layout.restarts);
+        return -1;
+    }
+
+    /* Strips start on MCU rows that begin a restart interval, every
+     * "step" rows, and overlap by that much if upsampling needs it.
+     */
+
+    step = layout.restart_interval / gcd(layout.restart_interval, layout.mcus_per_row);
+    steps = layout.mcu_rows / step;
+    num = steps < (unsigned int)max_strips ? steps : (unsigned int)max_strips;
+    overlap = layout.v_subsampled ? step : 0;
+
+    if (num < 2 || !(strips = calloc(num, sizeof(STRIP)))) {
+        free(layout.restarts);
+        return -1;
+    }
+
+    for (k = 0; k < num; k++) {
+        unsigned int first = ((k * steps) / num) * step;
+        unsigned int last = (k + 1 == num) ? layout.mcu_rows : (((k + 1) * steps) / num) * step;
+        unsigned int from = first > overlap ? first - overlap : 0;
+        unsigned int to = last + overlap < layout.mcu_rows ? last + overlap : layout.mcu_rows;
+        unsigned int y0 = first * layout.mcu_height;
+        unsigned int y1 = last * layout.mcu_height;
+        unsigned int bottom = to * layout.mcu_height;
+        STRIP       *strip = &strips[k];
+
+        if (y1 > layout.height) {
+            y1 = layout.height;
+        }
+        if (bottom > layout.height) {
+            bottom = layout.height;
+        }
+
+        strip->decode = decode;
+        strip->request = *request;
+        strip->request.v2.size = make_strip(&layout, from, to, &strip->jpeg);
+        if (!strip->request.v2.size) {
+            goto done;
+        }
+        strip->request.v2.image = strip->jpeg;
+        strip->request.v2.buffer = (unsigned char *)request->v2.buffer + (y0 * request->v2.stride);
+        strip->request.v2.height = bottom - (from * layout.mcu_height);
+        strip->request.v2.crop_y = y0 - (from * layout.mcu_height);
+        strip->request.v2.crop_height = y1 - y0;
+        strip->request.v2.completion_fd = -1;
+        strip->request.v2.priv = NULL;
+    }
+
+    pool_batch(decode_strip, strips, sizeof(STRIP), num);
+
+    status = JPEG_SUCCESS;
+    for (k = 0; k < num; k++) {
+        if (strips[k].status != JPEG_SUCCESS) {
+            status = strips[k].status;
+            break;
+        }
+    }
+
+done:
+    for (k = 0; k < num; k++) {
+        free(strips[k].jpeg);
+    }
+    free(strips);
+    free(layout.restarts);
+
+    return status;
+}
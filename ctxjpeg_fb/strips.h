@@ -0,0 +1,28 @@
+/***************************************************************************
+ *
+ * strips.h
+ *
+ * Decoding one large JPEG on several threads, split at restart markers.
+ *
+ ***************************************************************************/
+
+#ifndef STRIPS_H
+#define STRIPS_H
+
+#include "jpeg_decode.h"
+
+/* Images smaller than this are not worth splitting. */
+
+#define STRIPS_MIN_PIXELS   (256 * 1024)
+
+typedef int (*STRIP_DECODE)(struct JPEG_request *request);
+
+/* Decode an uncropped request as up to "max_strips" horizontal strips in
+ * parallel on the worker pool, each by calling "decode" with a request for
+ * a cropped part of a smaller JPEG. Returns a JPEG_* status, or -1 if the
+ * image can not be split, having done nothing.
+ */
+
+int strips_decode(struct JPEG_request *request, int max_strips, STRIP_DECODE decode);
+
+#endif /* STRIPS_H */
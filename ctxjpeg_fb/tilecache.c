@@ -0,0 +1,274 @@
+/***************************************************************************
+ *
+ * tilecache.c
+ *
+ * Servers often send byte-identical JPEG tiles again: toolbars, repeated
+ * thumbnails, and everything after a cache flush. When enabled, decoded
+ * pixels are kept, up to a memory budget, and a repeat becomes a copy.
+ *
+ * Entries are found by a hash of the compressed data, the crop and the
+ * output format, then checked against a copy of the data, so a hash
+ * collision can not return the wrong pixels. The least recently used
+ * entries are dropped to stay within the budget.
+ *
+ * A hit is pinned while its pixels are copied out, so that the copy is done
+ * without the lock and workers only queue on it for the lookup itself.
+ * Pinned entries are not evicted.
+ *
+ ***************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tilecache.h"
+
+#define TILECACHE_BUCKETS   4096        /* A power of 2. */
+
+typedef struct TILE {
+    struct TILE        *chain;          /* Next in hash bucket. */
+    struct TILE        *newer, *older;  /* LRU list. */
+    uint64_t            hash;
+    unsigned int        size;           /* Of the JPEG data. */
+    unsigned int        format;
+    unsigned int        crop_x, crop_y;
+    unsigned int        width, height;  /* Of the crop. */
+    size_t              bytes;          /* Of the whole entry. */
+    unsigned int        pins;           /* Lookups copying from it. */
+    unsigned char      *jpeg;
+    uint32_t           *pixels;         /* Rows of "width" pixels. */
+} TILE;
+
+static pthread_mutex_t  cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static TILE            *buckets[TILECACHE_BUCKETS];
+static TILE            *newest, *oldest;
+static struct ctxjpeg_fb_cache_stats stats;
+
+/* 64-bit multiply-rotate hash, a word at a time. */
+
+static inline uint64_t mix(uint64_t h, uint64_t k)
+{
+    k *= 0x87c37b91114253d5ULL;
+    k = (k << 31) | (k >> 33);
+    h ^= k * 0x4cf5ad432745937fULL;
+
+    return ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+}
+
+static uint64_t hash_request(const struct JPEG_request *request)
+{
+    const unsigned char *p = request->v2.image;
+    unsigned int         n = request->v2.size;
+    uint64_t             h = n, k;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&k, p, 8);
+        h = mix(h, k);
+    }
+    k = 0;
+    memcpy(&k, p, n);
+    h = mix(h, k);
+
+    h = mix(h, ((uint64_t)request->v2.crop_x << 32) | request->v2.crop_y);
+    h = mix(h, ((uint64_t)request->v2.crop_width << 32) | request->v2.crop_height);
+    h = mix(h, request->v2.format);
+
+    return h ^ (h >> 29);
+}
+
+static int matches(const TILE *tile, uint64_t hash, const struct JPEG_request *request)
+{
+    return tile->hash == hash &&
+           tile->size == request->v2.size &&
+           tile->format == request->v2.format &&
+           tile->crop_x == request->v2.crop_x &&
+           tile->crop_y == request->v2.crop_y &&
+           tile->width == request->v2.crop_width &&
+           tile->height == request->v2.crop_height &&
+           !memcmp(tile->jpeg, request->v2.image, tile->size);
+}
+
+/* Call with the lock held. */
+
+static TILE *find(uint64_t hash, const struct JPEG_request *request)
+{
+    TILE *tile;
+
+    for (tile = buckets[hash & (TILECACHE_BUCKETS - 1)]; tile; tile = tile->chain) {
+        if (matches(tile, hash, request)) {
+            break;
+        }
+    }
+
+    return tile;
+}
+
+static void unlink_lru(TILE *tile)
+{
+    if (tile->newer) {
+        tile->newer->older = tile->older;
+    } else {
+        newest = tile->older;
+    }
+    if (tile->older) {
+        tile->older->newer = tile->newer;
+    } else {
+        oldest = tile->newer;
+    }
+}
+
+static void link_newest(TILE *tile)
+{
+    tile->newer = NULL;
+    tile->older = newest;
+    if (newest) {
+        newest->newer = tile;
+    } else {
+        oldest = tile;
+    }
+    newest = tile;
+}
+
+static void evict(TILE *tile)
+{
+    TILE **link = &buckets[tile->hash & (TILECACHE_BUCKETS - 1)];
+
+    while (*link != tile) {
+        link = &(*link)->chain;
+    }
+    *link = tile->chain;
+    unlink_lru(tile);
+
+    stats.bytes_used -= tile->bytes;
+    stats.entries--;
+    stats.evictions++;
+    free(tile);
+}
+
+void tilecache_init(size_t budget)
+{
+    stats.budget = budget;
+}
+
+int tilecache_lookup(struct JPEG_request *request)
+{
+    uint64_t       hash;
+    TILE          *tile;
+    unsigned char *out;
+    size_t         row;
+    unsigned int   y;
+
+    if (!stats.budget || !request->v2.image) {
+        return 0;
+    }
+
+    hash = hash_request(request);
+
+    pthread_mutex_lock(&cache_lock);
+    stats.lookups++;
+
+    tile = find(hash, request);
+    if (!tile) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+
+    row = tile->width * 4;
+    tile->pins++;
+    unlink_lru(tile);
+    link_newest(tile);
+    stats.hits++;
+    stats.bytes_saved += row * tile->height;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    out = request->v2.buffer;
+    for (y = 0; y < tile->height; y++) {
+        memcpy(out, tile->pixels + (y * tile->width), row);
+        out += request->v2.stride;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    tile->pins--;
+    pthread_mutex_unlock(&cache_lock);
+
+    return 1;
+}
+
+void tilecache_insert(const struct JPEG_request *request)
+{
+    size_t         row = request->v2.crop_width * 4;
+    size_t         bytes = sizeof(TILE) + (row * request->v2.crop_height) + request->v2.size;
+    const uint8_t *in = request->v2.buffer;
+    uint64_t       hash;
+    TILE          *tile, *victim, *next;
+    unsigned int   y;
+
+    /* Don't let one image push out much of the cache. */
+    if (!stats.budget || !row || !request->v2.crop_height || bytes > stats.budget / 8) {
+        return;
+    }
+
+    tile = (TILE *)malloc(bytes);
+    if (!tile) {
+        return;
+    }
+
+    hash = hash_request(request);
+    tile->hash = hash;
+    tile->size = request->v2.size;
+    tile->format = request->v2.format;
+    tile->crop_x = request->v2.crop_x;
+    tile->crop_y = request->v2.crop_y;
+    tile->width = request->v2.crop_width;
+    tile->height = request->v2.crop_height;
+    tile->bytes = bytes;
+    tile->pins = 0;
+    tile->pixels = (uint32_t *)(tile + 1);
+    tile->jpeg = (unsigned char *)(tile->pixels + (tile->width * tile->height));
+
+    memcpy(tile->jpeg, request->v2.image, tile->size);
+    for (y = 0; y < tile->height; y++) {
+        memcpy(tile->pixels + (y * tile->width), in, row);
+        in += request->v2.stride;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    /* Another thread may have decoded the same tile meanwhile. */
+    if (find(hash, request)) {
+        pthread_mutex_unlock(&cache_lock);
+        free(tile);
+        return;
+    }
+
+    /* Drop the oldest that no lookup is copying from; without room, don't keep it. */
+    for (victim = oldest; stats.bytes_used + bytes > stats.budget; victim = next) {
+        while (victim && victim->pins) {
+            victim = victim->newer;
+        }
+        if (!victim) {
+            pthread_mutex_unlock(&cache_lock);
+            free(tile);
+            return;
+        }
+        next = victim->newer;
+        evict(victim);
+    }
+
+    tile->chain = buckets[hash & (TILECACHE_BUCKETS - 1)];
+    buckets[hash & (TILECACHE_BUCKETS - 1)] = tile;
+    link_newest(tile);
+    stats.bytes_used += bytes;
+    stats.entries++;
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void ctxjpeg_fb_cache_stats(struct ctxjpeg_fb_cache_stats *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,44 @@
+/***************************************************************************
+ *
+ * tilecache.h
+ *
+ * Cache of decoded JPEG tiles, keyed by the compressed data and the crop.
+ *
+ ***************************************************************************/
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <stddef.h>
+
+#include "jpeg_decode.h"
+
+/* Counters, for ctxjpeg_fb_cache_stats(). */
+
+struct ctxjpeg_fb_cache_stats {
+    unsigned long long  lookups;
+    unsigned long long  hits;
+    unsigned long long  bytes_saved;    /* Decoded pixel bytes copied on hits. */
+    unsigned long long  evictions;
+    size_t              bytes_used;
+    size_t              budget;
+    unsigned int        entries;
+};
+
+/* Enable the cache with a memory budget in bytes, 0 to leave it off. */
+
+void tilecache_init(size_t budget);
+
+/* Copy a cached decode of "request" into its buffer. Returns 0 on a miss. */
+
+int tilecache_lookup(struct JPEG_request *request);
+
+/* Remember the pixels just decoded for "request". */
+
+void tilecache_insert(const struct JPEG_request *request);
+
+/* Exported, for callers that look it up with dlsym(). */
+
+void ctxjpeg_fb_cache_stats(struct ctxjpeg_fb_cache_stats *stats);
+
+#endif /* TILECACHE_H */
@@ -0,0 +1,94 @@
+/***************************************************************************
+ *
+ * tjapi.c
+ *
+ * Whole-image decoding through the TurboJPEG API. One call decodes the
+ * image into the caller's buffer, letting libjpeg-turbo work on several
+ * rows at a time, where reading scanlines costs a call for each row.
+ *
+ * The library is loaded at run time, and only the entry points found in
+ * every version from 1.2 on, including 3.x, are used, so the plug-in does
+ * not depend on it or on its header.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include "tjapi.h"
+
+#define TJPF_RGBX   2               /* From turbojpeg.h. */
+#define TJPF_BGRX   3
+
+typedef void *tjhandle;
+
+static tjhandle (*tjInitDecompress)(void);
+static int      (*tjDecompressHeader3)(tjhandle handle,
+                                       const unsigned char *jpegBuf,
+                                       unsigned long jpegSize,
+                                       int *width, int *height,
+                                       int *jpegSubsamp, int *jpegColorspace);
+static int      (*tjDecompress2)(tjhandle handle,
+                                 const unsigned char *jpegBuf,
+                                 unsigned long jpegSize,
+                                 unsigned char *dstBuf,
+                                 int width, int pitch, int height,
+                                 int pixelFormat, int flags);
+static int      (*tjDestroy)(tjhandle handle);
+
+int tjapi_init(void)
+{
+    void *lib = dlopen("libturbojpeg.so.0", RTLD_NOW | RTLD_LOCAL);
+
+    if (!lib) {
+        return 0;
+    }
+
+    tjInitDecompress = dlsym(lib, "tjInitDecompress");
+    tjDecompressHeader3 = dlsym(lib, "tjDecompressHeader3");
+    tjDecompress2 = dlsym(lib, "tjDecompress2");
+    tjDestroy = dlsym(lib, "tjDestroy");
+
+    if (!tjInitDecompress || !tjDecompressHeader3 || !tjDecompress2 || !tjDestroy) {
+        dlclose(lib);
+        tjInitDecompress = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+void *tjapi_create(void)
+{
+    return tjInitDecompress ? tjInitDecompress() : NULL;
+}
+
+void tjapi_destroy(void *handle)
+{
+    if (handle) {
+        tjDestroy(handle);
+    }
+}
+
+int tjapi_decode(void *handle, struct JPEG_request *request, int xbgr)
+{
+    int width, height, subsamp, colorspace;
+
+    if (   request->v2.crop_x || request->v2.crop_y
+        || tjDecompressHeader3(handle, request->v2.image, request->v2.size,
+                               &width, &height, &subsamp, &colorspace) < 0
+        || (unsigned int)width != request->v2.crop_width
+        || (unsigned int)height != request->v2.crop_height) {
+        /* Cropped, or not understood. */
+
+        return 0;
+    }
+
+    /* Any error or warning, even if the image was decoded, is left for
+     * libjpeg to handle and report as it always has.
+     */
+
+    return tjDecompress2(handle, request->v2.image, request->v2.size,
+                         request->v2.buffer, width, request->v2.stride,
+                         height, xbgr ? TJPF_RGBX : TJPF_BGRX, 0) == 0;
+}
@@ -0,0 +1,32 @@
+/***************************************************************************
+ *
+ * tjapi.h
+ *
+ * Whole-image decoding through the TurboJPEG API, if libturbojpeg is
+ * installed.
+ *
+ ***************************************************************************/
+
+#ifndef TJAPI_H
+#define TJAPI_H
+
+#include "jpeg_decode.h"
+
+/* Load libturbojpeg. Returns 0 if it is not available. */
+
+int tjapi_init(void);
+
+/* Decompressor handles, one per thread as they can not be shared. */
+
+void *tjapi_create(void);
+void tjapi_destroy(void *handle);
+
+/* Decode an uncropped request straight into its buffer, as PIXEL_XBGR if
+ * "xbgr" is set and PIXEL_XRGB otherwise. Returns 0, having
+ * left the buffer in an unknown state, if the request was not handled and
+ * should be decoded with libjpeg instead.
+ */
+
+int tjapi_decode(void *handle, struct JPEG_request *request, int xbgr);
+
+#endif /* TJAPI_H */